@@ -0,0 +1,53 @@
+#! /usr/bin/env bash
+
+# Usage: ./bench_accept.sh [port] [connections] [loadgen options...]
+#
+# Times a connection storm (./loadgen -a): that many clients connecting
+# at once, each logging in and joining one of 100 rooms, against the
+# server with each engine and number of acceptor threads (-A) in turn.
+# It reports how long it took until every client had been answered,
+# and the latency from each client's connect until its join was
+# answered. The server and loadgen each need a descriptor per
+# connection, so "ulimit -n" has to allow a few more than that. Set
+# SERVER to benchmark a different server binary, ENGINES to choose the
+# engines, or ACCEPTORS to choose the numbers of acceptors.
+
+set -e
+
+if [[ $# -lt 2 ]]; then
+    echo "Usage: $0 [port] [connections] [loadgen options...]"
+    exit 1
+fi
+PORT=$1
+NUM=$2
+shift 2
+SERVER=${SERVER:-./server}
+ENGINES=${ENGINES:-"thread epoll"}
+ACCEPTORS=${ACCEPTORS:-"1 2 4"}
+
+ulimit -n 65536 2> /dev/null || true
+OUTPUT=$(mktemp)
+trap "rm -f ${OUTPUT}" EXIT
+
+printf "%7s %9s %9s %10s %10s %10s %7s\n" engine acceptors time_ms conns/sec p50_ms p99_ms errors
+for ENGINE in ${ENGINES}; do
+    for NUM_ACCEPTORS in ${ACCEPTORS}; do
+        ${SERVER} -e ${ENGINE} -A ${NUM_ACCEPTORS} ${PORT} 2> /dev/null &
+        SERVER_PID=$!
+        sleep 0.5
+
+        ./loadgen -a ${NUM} -m 100 "$@" localhost ${PORT} > ${OUTPUT} || true
+        kill ${SERVER_PID}
+        wait ${SERVER_PID} 2> /dev/null || true
+
+        printf "%7s %9d %9s %10s %10.1f %10.1f %7s\n" ${ENGINE} ${NUM_ACCEPTORS} \
+            $(awk '/^connected:/ { print $4 }' ${OUTPUT}) \
+            $(awk '/^connected:/ { gsub(/\(/, "", $6); print $6 }' ${OUTPUT}) \
+            $(awk '/^latency/ { print $4 / 1000 }' ${OUTPUT}) \
+            $(awk '/^latency/ { print $6 / 1000 }' ${OUTPUT}) \
+            $(awk '/^errors:/ { print $2 }' ${OUTPUT})
+
+        # let the old connections' ports be reused
+        sleep 1
+    done
+done
@@ -0,0 +1,68 @@
+#! /usr/bin/env bash
+
+# Usage: ./bench_engines.sh [port] [seconds] [loadgen options...]
+#
+# Runs the same load (./loadgen with the given options, for that many
+# seconds) against the server with each engine in turn: a thread per
+# client, epoll event loops, and io_uring event loops. For each one it
+# reports loadgen's throughput and latency, and the server's thread
+# count, CPU time and context switches (summed over its threads) per
+# thousand deliveries. Set SERVER to benchmark a different server
+# binary, or ENGINES to choose the engines.
+
+set -e
+
+if [[ $# -lt 2 || $2 -lt 3 ]]; then
+    echo "Usage: $0 [port] [seconds (at least 3)] [loadgen options...]"
+    exit 1
+fi
+PORT=$1
+SECS=$2
+shift 2
+SERVER=${SERVER:-./server}
+ENGINES=${ENGINES:-"thread epoll uring"}
+
+ulimit -n 65536 2> /dev/null || true
+OUTPUT=$(mktemp)
+trap "rm -f ${OUTPUT}" EXIT
+
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+context_switches() {
+    cat /proc/$1/task/*/status 2> /dev/null |
+        awk '/ctxt_switches/ { n += $2 } END { print n }'
+}
+
+printf "%7s %13s %13s %9s %9s %8s %11s %11s\n" engine sent/sec delivered/sec p50_us p99_us threads cpu_ms/1k csw/1k
+for ENGINE in ${ENGINES}; do
+    ${SERVER} -e ${ENGINE} ${PORT} 2> /dev/null &
+    SERVER_PID=$!
+    sleep 0.5
+
+    ./loadgen -d ${SECS} "$@" localhost ${PORT} > ${OUTPUT} &
+    LOADGEN_PID=$!
+
+    # the server's CPU time and context switches are measured while
+    # the load is steady: from a second in until a second before the end
+    sleep 1
+    THREADS=$(awk '/^Threads/ { print $2 }' /proc/${SERVER_PID}/status)
+    START_CPU=$(cpu_ticks ${SERVER_PID})
+    START_CSW=$(context_switches ${SERVER_PID})
+    sleep $(( SECS - 2 ))
+    CPU=$(( $(cpu_ticks ${SERVER_PID}) - START_CPU ))
+    CSW=$(( $(context_switches ${SERVER_PID}) - START_CSW ))
+    wait ${LOADGEN_PID}
+    kill ${SERVER_PID}
+    wait ${SERVER_PID} 2> /dev/null || true
+
+    SENT=$(awk '/^sent:/ { gsub(/\(/, "", $3); print $3 }' ${OUTPUT})
+    RATE=$(awk '/^delivered:/ { gsub(/\(/, "", $3); print $3 }' ${OUTPUT})
+    P50=$(awk '/^latency/ { print $4 }' ${OUTPUT})
+    P99=$(awk '/^latency/ { print $6 }' ${OUTPUT})
+    PER_K=$(awk "BEGIN { print ${RATE} * (${SECS} - 2) / 1000 }")
+    printf "%7s %13s %13s %9s %9s %8d %11.3f %11.2f\n" ${ENGINE} ${SENT} ${RATE} ${P50} ${P99} ${THREADS} \
+        $(awk "BEGIN { print ${CPU} * 1000 / $(getconf CLK_TCK) / ${PER_K} }") \
+        $(awk "BEGIN { print ${CSW} / ${PER_K} }")
+done
@@ -0,0 +1,48 @@
+#! /usr/bin/env bash
+
+# Usage: ./bench_idle.sh [port] [receivers] [seconds] [server options...]
+#
+# Starts a server, connects the given number of receivers to it (all
+# in one room, with nothing being sent), and reports how much CPU the
+# server burns while they sit idle. Set SERVER to benchmark a different
+# server binary (e.g. one built from an older revision).
+
+set -e
+
+if [[ $# -lt 3 ]]; then
+    echo "Usage: $0 [port] [receivers] [seconds] [server options...]"
+    exit 1
+fi
+PORT=$1
+NUM=$2
+SECS=$3
+shift 3
+SERVER=${SERVER:-./server}
+
+ulimit -n $((NUM * 3 + 256))
+${SERVER} "$@" ${PORT} &
+SERVER_PID=$!
+trap "kill ${SERVER_PID} 2> /dev/null" EXIT
+sleep 0.5
+
+# each receiver is just a socket held open by this shell
+echo "connecting ${NUM} receivers"
+for ((i = 0; i < NUM; i++)); do
+    exec {FD}<>/dev/tcp/localhost/${PORT}
+    printf 'rlogin:idle%d\njoin:idle\n' ${i} >&${FD}
+done
+sleep 2
+
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/${SERVER_PID}/stat
+}
+
+START=$(cpu_ticks)
+sleep ${SECS}
+END=$(cpu_ticks)
+
+TICKS=$(getconf CLK_TCK)
+echo "server threads: $(ls /proc/${SERVER_PID}/task | wc -l)"
+echo "server $(grep VmRSS /proc/${SERVER_PID}/status)"
+echo "server $(grep VmSize /proc/${SERVER_PID}/status)"
+echo "server CPU while idle: $(( (END - START) * 1000 / TICKS )) ms over ${SECS} s"
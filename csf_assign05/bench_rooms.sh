@@ -0,0 +1,54 @@
+#! /usr/bin/env bash
+
+# Usage: ./bench_rooms.sh [port] [rounds] [rooms per round] [server options...]
+#
+# Soak test for room reclamation: starts a server, and in each round
+# has a (pipelining) sender join that many new rooms, one after the
+# other, while a few receivers join rooms of their own and then leave.
+# Every room is empty by the end of its round, so the server's memory
+# (resident set size, printed after each round) should stay flat
+# rather than grow with the number of rooms ever used. Set SERVER to
+# run a different server binary, and SEND=1 to have the sender send a
+# message to each room (giving it history, with -H or -L).
+
+set -e
+
+if [[ $# -lt 3 ]]; then
+    echo "Usage: $0 [port] [rounds] [rooms per round] [server options...]"
+    exit 1
+fi
+PORT=$1
+ROUNDS=$2
+NUM=$3
+shift 3
+SERVER=${SERVER:-./server}
+NUM_RECEIVERS=10
+
+${SERVER} "$@" ${PORT} &
+SERVER_PID=$!
+INPUT=$(mktemp)
+trap "kill ${SERVER_PID} 2> /dev/null; rm -f ${INPUT}" EXIT
+sleep 0.5
+
+printf "%6s %12s %10s\n" round rooms rss_kb
+for ROUND in $(seq 1 ${ROUNDS}); do
+    RECEIVER_PIDS=""
+    for I in $(seq 1 ${NUM_RECEIVERS}); do
+        ./receiver localhost ${PORT} soak${I} round${ROUND}x${I} > /dev/null &
+        RECEIVER_PIDS="${RECEIVER_PIDS} $!"
+    done
+
+    if [[ -n "${SEND}" ]]; then
+        seq -f "/join round${ROUND}x%g" ${NUM} | sed 's/$/\nhello/' > ${INPUT}
+    else
+        seq -f "/join round${ROUND}x%g" ${NUM} > ${INPUT}
+    fi
+    echo "/quit" >> ${INPUT}
+    ./sender -w 256 localhost ${PORT} soak < ${INPUT}
+
+    kill ${RECEIVER_PIDS}
+    wait ${RECEIVER_PIDS} 2> /dev/null || true
+    sleep 0.2
+    RSS=$(awk '/^VmRSS/ { print $2 }' /proc/${SERVER_PID}/status)
+    printf "%6d %12d %10d\n" ${ROUND} $(( ROUND * NUM )) ${RSS}
+done
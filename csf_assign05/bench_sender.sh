@@ -0,0 +1,44 @@
+#! /usr/bin/env bash
+
+# Usage: ./bench_sender.sh [port] [messages] [server options...]
+#
+# Starts a server and times ./sender sending a file of messages to a
+# room, waiting for each response before sending the next message and
+# then pipelined (-w) with a few window sizes. Set SERVER to benchmark
+# a different server binary (e.g. one built from an older revision).
+
+set -e
+
+if [[ $# -lt 2 ]]; then
+    echo "Usage: $0 [port] [messages] [server options...]"
+    exit 1
+fi
+PORT=$1
+NUM=$2
+shift 2
+SERVER=${SERVER:-./server}
+
+${SERVER} "$@" ${PORT} &
+SERVER_PID=$!
+INPUT=$(mktemp)
+trap "kill ${SERVER_PID} 2> /dev/null; rm -f ${INPUT}" EXIT
+sleep 0.5
+
+echo "/join bulk" > ${INPUT}
+seq -f "bulk message number %g" ${NUM} >> ${INPUT}
+echo "/quit" >> ${INPUT}
+
+printf "%8s %14s\n" window messages/sec
+for WINDOW in 0 1 16 64 256; do
+    if [[ ${WINDOW} -eq 0 ]]; then
+        ARGS=""
+        LABEL=none
+    else
+        ARGS="-w ${WINDOW}"
+        LABEL=${WINDOW}
+    fi
+    START=$(date +%s%N)
+    ./sender ${ARGS} localhost ${PORT} bulk${WINDOW} < ${INPUT}
+    END=$(date +%s%N)
+    printf "%8s %14d\n" ${LABEL} $(( NUM * 1000000000 / (END - START) ))
+done
@@ -22,3 +22,16 @@ std::string rtrim(const std::string &s) {
 std::string trim(const std::string &s) {
   return rtrim(ltrim(s));
 }
+
+bool use_binary_protocol(Connection &conn) {
+  //the request and its reply are the last text messages
+  Message response;
+  if (!conn.send(Message(TAG_PROTO, "binary")) || !conn.receive(response)) {
+    return false;
+  }
+  if (response.tag != TAG_OK) {
+    return false;
+  }
+  conn.set_protocol(PROTO_BINARY);
+  return true;
+}
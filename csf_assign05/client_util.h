@@ -14,4 +14,8 @@ std::string trim(const std::string &s);
 
 // you can add additional declarations here...
 
+// ask the server to switch to the binary protocol, and switch conn to
+// it if the server agrees (returns false if it doesn't)
+bool use_binary_protocol(Connection &conn);
+
 #endif // CLIENT_UTIL_H
@@ -3,18 +3,65 @@
 #include <cctype>
 #include <cassert>
 #include <cstring>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <sys/uio.h>
 #include "csapp.h"
 #include "message.h"
+#include "frame.h"
+#include "pool.h"
 #include "connection.h"
 
+namespace {
+
+// the tags with binary protocol ids, indexed by id
+const char *const TAG_NAMES[] = {
+  nullptr, TAG_ERR, TAG_OK, TAG_SLOGIN, TAG_RLOGIN, TAG_JOIN, TAG_LEAVE,
+  TAG_SENDALL, TAG_SENDUSER, TAG_QUIT, TAG_DELIVERY, TAG_EMPTY, TAG_PROTO,
+};
+const unsigned NUM_TAG_NAMES = sizeof(TAG_NAMES) / sizeof(TAG_NAMES[0]);
+
+// parse a binary message header, returning its length, 0 if it isn't
+// all there yet, or -1 if it is invalid
+ssize_t decode_header(const char *buf, size_t len, unsigned &id, size_t &data_len) {
+  if (len < 1) {
+    return 0;
+  }
+  id = static_cast<unsigned char>(buf[0]);
+
+  //the data length is a varint: 7 bits per byte, least significant
+  //first, with the high bit set on all but the last byte
+  size_t value = 0;
+  for (size_t i = 1; i < Connection::MAX_BINARY_HEADER; i++) {
+    if (i >= len) {
+      return 0;
+    }
+    unsigned char byte = buf[i];
+    value |= (size_t)(byte & 0x7f) << (7 * (i - 1));
+    if (!(byte & 0x80)) {
+      if (value > Message::MAX_BINARY_LEN) {
+        return -1;
+      }
+      data_len = value;
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+}
+
 Connection::Connection()
   : m_fd(-1)
-  , m_last_result(SUCCESS) {
+  , m_last_result(SUCCESS)
+  , m_protocol(PROTO_TEXT) {
 }
 
 Connection::Connection(int fd)
   : m_fd(fd)
-  , m_last_result(SUCCESS) {
+  , m_last_result(SUCCESS)
+  , m_protocol(PROTO_TEXT) {
   rio_readinitb(&m_fdbuf, m_fd); //initialize read buffer
 }
 
@@ -29,6 +76,25 @@ void Connection::connect(const std::string &hostname, int port) {
   rio_readinitb(&m_fdbuf, m_fd);
 }
 
+namespace {
+
+// the pool for Connections (which are too big for the size classes)
+Pool &connection_pool() {
+  static Pool pool(sizeof(Connection));
+  return pool;
+}
+
+}
+
+void *Connection::operator new(size_t size) {
+  assert(size == sizeof(Connection));
+  return connection_pool().allocate();
+}
+
+void Connection::operator delete(void *p) {
+  connection_pool().deallocate(p);
+}
+
 Connection::~Connection() {
   close(); //close connection
 }
@@ -52,20 +118,28 @@ bool Connection::send(const Message &msg) {
     return false;
   }
 
-  //encode message with tag and data
-  std::string encoded = msg.tag + ":" + msg.data + "\n";
-  
-  //check if message length valid
-  if (encoded.length() > Message::MAX_LEN) {
+  if (m_protocol == PROTO_BINARY) {
+    return send_binary(msg);
+  }
+
+  //encode message with tag and data, check if message length valid
+  //(on the stack, so that sending doesn't allocate)
+  size_t len = msg.tag.size() + 1 + msg.data.size() + 1;
+  if (len > Message::MAX_LEN) {
     m_last_result = INVALID_MSG;
     return false;
   }
+  char encoded[Message::MAX_LEN];
+  memcpy(encoded, msg.tag.data(), msg.tag.size());
+  encoded[msg.tag.size()] = ':';
+  memcpy(encoded + msg.tag.size() + 1, msg.data.data(), msg.data.size());
+  encoded[len - 1] = '\n';
 
   //send message
-  ssize_t n = rio_writen(m_fd, encoded.c_str(), encoded.length());
+  ssize_t n = rio_writen(m_fd, encoded, len);
 
   //check if message sent successfully, if not throw error
-  if (n < 0 || (size_t)n != encoded.length()) {
+  if (n < 0 || (size_t)n != len) {
     m_last_result = EOF_OR_ERROR;
     return false;
   }
@@ -75,58 +149,422 @@ bool Connection::send(const Message &msg) {
   return true;
 }
 
-//if connectio not open, throw error
-bool Connection::receive(Message &msg) {
+bool Connection::send(const Frame &frame) {
   if (!is_open()) {
     m_last_result = EOF_OR_ERROR;
     return false;
   }
 
-  //create buffer to store message (+1 to includ newline character)
-  char buf[Message::MAX_LEN + 1];
-  //read message from connection
-  ssize_t n = rio_readlineb(&m_fdbuf, buf, Message::MAX_LEN + 1);
-  
-  //if message not read successfully, throw error
-  if (n <= 0) { 
+  //frame is already encoded, but maybe not in this protocol (it can't
+  //be if it's too long)
+  size_t size = frame.size(m_protocol);
+  if (size == 0) {
+    m_last_result = INVALID_MSG;
+    return false;
+  }
+
+  ssize_t n = rio_writen(m_fd, frame.data(m_protocol), size);
+  if (n < 0 || (size_t)n != size) {
     m_last_result = EOF_OR_ERROR;
     return false;
   }
 
-  //trim off newline chars
-  std::string line(buf);
-  //while line not empty and last character is newline or carriage return, remove last char
-  while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
-    line.pop_back();
+  m_last_result = SUCCESS;
+  return true;
+}
+
+bool Connection::send(Frame *const *frames, size_t count) {
+  if (!is_open()) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
   }
 
-  // Check if message is empty (invalid)
-  if (line.empty()) {
-    m_last_result = INVALID_MSG;
+  //gather as many frames as writev accepts into each write
+  struct iovec iov[IOV_MAX];
+  size_t next = 0;
+  size_t skipped = 0;
+  while (next < count) {
+    int niov = 0;
+    while (next < count && niov < IOV_MAX) {
+      //a frame that can't be encoded in this connection's protocol
+      //(a binary message too long for a text client) is skipped
+      size_t size = frames[next]->size(m_protocol);
+      if (size > 0) {
+        iov[niov].iov_base = const_cast<char *>(frames[next]->data(m_protocol));
+        iov[niov].iov_len = size;
+        niov++;
+      } else {
+        skipped++;
+      }
+      next++;
+    }
+
+    if (niov > 0 && !writev_all(iov, niov)) {
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+  }
+
+  m_last_result = skipped > 0 ? INVALID_MSG : SUCCESS;
+  return skipped == 0;
+}
+
+bool Connection::send(const Message *msgs, size_t count) {
+  if (!is_open()) {
+    m_last_result = EOF_OR_ERROR;
     return false;
   }
 
-  // Check if message is too long (including newline that was removed)
-  // The original message with newline should be <= MAX_LEN
-  if (n > (ssize_t)Message::MAX_LEN) {
-    m_last_result = INVALID_MSG;
+  //encode them all into one buffer (which keeps its memory between
+  //calls), with the same limits as sending them one at a time
+  m_out.clear();
+  size_t skipped = 0;
+  for (size_t i = 0; i < count; i++) {
+    const Message &msg = msgs[i];
+    if (m_protocol == PROTO_BINARY) {
+      unsigned id = tag_id(msg.tag);
+      if (id == 0 || msg.data.size() > Message::MAX_BINARY_LEN) {
+        skipped++;
+        continue;
+      }
+      char header[MAX_BINARY_HEADER];
+      m_out.append(header, encode_binary_header(id, msg.data.size(), header));
+      m_out += msg.data;
+    } else {
+      if (msg.tag.size() + 1 + msg.data.size() + 1 > Message::MAX_LEN) {
+        skipped++;
+        continue;
+      }
+      m_out += msg.tag;
+      m_out += ':';
+      m_out += msg.data;
+      m_out += '\n';
+    }
+  }
+
+  if (!m_out.empty() && rio_writen(m_fd, &m_out[0], m_out.size()) != (ssize_t)m_out.size()) {
+    m_last_result = EOF_OR_ERROR;
     return false;
   }
+  m_last_result = skipped > 0 ? INVALID_MSG : SUCCESS;
+  return skipped == 0;
+}
 
-  //find colon in message and split message into tag and data
-  size_t colon_pos = line.find(':');
-  //if no colon, throw error
-  if (colon_pos == std::string::npos) {
+bool Connection::has_buffered_message() const {
+  const rio_t *rp = &m_fdbuf;
+  if (m_protocol == PROTO_BINARY) {
+    unsigned id;
+    size_t len;
+    ssize_t header_len = decode_header(rp->rio_bufptr, rp->rio_cnt, id, len);
+    //(an invalid header is as good as a message: receiving fails at once)
+    return header_len < 0 || (header_len > 0 && header_len + len <= (size_t)rp->rio_cnt);
+  }
+  //a line longer than MAX_LEN is received MAX_LEN characters at a time
+  if (rp->rio_cnt >= (int)Message::MAX_LEN) {
+    return true;
+  }
+  return memchr(rp->rio_bufptr, '\n', rp->rio_cnt) != nullptr;
+}
+
+bool Connection::send_binary(const Message &msg) {
+  unsigned id = tag_id(msg.tag);
+  if (id == 0 || msg.data.size() > Message::MAX_BINARY_LEN) {
     m_last_result = INVALID_MSG;
     return false;
   }
 
-  //everything before colon is tag
-  msg.tag = line.substr(0, colon_pos);
-  //everything after colon is data
-  msg.data = line.substr(colon_pos + 1);
+  //the header goes on the stack, and the data is written from msg
+  char header[MAX_BINARY_HEADER];
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = encode_binary_header(id, msg.data.size(), header);
+  iov[1].iov_base = const_cast<char *>(msg.data.data());
+  iov[1].iov_len = msg.data.size();
+  if (!writev_all(iov, 2)) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+
+  m_last_result = SUCCESS;
+  return true;
+}
+
+bool Connection::writev_all(struct iovec *iov, int niov) {
+  //keep going until everything is written, like rio_writen
+  while (niov > 0) {
+    ssize_t n = writev(m_fd, iov, niov);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    //skip over what was written
+    while (niov > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if (niov > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+//if connectio not open, throw error
+bool Connection::receive(Message &msg) {
+  //parse in place, then copy out the tag and data
+  MessageView view;
+  if (!receive_view(view)) {
+    return false;
+  }
+  msg.tag.assign(view.tag.data, view.tag.len);
+  msg.data.assign(view.data.data, view.data.len);
+  return true;
+}
+
+bool Connection::receive_view(MessageView &msg) {
+  if (!is_open()) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+
+  if (m_protocol == PROTO_BINARY) {
+    return receive_binary(msg);
+  }
+
+  //read message from connection (it stays in the rio_t buffer)
+  const char *line;
+  ssize_t n = read_line(&line);
+
+  //if message not read successfully, throw error
+  if (n <= 0) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+
+  //split message into tag and data
+  if (decode(line, n, msg) != SUCCESS) {
+    m_last_result = INVALID_MSG;
+    return false;
+  }
 
   //successful receival
   m_last_result = SUCCESS;
   return true;
 }
+
+ssize_t Connection::read_line(const char **line) {
+  //lines are split up exactly as rio_readlineb(..., MAX_LEN + 1) would:
+  //a line is at most MAX_LEN characters including its newline, and a
+  //longer one is returned MAX_LEN characters at a time
+  rio_t *rp = &m_fdbuf;
+  size_t scanned = 0;
+  size_t len;
+  while (true) {
+    size_t avail = rp->rio_cnt < (int)Message::MAX_LEN ? rp->rio_cnt : Message::MAX_LEN;
+    const char *nl = static_cast<const char *>(memchr(rp->rio_bufptr + scanned, '\n', avail - scanned));
+    if (nl) {
+      len = nl - rp->rio_bufptr + 1;
+      break;
+    }
+    if (avail == Message::MAX_LEN) {
+      len = avail;
+      break;
+    }
+    scanned = avail;
+
+    //the line isn't all there yet: move what there is of it to the
+    //front of the buffer, and read more after it
+    if (rp->rio_bufptr != rp->rio_buf) {
+      memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+      rp->rio_bufptr = rp->rio_buf;
+    }
+    ssize_t n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      //EOF: a last line without a newline still counts
+      len = rp->rio_cnt;
+      break;
+    }
+    rp->rio_cnt += n;
+  }
+
+  *line = rp->rio_bufptr;
+  rp->rio_bufptr += len;
+  rp->rio_cnt -= len;
+  return len;
+}
+
+bool Connection::receive_binary(MessageView &msg) {
+  rio_t *rp = &m_fdbuf;
+
+  //read until the whole header is buffered
+  unsigned id;
+  size_t len;
+  ssize_t header_len;
+  while ((header_len = decode_header(rp->rio_bufptr, rp->rio_cnt, id, len)) == 0) {
+    if (!fill(rp->rio_cnt + 1)) {
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+  }
+  //with a bad header there's no telling where the next message starts
+  if (header_len < 0) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+
+  const char *data;
+  if (header_len + len <= sizeof(rp->rio_buf)) {
+    //the usual case: the data is parsed in place
+    if (!fill(header_len + len)) {
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+    data = rp->rio_bufptr + header_len;
+    rp->rio_bufptr += header_len + len;
+    rp->rio_cnt -= header_len + len;
+  } else {
+    //data too big for the buffer is collected in m_payload
+    rp->rio_bufptr += header_len;
+    rp->rio_cnt -= header_len;
+    m_payload.resize(len);
+    size_t have = std::min((size_t)rp->rio_cnt, len);
+    memcpy(&m_payload[0], rp->rio_bufptr, have);
+    rp->rio_bufptr += have;
+    rp->rio_cnt -= have;
+    if (rio_readnb(rp, &m_payload[have], len - have) != (ssize_t)(len - have)) {
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+    data = m_payload.data();
+  }
+
+  msg.tag = tag_name(id);
+  msg.data = Slice(data, len);
+  m_last_result = SUCCESS;
+  return true;
+}
+
+size_t Connection::take_input(char *buf, size_t size) {
+  rio_t *rp = &m_fdbuf;
+  size_t n = std::min((size_t)rp->rio_cnt, size);
+  memcpy(buf, rp->rio_bufptr, n);
+  rp->rio_bufptr += n;
+  rp->rio_cnt -= n;
+  return n;
+}
+
+bool Connection::fill(size_t n) {
+  rio_t *rp = &m_fdbuf;
+  while ((size_t)rp->rio_cnt < n) {
+    //make room after the unread bytes
+    if (rp->rio_bufptr + n > rp->rio_buf + sizeof(rp->rio_buf)) {
+      memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+      rp->rio_bufptr = rp->rio_buf;
+    }
+    char *end = rp->rio_bufptr + rp->rio_cnt;
+    ssize_t r = read(rp->rio_fd, end, rp->rio_buf + sizeof(rp->rio_buf) - end);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    rp->rio_cnt += r;
+  }
+  return true;
+}
+
+unsigned Connection::tag_id(const Slice &tag) {
+  for (unsigned id = 1; id < NUM_TAG_NAMES; id++) {
+    if (tag == TAG_NAMES[id]) {
+      return id;
+    }
+  }
+  return 0;
+}
+
+Slice Connection::tag_name(unsigned id) {
+  if (id == 0 || id >= NUM_TAG_NAMES) {
+    return Slice();
+  }
+  return Slice(TAG_NAMES[id], strlen(TAG_NAMES[id]));
+}
+
+size_t Connection::encode_binary_header(unsigned id, size_t len, char *buf) {
+  char *p = buf;
+  *p++ = (char)id;
+  do {
+    unsigned char byte = len & 0x7f;
+    len >>= 7;
+    if (len > 0) {
+      byte |= 0x80;
+    }
+    *p++ = (char)byte;
+  } while (len > 0);
+  return p - buf;
+}
+
+ssize_t Connection::decode_binary(const char *buf, size_t len, MessageView &msg) {
+  unsigned id;
+  size_t data_len;
+  ssize_t header_len = decode_header(buf, len, id, data_len);
+  if (header_len <= 0) {
+    return header_len;
+  }
+  if (header_len + data_len > len) {
+    return 0;
+  }
+  msg.tag = tag_name(id);
+  msg.data = Slice(buf + header_len, data_len);
+  return header_len + data_len;
+}
+
+bool Connection::encode(const Message &msg, std::string &encoded) {
+  encoded = msg.tag + ":" + msg.data + "\n";
+  return encoded.length() <= Message::MAX_LEN;
+}
+
+Connection::Result Connection::decode(const char *line, size_t len, Message &msg) {
+  MessageView view;
+  Result result = decode(line, len, view);
+  if (result == SUCCESS) {
+    msg.tag.assign(view.tag.data, view.tag.len);
+    msg.data.assign(view.data.data, view.data.len);
+  }
+  return result;
+}
+
+Connection::Result Connection::decode(const char *line, size_t len, MessageView &msg) {
+  //trim off newline chars
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+    len--;
+  }
+
+  // Check if message is empty (invalid)
+  if (len == 0) {
+    return INVALID_MSG;
+  }
+
+  //find colon in message and split message into tag and data
+  const char *colon = static_cast<const char *>(memchr(line, ':', len));
+  //if no colon, message is invalid
+  if (!colon) {
+    return INVALID_MSG;
+  }
+
+  //everything before colon is tag
+  msg.tag = Slice(line, colon - line);
+  //everything after colon is data
+  msg.data = Slice(colon + 1, line + len - (colon + 1));
+  return SUCCESS;
+}
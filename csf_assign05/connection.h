@@ -1,8 +1,10 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <string>
 #include "csapp.h"
-struct Message;
+#include "message.h"
+class Frame;
 
 class Connection {
 public:
@@ -27,6 +29,11 @@ public:
   // Destructor. Should make sure that the file descriptor is closed.
   ~Connection();
 
+  // the server allocates a Connection for every client, and they are
+  // big (because of the read buffer), so they are pooled
+  static void *operator new(size_t size);
+  static void operator delete(void *p);
+
   // Connect to a server via specified hostname and port number.
   void connect(const std::string &hostname, int port);
 
@@ -41,18 +48,98 @@ public:
   bool send(const Message &msg);
   bool receive(Message &msg);
 
+  // receive a message without copying it: msg's tag and data point
+  // into this connection's input buffer, so they are only valid until
+  // the next call to receive or receive_view
+  bool receive_view(MessageView &msg);
+
+  // send a frame that is already encoded
+  bool send(const Frame &frame);
+
+  // send several encoded frames with as few writes (writev) as
+  // possible; on failure, an unknown prefix of them may have been sent.
+  // A frame that can't be encoded in this protocol is skipped, but the
+  // others are still sent, and then the call fails with INVALID_MSG
+  bool send(Frame *const *frames, size_t count);
+
+  // send several messages in one write (a message that can't be
+  // encoded is skipped and fails the call, as for frames)
+  bool send(const Message *msgs, size_t count);
+
+  // true if a whole message has already been read from the socket, so
+  // receiving it won't block
+  bool has_buffered_message() const;
+
   Result get_last_result() const { return m_last_result; }
 
+  // move (up to size bytes of) the input that has been read from the
+  // socket but not yet received into buf, returning how many bytes
+  // there were: for a caller switching to its own buffering
+  size_t take_input(char *buf, size_t size);
+
+  int get_fd() const { return m_fd; }
+
+  // the wire protocol used for sending and receiving (text at first)
+  Protocol get_protocol() const { return m_protocol; }
+  void set_protocol(Protocol protocol) { m_protocol = protocol; }
+
+  // a binary message's header (tag id and data length) takes at
+  // most this many bytes
+  enum { MAX_BINARY_HEADER = 4 };
+
+  // the binary protocol's id for a tag, 0 if it has none
+  static unsigned tag_id(const Slice &tag);
+
+  // the tag with the given id, an empty Slice if there is none
+  static Slice tag_name(unsigned id);
+
+  // encode the header of a binary message into buf (which must have
+  // room for MAX_BINARY_HEADER bytes), returning its length
+  static size_t encode_binary_header(unsigned id, size_t len, char *buf);
+
+  // parse one binary message from the len bytes at buf into msg (whose
+  // tag is empty if the id is unknown), returning how many bytes it
+  // took up, 0 if it isn't all there yet, or -1 if the header is
+  // invalid (in which case the stream can't be parsed any further)
+  static ssize_t decode_binary(const char *buf, size_t len, MessageView &msg);
+
+  // encode msg as one line of the text protocol ("tag:data\n"),
+  // returns false if it would be longer than Message::MAX_LEN
+  static bool encode(const Message &msg, std::string &encoded);
+
+  // parse one line of the text protocol (with or without its trailing
+  // newline) into msg, returns SUCCESS or INVALID_MSG
+  static Result decode(const char *line, size_t len, Message &msg);
+
+  // same, but msg's tag and data point into line
+  static Result decode(const char *line, size_t len, MessageView &msg);
+
 private:
   // prohibit value semantics
   Connection(const Connection &);
   Connection &operator=(const Connection &);
 
+  bool writev_all(struct iovec *iov, int niov);
+
+  // find the next line in the input buffer (reading more if necessary)
+  // and consume it, returning its length (0 at EOF, -1 on error)
+  ssize_t read_line(const char **line);
+
+  bool send_binary(const Message &msg);
+  bool receive_binary(MessageView &msg);
+
+  // read until the input buffer holds at least n bytes
+  // (n <= RIO_BUFSIZE), returns false at EOF or on error
+  bool fill(size_t n);
+
   // these are the recommended member variables for the
   // Connection class
   int m_fd;
   rio_t m_fdbuf; // used to allow buffered input
   Result m_last_result;
+  Protocol m_protocol;
+  std::string m_payload; // binary data too big for m_fdbuf
+  std::string m_out;     // messages being sent together
 };
 
 #endif // CONNECTION_H
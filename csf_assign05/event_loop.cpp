@@ -0,0 +1,980 @@
+#include <string>
+#include <deque>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include "message.h"
+#include "frame.h"
+#include "message_queue.h"
+#include "connection.h"
+#include "user.h"
+#include "session.h"
+#include "guard.h"
+#include "server.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "pool.h"
+#include "uring.h"
+
+////////////////////////////////////////////////////////////////////////
+// EventClient: per-client state for the epoll engine
+////////////////////////////////////////////////////////////////////////
+
+// stop pulling deliveries from a receiver's queue once this many bytes
+// are waiting to be written to its socket
+static const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+// stop reading from a sender waiting for the message log once this many
+// bytes of its input are waiting to be processed
+static const size_t INPUT_HIGH_WATER = 64 * 1024;
+
+static const int MAX_EVENTS = 64;
+
+// io_uring: submission queue size, and the buffers recvs take from
+// (enough for a few reads by each of a batch of clients)
+static const unsigned RING_ENTRIES = 1024;
+static const unsigned NUM_RECV_BUFFERS = 512;
+static const unsigned RECV_BUFFER_SIZE = 4096;
+static const uint16_t RECV_BUFFER_GROUP = 0;
+
+// what a completion is for: the low bits of its user_data (the rest
+// is the client, or nullptr for the wakeup eventfd's poll and for
+// cancellations, which need nothing done when they complete)
+static const uint64_t OP_RECV = 1;
+static const uint64_t OP_WRITE = 2;
+static const uint64_t OP_CANCEL = 3;
+static const uint64_t OP_MASK = 3;
+
+// a frame waiting to be written, in the encoding for the protocol the
+// client was using when it was queued
+struct OutFrame {
+  Frame *frame;
+  const char *data;
+  size_t size;
+};
+
+class EventClient : public MessageQueueListener {
+public:
+  EventClient(EventLoop *loop, Server *server, int fd)
+      : loop(loop), fd(fd), session(server), protocol(PROTO_TEXT),
+        out_offset(0), out_bytes(0), held_close(false), waiting(false),
+        closing(false), eof(false), want_read(true), want_write(false),
+        events(EPOLLIN | EPOLLRDHUP), scheduled(false),
+        recv_armed(false), recv_cancelled(false), write_pending(false), closed(false),
+        write_start(0) { }
+
+  virtual ~EventClient()
+  {
+    for (OutFrame &entry : out)
+      entry.frame->unref();
+  }
+
+  static void *operator new(size_t size) { return Pool::allocate(size); }
+  static void operator delete(void *p, size_t size) { Pool::deallocate(p, size); }
+
+  // called by a sender's thread when a message is added to the
+  // (receiving) user's empty queue, or when the queue is closed
+  virtual void message_available() { loop->schedule(this); }
+
+  EventLoop *loop;
+  int fd;
+  Session session;
+  Protocol protocol;    // protocol used for input and (new) output
+  std::string in;       // received bytes not yet processed
+  std::deque<OutFrame, PoolAllocator<OutFrame> > out; // frames not yet (completely) written
+  size_t out_offset;    // how much of the first frame has been written
+  size_t out_bytes;     // total size of the frames in out
+  ReplyBatch held;      // replies waiting for the message log
+  bool held_close;      // close once the held replies are sent
+  bool waiting;         // in the loop's list of clients waiting for the log
+  bool closing;         // close once out has been written
+  bool eof;             // input has ended (close once done waiting)
+  bool want_read;       // still reading input (until EOF)
+  bool want_write;      // waiting for the socket to become writable
+  unsigned events;      // events currently registered with epoll
+  bool scheduled;       // on the loop's ready list (guarded by its lock)
+
+  // io_uring only
+  bool recv_armed;      // a (multishot) recv is outstanding
+  bool recv_cancelled;  // and has been cancelled (see update_events)
+  bool write_pending;   // a writev is outstanding (of iov, which
+                        // points into the first frames in out)
+  bool closed;          // closed, but waiting for the above to complete
+  int64_t write_start;
+  std::vector<struct iovec> iov;
+};
+
+////////////////////////////////////////////////////////////////////////
+// EventLoop member function implementation
+////////////////////////////////////////////////////////////////////////
+
+EventLoop::EventLoop(Server *server, bool use_uring)
+    : m_server(server), m_ring(use_uring ? new Ring : nullptr), m_epfd(-1), m_wakefd(-1), m_woken(false), m_num_waiting(0),
+      m_num_clients(0), m_num_closed(0), m_drain(RUNNING), m_drain_started(RUNNING),
+      m_senders_left(0), m_clients_left(0)
+{
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+EventLoop::~EventLoop()
+{
+  if (m_wakefd >= 0)
+    close(m_wakefd);
+  if (m_epfd >= 0)
+    close(m_epfd);
+  delete m_ring;
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool EventLoop::start()
+{
+  m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakefd < 0)
+    return false;
+  if (m_ring)
+  {
+    if (!m_ring->init(RING_ENTRIES) ||
+        !m_ring->init_buffers(NUM_RECV_BUFFERS, RECV_BUFFER_SIZE, RECV_BUFFER_GROUP))
+      return false;
+    arm_wakeup();
+  }
+  else
+  {
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0)
+      return false;
+
+    //the wakeup eventfd is the only registration without a client pointer
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) < 0)
+      return false;
+  }
+
+  if (pthread_create(&m_thread, nullptr, run, this) != 0)
+    return false;
+  //(only a loop that started can be a listener, which is never removed)
+  if (m_server->get_log())
+    m_server->get_log()->add_listener(this);
+  return true;
+}
+
+void EventLoop::add_client(int fd)
+{
+  m_num_clients.fetch_add(1);
+  {
+    Guard g(m_lock);
+    m_new_fds.push_back(fd);
+  }
+  wake();
+}
+
+void EventLoop::schedule(EventClient *client)
+{
+  {
+    Guard g(m_lock);
+    if (client->scheduled)
+      return;
+    client->scheduled = true;
+    m_ready.push_back(client);
+  }
+  wake();
+}
+
+void EventLoop::log_flushed()
+{
+  if (m_num_waiting.load() > 0)
+    wake();
+}
+
+void EventLoop::drain(Drain phase)
+{
+  m_drain.store(phase);
+  wake();
+}
+
+int EventLoop::get_drain_left(Drain phase) const
+{
+  if (m_drain_started.load() < phase)
+    return -1;
+  return phase == STOP_SENDERS ? m_senders_left.load() : m_clients_left.load();
+}
+
+void EventLoop::join()
+{
+  pthread_join(m_thread, nullptr);
+}
+
+void *EventLoop::run(void *arg)
+{
+  static_cast<EventLoop *>(arg)->loop();
+  return nullptr;
+}
+
+void EventLoop::loop()
+{
+  struct epoll_event events[MAX_EVENTS];
+  while (true)
+  {
+    bool woken = false;
+    if (m_ring)
+    {
+      if (!wait_ring(woken))
+        break;
+    }
+    else
+    {
+      int n = epoll_wait(m_epfd, events, MAX_EVENTS, -1);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+
+      for (int i = 0; i < n; i++)
+      {
+        EventClient *client = static_cast<EventClient *>(events[i].data.ptr);
+        if (!client)
+          woken = true;
+        else
+          handle_event(client, events[i].events);
+      }
+    }
+
+    //new clients and scheduled deliveries are handled after the socket
+    //events, so no client closed above is still on the ready list
+    if (woken)
+      handle_wakeup();
+
+    //a new drain phase is started once the clients handed to the loop
+    //before it was requested have been added
+    if (m_drain.load() != RUNNING)
+    {
+      Drain phase = static_cast<Drain>(m_drain.load());
+      if (phase != m_drain_started.load())
+        start_drain_phase(phase);
+      update_drain_left();
+      if (phase >= CLOSE_QUEUES && m_clients.empty() && m_num_closed == 0)
+        break;
+    }
+  }
+}
+
+void EventLoop::start_drain_phase(Drain phase)
+{
+  //(closing a client removes it from m_clients)
+  std::vector<EventClient *> clients(m_clients.begin(), m_clients.end());
+  for (EventClient *client : clients)
+  {
+    if (phase == CLOSE_ALL)
+      close_client(client);
+    else if (client->session.get_state() == Session::RECEIVING)
+    {
+      if (phase == CLOSE_QUEUES)
+        client->session.get_user()->mqueue->close();
+    }
+    else if (client->want_read)
+    {
+      //the rest of the client's input is read, answered, and then
+      //taken as EOF (which with io_uring its recv gets to by itself)
+      shutdown(client->fd, SHUT_RD);
+      if (!m_ring)
+        read_input(client);
+    }
+  }
+  m_drain_started.store(phase);
+}
+
+void EventLoop::update_drain_left()
+{
+  int senders = 0;
+  if (m_drain_started.load() == STOP_SENDERS)
+  {
+    for (EventClient *client : m_clients)
+    {
+      if (client->session.get_state() != Session::RECEIVING)
+        senders++;
+    }
+  }
+  m_senders_left.store(senders);
+  m_clients_left.store(m_clients.size());
+}
+
+void EventLoop::wake()
+{
+  //only the first wakeup since the loop last drained needs a write
+  {
+    Guard g(m_lock);
+    if (m_woken)
+      return;
+    m_woken = true;
+  }
+  uint64_t one = 1;
+  ssize_t rc = write(m_wakefd, &one, sizeof(one));
+  (void)rc;
+}
+
+void EventLoop::handle_wakeup()
+{
+  uint64_t count;
+  ssize_t rc = read(m_wakefd, &count, sizeof(count));
+  (void)rc;
+
+  std::vector<int> new_fds;
+  std::vector<EventClient *> ready;
+  {
+    Guard g(m_lock);
+    m_woken = false;
+    new_fds.swap(m_new_fds);
+    ready.swap(m_ready);
+    for (EventClient *client : ready)
+      client->scheduled = false;
+  }
+
+  for (int fd : new_fds)
+  {
+    EventClient *client = new EventClient(this, m_server, fd);
+    if (m_ring)
+    {
+      m_clients.insert(client);
+      arm_recv(client);
+      continue;
+    }
+    struct epoll_event ev;
+    ev.events = client->events;
+    ev.data.ptr = client;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+      ::close(fd);
+      delete client;
+      m_num_clients.fetch_sub(1);
+      continue;
+    }
+    m_clients.insert(client);
+  }
+
+  for (EventClient *client : ready)
+    pump(client);
+
+  if (!m_waiting.empty())
+    resume_waiting();
+}
+
+void EventLoop::handle_event(EventClient *client, unsigned events)
+{
+  //reading may close (and free) the client
+  if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !read_input(client))
+    return;
+  if (events & EPOLLOUT)
+    pump(client);
+}
+
+bool EventLoop::read_input(EventClient *client)
+{
+  char buf[4096];
+  while (true)
+  {
+    ssize_t n = read(client->fd, buf, sizeof(buf));
+    if (n > 0)
+    {
+      add_input(client, buf, n);
+      if (client->waiting && client->in.size() >= INPUT_HIGH_WATER)
+        break;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+
+    //error: the client is gone
+    if (n < 0)
+    {
+      close_client(client);
+      return false;
+    }
+
+    return end_input(client);
+  }
+
+  process_input(client);
+  return pump(client);
+}
+
+void EventLoop::add_input(EventClient *client, const char *data, size_t len)
+{
+  //a receiver doesn't send anything once it has joined
+  if (client->session.get_state() != Session::RECEIVING && !client->closing)
+    client->in.append(data, len);
+}
+
+bool EventLoop::end_input(EventClient *client)
+{
+  //EOF: the client is gone (for a receiver, this is how we notice a
+  //departure without having to send it anything), but commands it
+  //sent before closing are still answered; stop polling for input
+  process_input(client);
+  if (client->waiting)
+    client->eof = true;
+  else
+    client->closing = true;
+  client->want_read = false;
+  update_events(client);
+  return pump(client);
+}
+
+void EventLoop::process_input(EventClient *client)
+{
+  size_t pos = 0;
+  while (!client->closing && !client->waiting &&
+         client->session.get_state() != Session::RECEIVING)
+  {
+    size_t avail = client->in.size() - pos;
+    const char *start = client->in.data() + pos;
+    MessageView msg;
+    bool valid;
+    if (client->protocol == PROTO_BINARY)
+    {
+      ssize_t len = Connection::decode_binary(start, avail, msg);
+      if (len == 0)
+        break;
+      if (len < 0)
+      {
+        //with a bad header there's no telling where the next message starts
+        client->closing = true;
+        break;
+      }
+      pos += len;
+      valid = true;
+    }
+    else
+    {
+      //split input into lines the same way rio_readlineb does for the
+      //thread engine: at most MAX_LEN characters, including the newline
+      size_t scan = std::min(avail, (size_t)Message::MAX_LEN);
+      const char *nl = static_cast<const char *>(memchr(start, '\n', scan));
+      size_t len;
+      if (nl)
+        len = nl - start + 1;
+      else if (avail >= Message::MAX_LEN)
+        len = Message::MAX_LEN;
+      else
+        break;
+      pos += len;
+      valid = Connection::decode(start, len, msg) == Connection::SUCCESS;
+    }
+
+    Message reply;
+    bool keep_open;
+    int64_t handle_start = Metrics::now();
+    Metrics::add(Metrics::MESSAGES_RECEIVED);
+    if (valid)
+      keep_open = client->session.handle(msg, reply);
+    else
+    {
+      Metrics::add(Metrics::INVALID_MESSAGES);
+      keep_open = client->session.handle_invalid(reply);
+    }
+    Metrics::observe(Metrics::REQUEST_TIME, Metrics::now() - handle_start);
+
+    //a sendall isn't acknowledged until its message is on disk: its
+    //reply (and every one after it, to keep them in order) is held
+    //back, but the requests already received carry on being handled,
+    //so a pipelining sender's messages share a flush
+    if (client->session.get_durable_lsn() || !client->held.empty())
+    {
+      client->held.add(client->session, reply);
+      client->held_close = !keep_open;
+      if ((!keep_open || client->held.size() >= ReplyBatch::MAX_SIZE) && !release_held(client))
+        break;
+      continue;
+    }
+
+    if (!queue_reply(client, reply) || !keep_open)
+    {
+      client->closing = true;
+      break;
+    }
+
+    //the reply is queued in the old protocol, and everything after it
+    //is in the new one
+    client->protocol = client->session.get_protocol();
+
+    //a receiver that just joined its room is caught up on the room's
+    //recent messages (written along with the reply), then starts
+    //getting deliveries
+    if (client->session.get_state() == Session::RECEIVING)
+    {
+      std::vector<Frame *> replay;
+      client->session.take_replay(replay);
+      for (Frame *frame : replay)
+        append_frame(client, frame);
+      client->session.get_user()->mqueue->set_listener(client);
+
+      //(a receiver joining while the queues are being closed)
+      if (m_drain.load() >= CLOSE_QUEUES)
+        client->session.get_user()->mqueue->close();
+    }
+  }
+  if (!client->held.empty() && !client->waiting)
+    release_held(client);
+  client->in.erase(0, pos);
+}
+
+bool EventLoop::pump(EventClient *client)
+{
+  while (true)
+  {
+    //pull pending deliveries for a receiver into the output queue
+    if (client->session.get_state() == Session::RECEIVING && !client->closing)
+    {
+      MessageQueue *mqueue = client->session.get_user()->mqueue;
+      Frame *frames[64];
+      while (client->out_bytes < OUTPUT_HIGH_WATER)
+      {
+        size_t n = mqueue->dequeue_batch(frames, 64);
+        if (n > 0)
+        {
+          Metrics::add(Metrics::DELIVERIES_SENT, n);
+          Metrics::add(Metrics::QUEUED_MESSAGES, -(int64_t)n);
+          Metrics::observe(Metrics::QUEUE_DELAY, Metrics::now() - frames[0]->get_created());
+        }
+        for (size_t i = 0; i < n; i++)
+          append_frame(client, frames[i]);
+        if (n == 0)
+        {
+          //a closed queue means the receiver should be disconnected,
+          //right away (without flushing) if it is too slow to keep up
+          if (mqueue->is_closed())
+          {
+            if (mqueue->is_aborted())
+            {
+              close_client(client);
+              return false;
+            }
+            client->closing = true;
+          }
+          break;
+        }
+      }
+    }
+    bool more = client->out_bytes >= OUTPUT_HIGH_WATER;
+
+    //write as much as the socket will take
+    if (!flush(client))
+      return false;
+    if (client->want_write)
+      return true;
+
+    if (client->closing)
+    {
+      close_client(client);
+      return false;
+    }
+    if (!more)
+      return true;
+  }
+}
+
+bool EventLoop::flush(EventClient *client)
+{
+  if (m_ring)
+    return submit_write(client);
+
+  struct iovec iov[IOV_MAX];
+  size_t max_iov = std::min(m_server->get_config().batch_size, (size_t)IOV_MAX);
+  while (!client->out.empty())
+  {
+    //gather up to batch_size frames into one writev
+    size_t niov = 0;
+    for (auto it = client->out.begin(); it != client->out.end() && niov < max_iov; ++it)
+    {
+      iov[niov].iov_base = const_cast<char *>(it->data);
+      iov[niov].iov_len = it->size;
+      niov++;
+    }
+    iov[0].iov_base = static_cast<char *>(iov[0].iov_base) + client->out_offset;
+    iov[0].iov_len -= client->out_offset;
+
+    int64_t start = Metrics::now();
+    ssize_t n = writev(client->fd, iov, niov);
+    Metrics::observe(Metrics::SEND_TIME, Metrics::now() - start);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        //finish when the socket becomes writable
+        client->want_write = true;
+        update_events(client);
+        return true;
+      }
+      close_client(client);
+      return false;
+    }
+
+    consume_output(client, n);
+  }
+
+  client->want_write = false;
+  update_events(client);
+  return true;
+}
+
+void EventLoop::consume_output(EventClient *client, size_t written)
+{
+  //drop the frames that were completely written
+  client->out_bytes -= written;
+  written += client->out_offset;
+  while (!client->out.empty() && written >= client->out.front().size)
+  {
+    written -= client->out.front().size;
+    client->out.front().frame->unref();
+    client->out.pop_front();
+  }
+  client->out_offset = written;
+}
+
+bool EventLoop::queue_reply(EventClient *client, const Message &msg)
+{
+  //same length limits as Connection::send
+  Frame *frame = Frame::create(msg.tag, msg.data);
+  if (frame->size(client->protocol) == 0)
+  {
+    frame->unref();
+    return false;
+  }
+  append_frame(client, frame);
+  return true;
+}
+
+void EventLoop::append_frame(EventClient *client, Frame *frame)
+{
+  //a frame that can't be encoded in the client's protocol (a binary
+  //message too long for a text client) is skipped
+  OutFrame entry;
+  entry.frame = frame;
+  entry.data = frame->data(client->protocol);
+  entry.size = frame->size(client->protocol);
+  if (entry.size == 0)
+  {
+    frame->unref();
+    return;
+  }
+  client->out.push_back(entry);
+  client->out_bytes += entry.size;
+}
+
+bool EventLoop::release_held(EventClient *client)
+{
+  //count the client as waiting before checking, so a flush that
+  //finishes after the check is sure to wake the loop
+  MessageLog *log = m_server->get_log();
+  m_num_waiting.fetch_add(1);
+  if (!log->is_durable(client->held.get_durable_lsn()) && !log->has_failed())
+  {
+    client->waiting = true;
+    m_waiting.push_back(client);
+    return false;
+  }
+  m_num_waiting.fetch_sub(1);
+  send_held(client);
+  return true;
+}
+
+void EventLoop::send_held(EventClient *client)
+{
+  if (!m_server->get_log()->is_durable(client->held.get_durable_lsn()))
+    client->held.set_failed();
+  const Message *replies = client->held.get_replies();
+  for (size_t i = 0; i < client->held.size(); i++)
+  {
+    if (!queue_reply(client, replies[i]))
+      client->closing = true;
+  }
+  if (client->held_close)
+    client->closing = true;
+  client->held.clear();
+}
+
+void EventLoop::resume_waiting()
+{
+  MessageLog *log = m_server->get_log();
+  bool failed = log->has_failed();
+  std::vector<EventClient *> waiting;
+  waiting.swap(m_waiting);
+  for (EventClient *client : waiting)
+  {
+    if (!log->is_durable(client->held.get_durable_lsn()) && !failed)
+    {
+      m_waiting.push_back(client);
+      continue;
+    }
+    m_num_waiting.fetch_sub(1);
+    client->waiting = false;
+
+    //send the replies, then carry on with the input received meanwhile
+    //(and with reading, if that had stopped)
+    send_held(client);
+    process_input(client);
+    if (client->eof && !client->waiting)
+      client->closing = true;
+    if (pump(client))
+      update_events(client);
+  }
+}
+
+void EventLoop::update_events(EventClient *client)
+{
+  //a client waiting for the log is only read from until enough input
+  //has piled up: a sender pipelining faster than the log flushes then
+  //waits in its socket buffer, rather than in the loop's
+  bool reading = client->want_read &&
+                 !(client->waiting && client->in.size() >= INPUT_HIGH_WATER);
+  if (m_ring)
+  {
+    //there's nothing to register, except that a client's recv has to
+    //be replaced once it finishes (short of EOF), and a multishot recv
+    //can't be paused, only cancelled
+    if (reading && !client->recv_armed)
+      arm_recv(client);
+    else if (!reading && client->want_read && client->recv_armed && !client->recv_cancelled)
+      cancel_recv(client);
+    return;
+  }
+
+  unsigned events = 0;
+  if (reading)
+    events |= EPOLLIN | EPOLLRDHUP;
+  if (client->want_write)
+    events |= EPOLLOUT;
+  if (events == client->events)
+    return;
+  client->events = events;
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = client;
+  epoll_ctl(m_epfd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+void EventLoop::close_client(EventClient *client)
+{
+  //(a recv or write still in flight is ended by shutting the socket
+  //down, and holds on to the socket until then)
+  if (m_ring && (client->recv_armed || client->write_pending))
+    shutdown(client->fd, SHUT_RDWR);
+  else if (!m_ring)
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, client->fd, nullptr);
+  ::close(client->fd);
+  Metrics::add(Metrics::DISCONNECTIONS);
+
+  //once the listener is cleared no sender can call message_available,
+  //so after deleting the client it only remains to take it off the
+  //ready list
+  if (client->session.get_state() == Session::RECEIVING)
+    client->session.get_user()->mqueue->set_listener(nullptr);
+  if (client->waiting)
+  {
+    m_waiting.erase(std::find(m_waiting.begin(), m_waiting.end(), client));
+    m_num_waiting.fetch_sub(1);
+  }
+  m_clients.erase(client);
+  m_num_clients.fetch_sub(1);
+  if (client->recv_armed || client->write_pending)
+  {
+    client->closed = true;
+    m_num_closed++;
+  }
+  else
+    delete client;
+  Guard g(m_lock);
+  auto it = std::find(m_ready.begin(), m_ready.end(), client);
+  if (it != m_ready.end())
+    m_ready.erase(it);
+}
+
+////////////////////////////////////////////////////////////////////////
+// io_uring
+////////////////////////////////////////////////////////////////////////
+
+bool EventLoop::wait_ring(bool &woken)
+{
+  //submit everything queued since last time, and wait for something
+  //to complete, in one system call
+  if (!m_ring->submit(1))
+    return false;
+  m_ring->for_each_completion([this, &woken](const io_uring_cqe *cqe) {
+    EventClient *client = reinterpret_cast<EventClient *>(cqe->user_data & ~OP_MASK);
+    if ((cqe->user_data & OP_MASK) == OP_CANCEL)
+      return;
+    if (!client)
+    {
+      woken = true;
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        arm_wakeup();
+    }
+    else if ((cqe->user_data & OP_MASK) == OP_RECV)
+      handle_recv(client, cqe);
+    else
+      handle_write(client, cqe->res);
+  });
+  return true;
+}
+
+void EventLoop::handle_recv(EventClient *client, const io_uring_cqe *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+  {
+    client->recv_armed = false;
+    client->recv_cancelled = false;
+  }
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+  {
+    if (cqe->res > 0 && !client->closed)
+      add_input(client, m_ring->get_buffer(cqe), cqe->res);
+    m_ring->return_buffer(cqe);
+  }
+  if (client->closed)
+  {
+    finish_closed(client);
+    return;
+  }
+
+  if (cqe->res == 0)
+  {
+    end_input(client);
+    return;
+  }
+  //out of buffers (a burst from many clients at once): just try again
+  //(as after a cancellation, once the client is done waiting)
+  if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+  {
+    close_client(client);
+    return;
+  }
+  process_input(client);
+  if (pump(client))
+    update_events(client);
+}
+
+void EventLoop::handle_write(EventClient *client, int result)
+{
+  client->write_pending = false;
+  if (client->closed)
+  {
+    finish_closed(client);
+    return;
+  }
+  Metrics::observe(Metrics::SEND_TIME, Metrics::now() - client->write_start);
+  if (result < 0)
+  {
+    close_client(client);
+    return;
+  }
+
+  //write whatever is left (or has been queued since)
+  consume_output(client, result);
+  client->want_write = false;
+  pump(client);
+}
+
+void EventLoop::arm_wakeup()
+{
+  io_uring_sqe *sqe = m_ring->get_sqe();
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = m_wakefd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = 0;
+}
+
+void EventLoop::arm_recv(EventClient *client)
+{
+  io_uring_sqe *sqe = m_ring->get_sqe();
+  if (!sqe)
+  {
+    close_client(client);
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = client->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_BUFFER_GROUP;
+  sqe->user_data = reinterpret_cast<uint64_t>(client) | OP_RECV;
+  client->recv_armed = true;
+}
+
+void EventLoop::cancel_recv(EventClient *client)
+{
+  //(if there's no room to cancel it now, it's tried again next time
+  //the client's events are updated)
+  io_uring_sqe *sqe = m_ring->get_sqe();
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = reinterpret_cast<uint64_t>(client) | OP_RECV;
+  sqe->user_data = OP_CANCEL;
+  client->recv_cancelled = true;
+}
+
+bool EventLoop::submit_write(EventClient *client)
+{
+  //one write at a time: more output waits for it to complete
+  if (client->write_pending)
+    return true;
+  if (client->out.empty())
+  {
+    client->want_write = false;
+    return true;
+  }
+  io_uring_sqe *sqe = m_ring->get_sqe();
+  if (!sqe)
+  {
+    close_client(client);
+    return false;
+  }
+
+  //gather up to batch_size frames into one writev
+  size_t max_iov = std::min(m_server->get_config().batch_size, (size_t)IOV_MAX);
+  client->iov.resize(std::min(client->out.size(), max_iov));
+  size_t niov = 0;
+  for (auto it = client->out.begin(); niov < client->iov.size(); ++it)
+  {
+    client->iov[niov].iov_base = const_cast<char *>(it->data);
+    client->iov[niov].iov_len = it->size;
+    niov++;
+  }
+  client->iov[0].iov_base = static_cast<char *>(client->iov[0].iov_base) + client->out_offset;
+  client->iov[0].iov_len -= client->out_offset;
+
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = client->fd;
+  sqe->addr = reinterpret_cast<uint64_t>(client->iov.data());
+  sqe->len = niov;
+  sqe->user_data = reinterpret_cast<uint64_t>(client) | OP_WRITE;
+  client->write_pending = true;
+  client->want_write = true;
+  client->write_start = Metrics::now();
+  return true;
+}
+
+void EventLoop::finish_closed(EventClient *client)
+{
+  if (client->recv_armed || client->write_pending)
+    return;
+  m_num_closed--;
+  delete client;
+}
@@ -0,0 +1,145 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <vector>
+#include <unordered_set>
+#include <atomic>
+#include <pthread.h>
+#include "message_log.h"
+class Server;
+class EventClient;
+class Ring;
+class Frame;
+struct Message;
+
+// An EventLoop is one thread of the epoll engine. It owns a set of
+// non-blocking client sockets and drives each client's Session from
+// epoll readiness events, so a small fixed number of loops can serve
+// any number of clients (rather than one thread per client).
+//
+// With a durable message log, a sender's reply to a sendall has to wait
+// until the message is on disk, but the loop can't block: the sender is
+// put aside until the log's flusher says it has flushed far enough (and
+// is read from meanwhile only until a limited amount of input piles up).
+//
+// A loop can do its I/O through io_uring (see Ring) instead of epoll:
+// every client has a (multishot) recv outstanding, which takes a
+// buffer from the loop's provided buffers only once data arrives, and
+// writes are submitted as writevs that complete in the background, so
+// all of the loop's reads and writes since it last waited are
+// submitted, and their completions collected, in one system call.
+class EventLoop : public MessageLog::Listener {
+public:
+  EventLoop(Server *server, bool use_uring = false);
+  ~EventLoop();
+
+  // create the epoll instance (or io_uring) and start the loop thread,
+  // returns false if any of this fails
+  bool start();
+
+  // hand a newly accepted (non-blocking) client socket to this loop,
+  // may be called from any thread
+  void add_client(int fd);
+
+  // ask the loop to deliver queued messages to a receiving client,
+  // may be called from any thread
+  void schedule(EventClient *client);
+
+  // called by the message log's flusher thread after each flush
+  virtual void log_flushed();
+
+  // Draining at shutdown goes through these phases, in order (each
+  // started by drain, from any thread):
+  enum Drain {
+    RUNNING,
+    STOP_SENDERS, // answer the input already received from clients
+                  // that aren't receivers, then close them
+    CLOSE_QUEUES, // close the receivers' queues, so each is closed
+                  // once what's in its queue has been written
+    CLOSE_ALL,    // close every client still left
+  };
+  void drain(Drain phase);
+
+  // how many clients are still to finish the given phase (for
+  // STOP_SENDERS, the clients that aren't receivers; after that, all
+  // of them), or -1 if the loop hasn't started that phase yet
+  int get_drain_left(Drain phase) const;
+
+  // number of clients handed to the loop and not yet closed
+  int get_num_clients() const { return m_num_clients.load(); }
+
+  // wait for the loop thread to exit, which it does once draining is
+  // past STOP_SENDERS and it has no clients left
+  void join();
+
+private:
+  // prohibit value semantics
+  EventLoop(const EventLoop &);
+  EventLoop &operator=(const EventLoop &);
+
+  static void *run(void *arg);
+  void loop();
+
+  void wake();
+  void handle_wakeup();
+  void handle_event(EventClient *client, unsigned events);
+  bool read_input(EventClient *client);
+  void add_input(EventClient *client, const char *data, size_t len);
+  bool end_input(EventClient *client);
+  void process_input(EventClient *client);
+  bool pump(EventClient *client);
+  bool flush(EventClient *client);
+  void consume_output(EventClient *client, size_t written);
+  bool queue_reply(EventClient *client, const Message &msg);
+  void append_frame(EventClient *client, Frame *frame);
+  void update_events(EventClient *client);
+  void close_client(EventClient *client); // also deletes the client
+  // send the client's held replies if the log is durable far enough,
+  // otherwise put it on the waiting list (and return false)
+  bool release_held(EventClient *client);
+  void send_held(EventClient *client);
+  void resume_waiting();
+  void start_drain_phase(Drain phase);
+  void update_drain_left();
+
+  // the io_uring versions of waiting for events, reading and writing
+  bool wait_ring(bool &woken);
+  void handle_recv(EventClient *client, const struct io_uring_cqe *cqe);
+  void handle_write(EventClient *client, int result);
+  void arm_wakeup();
+  void arm_recv(EventClient *client);
+  void cancel_recv(EventClient *client);
+  bool submit_write(EventClient *client);
+  void finish_closed(EventClient *client);
+
+  Server *m_server;
+  Ring *m_ring; // nullptr when using epoll
+  int m_epfd;
+  int m_wakefd; // eventfd used to wake the loop from other threads
+  pthread_t m_thread;
+
+  pthread_mutex_t m_lock; // protects the members below
+  bool m_woken;           // true if m_wakefd has been written but not read
+  std::vector<int> m_new_fds;
+  std::vector<EventClient *> m_ready;
+
+  // senders waiting for the log to be flushed (only used by the loop
+  // thread, except that flushes only wake the loop if there are any)
+  std::vector<EventClient *> m_waiting;
+  std::atomic<int> m_num_waiting;
+
+  // every client the loop has (only used by the loop thread)
+  std::unordered_set<EventClient *> m_clients;
+  std::atomic<int> m_num_clients;
+
+  // closed clients (with io_uring) that still have a recv or write in
+  // flight, deleted once it completes
+  size_t m_num_closed;
+
+  std::atomic<int> m_drain;         // phase requested
+  std::atomic<int> m_drain_started; // phase the loop has started
+  std::atomic<int> m_senders_left;
+  std::atomic<int> m_clients_left;
+};
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,112 @@
+#include <new>
+#include <cstring>
+#include "message.h"
+#include "connection.h"
+#include "frame.h"
+#include "metrics.h"
+#include "pool.h"
+
+Frame *Frame::build(unsigned tag_id, const std::string &tag,
+                    const Slice *parts, size_t num_parts)
+{
+  //the data is the parts separated by colons
+  size_t data_len = num_parts - 1;
+  for (size_t i = 0; i < num_parts; i++)
+    data_len += parts[i].len;
+
+  //work out which encodings the message fits in
+  size_t text_size = tag.size() + 1 + data_len + 1;
+  if (text_size > Message::MAX_LEN)
+    text_size = 0;
+  size_t binary_size = 0;
+  if (tag_id != 0 && data_len <= Message::MAX_BINARY_LEN)
+  {
+    char header[Connection::MAX_BINARY_HEADER];
+    binary_size = Connection::encode_binary_header(tag_id, data_len, header) + data_len;
+  }
+
+  //the text encoding lives right after the Frame's other members (and
+  //most frames are small enough to come from a pool); it's kept even
+  //when it's too long to send, since the binary one is made from it
+  void *mem = Pool::allocate(alloc_size(tag.size(), data_len));
+  Frame *frame = new (mem) Frame(tag_id, tag.size(), data_len, text_size, binary_size, Metrics::now());
+
+  char *p = frame->m_data;
+  memcpy(p, tag.data(), tag.size());
+  p += tag.size();
+  *p++ = ':';
+  for (size_t i = 0; i < num_parts; i++)
+  {
+    if (i > 0)
+      *p++ = ':';
+    memcpy(p, parts[i].data, parts[i].len);
+    p += parts[i].len;
+  }
+  *p = '\n';
+  return frame;
+}
+
+size_t Frame::alloc_size(size_t tag_len, size_t data_len)
+{
+  //(an empty message still needs the whole Frame)
+  size_t size = offsetof(Frame, m_data) + tag_len + 1 + data_len + 1;
+  return size < sizeof(Frame) ? sizeof(Frame) : size;
+}
+
+const char *Frame::binary_data() const
+{
+  char *binary = m_binary.load(std::memory_order_acquire);
+  if (binary || m_binary_size == 0)
+    return binary;
+
+  //encode it, and if another thread has just done the same, use
+  //theirs instead
+  char *encoded = static_cast<char *>(Pool::allocate(m_binary_size));
+  size_t header_len = Connection::encode_binary_header(m_tag_id, m_data_len, encoded);
+  memcpy(encoded + header_len, m_data + m_tag_len + 1, m_data_len);
+  if (!m_binary.compare_exchange_strong(binary, encoded, std::memory_order_acq_rel,
+                                        std::memory_order_acquire))
+  {
+    Pool::deallocate(encoded, m_binary_size);
+    return binary;
+  }
+  return encoded;
+}
+
+Frame *Frame::create(const std::string &tag, const std::string &data)
+{
+  Slice part(data);
+  return build(Connection::tag_id(tag), tag, &part, 1);
+}
+
+Frame *Frame::create_delivery(const std::string &room,
+                              const std::string &sender,
+                              const Slice &text)
+{
+  static const std::string TAG(TAG_DELIVERY);
+
+  Slice parts[] = { room, sender, text };
+  return build(TAG_ID_DELIVERY, TAG, parts, 3);
+}
+
+Frame *Frame::create_delivery(const std::string &room, uint64_t seq,
+                              const std::string &sender,
+                              const Slice &text)
+{
+  //(room names are letters and digits, so the '@' can't be ambiguous)
+  std::string numbered_room = room + "@" + std::to_string(seq);
+  return create_delivery(numbered_room, sender, text);
+}
+
+void Frame::unref()
+{
+  if (m_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+  {
+    char *binary = m_binary.load(std::memory_order_relaxed);
+    if (binary)
+      Pool::deallocate(binary, m_binary_size);
+    size_t size = alloc_size(m_tag_len, m_data_len);
+    this->~Frame();
+    Pool::deallocate(this, size);
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <string>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "message.h"
+
+// A Frame is a message that has already been encoded in wire format
+// and can be written to a socket as-is. Frames are immutable and
+// reference counted, so the one Frame built by a broadcast can sit in
+// every member's queue at the same time: the message is encoded once,
+// in a single allocation, no matter how many receivers it goes to.
+// That encoding is the text protocol's; receivers may use the binary
+// protocol too, but most rooms have none, so the binary encoding is
+// only made (in an allocation of its own) the first time it's needed.
+class Frame {
+public:
+  // create the frame for tag and data ("tag:data\n" in the text
+  // protocol), with a reference count of 1
+  static Frame *create(const std::string &tag, const std::string &data);
+
+  // create the delivery frame ("delivery:room:sender:text\n" in the
+  // text protocol), with a reference count of 1
+  static Frame *create_delivery(const std::string &room,
+                                const std::string &sender,
+                                const Slice &text);
+
+  // the same, for the message numbered seq in its room, whose number
+  // follows the room's name: "delivery:room@seq:sender:text\n"
+  static Frame *create_delivery(const std::string &room, uint64_t seq,
+                                const std::string &sender,
+                                const Slice &text);
+
+  // reference counting: the frame is freed when the last
+  // reference is dropped, and may be shared between threads
+  void ref() { m_refcount.fetch_add(1, std::memory_order_relaxed); }
+  void unref();
+
+  // the encoded bytes for the given protocol; the size is 0 if the
+  // message can't be sent using it (because it is too long)
+  const char *data(Protocol protocol = PROTO_TEXT) const
+  { return protocol == PROTO_TEXT ? m_data : binary_data(); }
+  size_t size(Protocol protocol = PROTO_TEXT) const
+  { return protocol == PROTO_TEXT ? m_text_size : m_binary_size; }
+
+  // when the frame was created (Metrics::now), so the time it spent
+  // waiting in queues can be measured
+  int64_t get_created() const { return m_created; }
+
+private:
+  Frame(unsigned tag_id, size_t tag_len, size_t data_len, size_t text_size,
+        size_t binary_size, int64_t created)
+    : m_refcount(1), m_tag_len(tag_len), m_created(created), m_tag_id(tag_id),
+      m_data_len(data_len), m_text_size(text_size), m_binary_size(binary_size),
+      m_binary(nullptr) { }
+  ~Frame() { }
+
+  // prohibit value semantics
+  Frame(const Frame &);
+  Frame &operator=(const Frame &);
+
+  // allocate and encode a frame whose data is the given parts,
+  // separated by colons
+  static Frame *build(unsigned tag_id, const std::string &tag,
+                      const Slice *parts, size_t num_parts);
+
+  // bytes allocated for a frame with the given tag and data lengths
+  static size_t alloc_size(size_t tag_len, size_t data_len);
+
+  // the binary encoding, made from the text one the first time it's
+  // asked for (nullptr if the message has none)
+  const char *binary_data() const;
+
+  std::atomic<int> m_refcount;
+  uint32_t m_tag_len;
+  int64_t m_created;
+  uint32_t m_tag_id;
+  uint32_t m_data_len; // (messages are limited to far less than 4GB)
+  size_t m_text_size;
+  size_t m_binary_size;
+  mutable std::atomic<char *> m_binary;
+  char m_data[1]; // actually "tag:data\n", allocated along with the
+                  // Frame (even if it's too long to send as text)
+};
+
+#endif // FRAME_H
@@ -0,0 +1,584 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "csapp.h"
+#include "message.h"
+#include "connection.h"
+#include "client_util.h"
+
+// Load generator for the chat server: opens many sender and receiver
+// connections, has the senders broadcast timestamped messages into
+// their rooms at a given rate, and reports the server's throughput and
+// the end-to-end latency of deliveries (from just before a sender
+// writes a message until a receiver has read it).
+//
+// The connections are shared out among a few threads, each driving its
+// connections with epoll, so thousands of them need no more than that.
+// Every sender has one sendall outstanding at a time (the next one is
+// sent once it has been acknowledged, and not before it is due). With
+// -w, each receiver follows every room with one subscription (joining
+// "room*") rather than joining one of them.
+//
+// With -a N it instead measures how quickly the server takes on a
+// storm of new connections (as after a restart, when every client
+// reconnects at once): it opens N receiver connections all at once,
+// has each log in and join one of -m rooms, and reports how long it
+// took until every one of them had been answered.
+//
+// Usage: ./loadgen [options] <server_address> <port>
+
+namespace {
+
+struct Options {
+  int senders;
+  int receivers;
+  int rooms;
+  double rate;      // messages/sec per sender, 0 means as fast as possible
+  int duration;     // seconds of sending
+  int payload;      // size of each message's text
+  int threads;
+  bool binary;
+  int storm;        // connections to open at once (-a), 0 for a load test
+  bool wildcard;    // receivers subscribe to every room (-w)
+
+  Options()
+    : senders(10), receivers(100), rooms(1), rate(0), duration(10),
+      payload(32), threads(4), binary(false), storm(0), wildcard(false) { }
+};
+
+void usage() {
+  std::cerr << "Usage: ./loadgen [-s senders] [-r receivers] [-m rooms] [-R msgs/sec per sender]\n"
+               "                 [-d seconds] [-z payload bytes] [-t threads] [-b] [-w] <server_address> <port>\n"
+               "       ./loadgen -a connections [-m rooms] [-t threads] <server_address> <port>\n";
+}
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// one connection to the server (a sender or a receiver)
+struct Client {
+  Connection *conn;
+  bool sender;
+  std::string in;      // received bytes not yet parsed
+  std::string out;     // bytes not yet written
+  bool waiting;        // a sendall hasn't been acknowledged yet
+  long long next_send; // when the next sendall is due
+  long sent;
+  int fan_out;         // number of receivers in the (sender's) room
+};
+
+struct Worker {
+  const Options *options;
+  std::vector<Client> clients;
+  long long stop_sending; // no sendalls are started after this
+  long long stop;         // the thread returns at this time
+  pthread_t thread;
+
+  // results
+  long sent;
+  long acked;
+  long delivered;
+  long errors;
+  std::vector<long long> latencies;
+};
+
+// log in (and join a room) using the blocking Connection functions
+bool setup_client(Client &client, const std::string &host, int port,
+                  const std::string &username, const std::string &room, bool binary) {
+  client.conn = new Connection();
+  client.conn->connect(host, port);
+  if (!client.conn->is_open()) {
+    return false;
+  }
+  if (binary && !use_binary_protocol(*client.conn)) {
+    return false;
+  }
+
+  Message response;
+  Message login(client.sender ? TAG_SLOGIN : TAG_RLOGIN, username);
+  if (!client.conn->send(login) || !client.conn->receive(response) || response.tag != TAG_OK) {
+    return false;
+  }
+  if (!client.conn->send(Message(TAG_JOIN, room)) || !client.conn->receive(response) || response.tag != TAG_OK) {
+    return false;
+  }
+
+  // from now on the socket is driven by a worker's epoll loop
+  int fd = client.conn->get_fd();
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  client.waiting = false;
+  client.next_send = 0;
+  client.sent = 0;
+  return true;
+}
+
+// encode a sendall whose text starts with the current time
+void queue_sendall(Client &client, const Options &options) {
+  char stamp[32];
+  int len = snprintf(stamp, sizeof(stamp), "%lld ", now_ns());
+  std::string text(stamp, len);
+  if ((int)text.size() < options.payload) {
+    text.append(options.payload - text.size(), 'x');
+  }
+
+  if (options.binary) {
+    char header[Connection::MAX_BINARY_HEADER];
+    size_t header_len = Connection::encode_binary_header(TAG_ID_SENDALL, text.size(), header);
+    client.out.append(header, header_len);
+    client.out.append(text);
+  } else {
+    client.out.append(TAG_SENDALL ":");
+    client.out.append(text);
+    client.out.append("\n");
+  }
+}
+
+// write as much pending output as the socket takes, false on error
+bool flush_client(Client &client) {
+  while (!client.out.empty()) {
+    ssize_t n = write(client.conn->get_fd(), client.out.data(), client.out.size());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    client.out.erase(0, n);
+  }
+  return true;
+}
+
+// parse the message at the start of the len bytes at buf, returning how
+// many bytes it took up (0 if it isn't all there yet, -1 if it is invalid)
+ssize_t next_message(const char *buf, size_t len, bool binary, MessageView &msg) {
+  if (binary) {
+    return Connection::decode_binary(buf, len, msg);
+  }
+  const char *nl = static_cast<const char *>(memchr(buf, '\n', len));
+  if (!nl) {
+    return 0;
+  }
+  len = nl - buf + 1;
+  if (Connection::decode(buf, len, msg) != Connection::SUCCESS) {
+    return -1;
+  }
+  return len;
+}
+
+void handle_message(Worker *worker, Client &client, const MessageView &msg) {
+  if (client.sender) {
+    // the acknowledgement of the outstanding sendall
+    if (msg.tag == TAG_OK) {
+      worker->acked++;
+    } else {
+      worker->errors++;
+    }
+    client.waiting = false;
+    return;
+  }
+
+  // a delivery is "room:sender:text", and the text starts with the
+  // time the message was sent
+  if (msg.tag != TAG_DELIVERY) {
+    worker->errors++;
+    return;
+  }
+  long long received = now_ns();
+  const char *p = static_cast<const char *>(memchr(msg.data.data, ':', msg.data.len));
+  const char *end = msg.data.data + msg.data.len;
+  if (p) {
+    p = static_cast<const char *>(memchr(p + 1, ':', end - p - 1));
+  }
+  if (!p) {
+    worker->errors++;
+    return;
+  }
+  long long sent = 0;
+  for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+    sent = sent * 10 + (*p - '0');
+  }
+  worker->delivered++;
+  worker->latencies.push_back(received - sent);
+}
+
+// read whatever has arrived, false if the connection is gone
+bool read_client(Worker *worker, Client &client) {
+  char buf[16384];
+  while (true) {
+    ssize_t n = read(client.conn->get_fd(), buf, sizeof(buf));
+    if (n > 0) {
+      client.in.append(buf, n);
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    return false;
+  }
+
+  size_t pos = 0;
+  while (true) {
+    MessageView msg;
+    ssize_t len = next_message(client.in.data() + pos, client.in.size() - pos,
+                               worker->options->binary, msg);
+    if (len == 0) {
+      break;
+    }
+    if (len < 0) {
+      return false;
+    }
+    handle_message(worker, client, msg);
+    pos += len;
+  }
+  client.in.erase(0, pos);
+  return true;
+}
+
+void *run_worker(void *arg) {
+  Worker *worker = static_cast<Worker *>(arg);
+  const Options &options = *worker->options;
+  long long interval = options.rate > 0 ? (long long)(1e9 / options.rate) : 0;
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  for (size_t i = 0; i < worker->clients.size(); i++) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, worker->clients[i].conn->get_fd(), &ev);
+  }
+
+  // spread the senders' first messages over one interval
+  long long start = now_ns();
+  for (size_t i = 0; i < worker->clients.size(); i++) {
+    worker->clients[i].next_send = start + (interval * (long long)i) / (long long)worker->clients.size();
+  }
+
+  std::vector<struct epoll_event> events(256);
+  while (true) {
+    long long now = now_ns();
+    if (now >= worker->stop) {
+      break;
+    }
+
+    // start the sendalls that are due, and find when the next one is
+    long long next_due = worker->stop;
+    for (Client &client : worker->clients) {
+      if (!client.sender || client.waiting || now >= worker->stop_sending) {
+        continue;
+      }
+      if (client.next_send <= now) {
+        queue_sendall(client, options);
+        client.waiting = true;
+        client.sent++;
+        worker->sent++;
+        // don't try to catch up on sends missed while waiting
+        client.next_send = std::max(client.next_send + interval, now);
+        if (!flush_client(client)) {
+          worker->errors++;
+        }
+      } else {
+        next_due = std::min(next_due, client.next_send);
+      }
+    }
+
+    int timeout_ms = (int)((next_due - now + 999999) / 1000000);
+    int n = epoll_wait(epfd, events.data(), events.size(), timeout_ms);
+    for (int i = 0; i < n; i++) {
+      Client &client = worker->clients[events[i].data.u64];
+      if (!read_client(worker, client)) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, client.conn->get_fd(), nullptr);
+        worker->errors++;
+        continue;
+      }
+      if (!flush_client(client)) {
+        worker->errors++;
+      }
+    }
+  }
+
+  close(epfd);
+  return nullptr;
+}
+
+double percentile_us(const std::vector<long long> &sorted, double pct) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t idx = (size_t)(pct / 100.0 * (sorted.size() - 1));
+  return sorted[idx] / 1000.0;
+}
+
+// one connection of a connection storm
+struct StormClient {
+  int fd;
+  long long started; // when it was opened
+  bool requested;    // the login and join have been written
+  std::string in;
+  int answered;      // responses read so far (ok to the login, then the join)
+};
+
+struct StormWorker {
+  const Options *options;
+  const struct addrinfo *addr;
+  int first, count;  // its connections' numbers
+  std::vector<StormClient> clients;
+  pthread_t thread;
+
+  // results
+  long long finished; // when the last of its connections was answered
+  long errors;
+  std::vector<long long> latencies;
+};
+
+// open a worker's connections as fast as possible, and drive them with
+// epoll until each has been answered (or has failed); the sockets are
+// left open, so the server has all of the connections at once
+void *run_storm_worker(void *arg) {
+  StormWorker *worker = static_cast<StormWorker *>(arg);
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  worker->clients.resize(worker->count);
+  worker->errors = 0;
+  int left = worker->count;
+  for (int i = 0; i < worker->count; i++) {
+    StormClient &client = worker->clients[i];
+    client.started = now_ns();
+    client.requested = false;
+    client.answered = 0;
+    client.fd = socket(worker->addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client.fd < 0 ||
+        (connect(client.fd, worker->addr->ai_addr, worker->addr->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+      worker->errors++;
+      left--;
+      continue;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u64 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, client.fd, &ev);
+  }
+
+  std::vector<struct epoll_event> events(256);
+  long long give_up = now_ns() + 60 * 1000000000LL;
+  while (left > 0 && now_ns() < give_up) {
+    int n = epoll_wait(epfd, events.data(), events.size(), 1000);
+    for (int i = 0; i < n; i++) {
+      StormClient &client = worker->clients[events[i].data.u64];
+      bool failed = events[i].events & (EPOLLERR | EPOLLHUP);
+      if (!failed && !client.requested && (events[i].events & EPOLLOUT)) {
+        // connected: log in and join (both fit in the socket's buffer)
+        long index = worker->first + events[i].data.u64;
+        std::string request = std::string(TAG_RLOGIN ":a") + std::to_string(index) + "\n" TAG_JOIN ":storm" +
+                              std::to_string(index % worker->options->rooms) + "\n";
+        failed = write(client.fd, request.data(), request.size()) != (ssize_t)request.size();
+        client.requested = true;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = events[i].data.u64;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, client.fd, &ev);
+      }
+      if (!failed && (events[i].events & EPOLLIN)) {
+        char buf[256];
+        ssize_t len = read(client.fd, buf, sizeof(buf));
+        if (len > 0) {
+          client.in.append(buf, len);
+        } else if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+          failed = true;
+        }
+        size_t nl;
+        while (!failed && (nl = client.in.find('\n')) != std::string::npos) {
+          failed = client.in.compare(0, strlen(TAG_OK ":"), TAG_OK ":") != 0;
+          client.in.erase(0, nl + 1);
+          if (!failed && ++client.answered == 2) {
+            worker->finished = now_ns();
+            worker->latencies.push_back(worker->finished - client.started);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, client.fd, nullptr);
+            left--;
+          }
+        }
+      }
+      if (failed) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, client.fd, nullptr);
+        worker->errors++;
+        left--;
+      }
+    }
+  }
+  worker->errors += left;
+
+  close(epfd);
+  return nullptr;
+}
+
+int run_storm(const Options &options, const std::string &host, const std::string &port) {
+  struct addrinfo hints, *addr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addr) != 0) {
+    std::cerr << "Error: could not resolve " << host << "\n";
+    return 1;
+  }
+
+  std::vector<StormWorker> workers(options.threads);
+  long long start = now_ns();
+  for (int i = 0; i < options.threads; i++) {
+    StormWorker &worker = workers[i];
+    worker.options = &options;
+    worker.addr = addr;
+    worker.first = (int)((long long)options.storm * i / options.threads);
+    worker.count = (int)((long long)options.storm * (i + 1) / options.threads) - worker.first;
+    worker.finished = start;
+    pthread_create(&worker.thread, nullptr, run_storm_worker, &worker);
+  }
+
+  long long finished = start;
+  long errors = 0;
+  std::vector<long long> latencies;
+  for (StormWorker &worker : workers) {
+    pthread_join(worker.thread, nullptr);
+    finished = std::max(finished, worker.finished);
+    errors += worker.errors;
+    latencies.insert(latencies.end(), worker.latencies.begin(), worker.latencies.end());
+  }
+  for (StormWorker &worker : workers) {
+    for (StormClient &client : worker.clients) {
+      if (client.fd >= 0) {
+        close(client.fd);
+      }
+    }
+  }
+  freeaddrinfo(addr);
+  std::sort(latencies.begin(), latencies.end());
+
+  double elapsed_ms = (finished - start) / 1e6;
+  std::cout << std::fixed << std::setprecision(1)
+            << "connected:  " << latencies.size() << " in " << elapsed_ms << " ms ("
+            << latencies.size() / (elapsed_ms / 1000.0) << " connections/sec)\n"
+            << "errors:     " << errors << "\n"
+            << "latency us: p50 " << percentile_us(latencies, 50)
+            << "  p99 " << percentile_us(latencies, 99)
+            << "  p999 " << percentile_us(latencies, 99.9)
+            << "  max " << (latencies.empty() ? 0.0 : latencies.back() / 1000.0) << "\n";
+  return errors == 0 ? 0 : 1;
+}
+
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:m:R:d:z:t:ba:w")) != -1) {
+    switch (opt) {
+    case 's': options.senders = std::stoi(optarg); break;
+    case 'r': options.receivers = std::stoi(optarg); break;
+    case 'm': options.rooms = std::stoi(optarg); break;
+    case 'R': options.rate = std::stod(optarg); break;
+    case 'd': options.duration = std::stoi(optarg); break;
+    case 'z': options.payload = std::stoi(optarg); break;
+    case 't': options.threads = std::stoi(optarg); break;
+    case 'b': options.binary = true; break;
+    case 'a': options.storm = std::stoi(optarg); break;
+    case 'w': options.wildcard = true; break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || options.senders < 1 || options.receivers < 0 || options.rooms < 1 ||
+      options.rate < 0 || options.duration < 1 || options.payload < 0 || options.threads < 1 ||
+      options.storm < 0) {
+    usage();
+    return 1;
+  }
+  std::string host = argv[optind];
+  if (options.storm > 0) {
+    return run_storm(options, host, argv[optind + 1]);
+  }
+  int port = std::stoi(argv[optind + 1]);
+
+  // the receivers log in first, so that they see every message; rooms
+  // are assigned round robin, and clients are shared out among the
+  // workers the same way
+  std::vector<Worker> workers(options.threads);
+  for (Worker &worker : workers) {
+    worker.options = &options;
+    worker.sent = worker.acked = worker.delivered = worker.errors = 0;
+  }
+  int total = options.receivers + options.senders;
+  for (int i = 0; i < total; i++) {
+    Client client;
+    client.sender = i >= options.receivers;
+    int index = client.sender ? i - options.receivers : i;
+    std::string username = (client.sender ? "s" : "r") + std::to_string(index);
+    std::string room = "room" + std::to_string(index % options.rooms);
+    client.fan_out = (options.receivers - index % options.rooms + options.rooms - 1) / options.rooms;
+    if (options.wildcard && !client.sender) {
+      room = "room*";
+    }
+    if (options.wildcard) {
+      client.fan_out = options.receivers;
+    }
+    if (!setup_client(client, host, port, username, room, options.binary)) {
+      std::cerr << "Error: could not set up " << username << " (connection " << i + 1
+                << " of " << total << ")\n";
+      return 1;
+    }
+    workers[i % options.threads].clients.push_back(client);
+  }
+
+  // let everyone drain for a second after the senders stop
+  long long start = now_ns();
+  for (Worker &worker : workers) {
+    worker.stop_sending = start + options.duration * 1000000000LL;
+    worker.stop = worker.stop_sending + 1000000000LL;
+    pthread_create(&worker.thread, nullptr, run_worker, &worker);
+  }
+
+  // every message should reach each receiver in its room
+  long sent = 0, acked = 0, delivered = 0, errors = 0, expected = 0;
+  std::vector<long long> latencies;
+  for (Worker &worker : workers) {
+    pthread_join(worker.thread, nullptr);
+    sent += worker.sent;
+    acked += worker.acked;
+    delivered += worker.delivered;
+    errors += worker.errors;
+    latencies.insert(latencies.end(), worker.latencies.begin(), worker.latencies.end());
+    for (Client &client : worker.clients) {
+      if (client.sender) {
+        expected += client.sent * client.fan_out;
+      }
+      delete client.conn;
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  std::cout << std::fixed << std::setprecision(1)
+            << "sent:       " << sent << " (" << sent / (double)options.duration << " msgs/sec)\n"
+            << "acked:      " << acked << "\n"
+            << "delivered:  " << delivered << " (" << delivered / (double)options.duration
+            << " msgs/sec, " << expected << " expected)\n"
+            << "errors:     " << errors << "\n"
+            << "latency us: p50 " << percentile_us(latencies, 50)
+            << "  p99 " << percentile_us(latencies, 99)
+            << "  p999 " << percentile_us(latencies, 99.9)
+            << "  max " << (latencies.empty() ? 0.0 : latencies.back() / 1000.0) << "\n";
+  return 0;
+}
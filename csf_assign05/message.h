@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <string>
+#include <cstring>
 
 struct Message {
   // An encoded message may have at most this many characters,
@@ -11,6 +12,10 @@ struct Message {
   // temporarily store the encoded message.)
   static const unsigned MAX_LEN = 255;
 
+  // In the binary protocol, the data may have at most this many
+  // characters (the tag and length are encoded separately).
+  static const unsigned MAX_BINARY_LEN = 65536;
+
   std::string tag;
   std::string data;
 
@@ -22,6 +27,37 @@ struct Message {
   // TODO: you could add helper functions
 };
 
+// A Slice refers to characters stored somewhere else (it doesn't own
+// them), so it is only valid for as long as they are.
+struct Slice {
+  const char *data;
+  size_t len;
+
+  Slice() : data(nullptr), len(0) { }
+
+  Slice(const char *data, size_t len)
+    : data(data), len(len) { }
+
+  Slice(const std::string &str)
+    : data(str.data()), len(str.size()) { }
+
+  bool empty() const { return len == 0; }
+
+  bool operator==(const char *str) const
+  { return strlen(str) == len && memcmp(str, data, len) == 0; }
+  bool operator!=(const char *str) const { return !(*this == str); }
+
+  std::string str() const { return std::string(data, len); }
+};
+
+// A message parsed in place: tag and data point into the buffer the
+// encoded message was read into (see Connection::receive_view), so
+// parsing one doesn't copy or allocate anything
+struct MessageView {
+  Slice tag;
+  Slice data;
+};
+
 // standard message tags (note that you don't need to worry about
 // "senduser" or "empty" messages)
 #define TAG_ERR       "err"       // protocol error
@@ -35,5 +71,31 @@ struct Message {
 #define TAG_QUIT      "quit"      // quit
 #define TAG_DELIVERY  "delivery"  // message delivered by server to receiving client
 #define TAG_EMPTY     "empty"     // sent by server to receiving client to indicate no msgs available
+#define TAG_PROTO     "proto"     // choose the wire protocol (before logging in)
+
+// the two wire protocols a Connection can speak: all connections start
+// out using text, and switch to binary if the client sends
+// "proto:binary" before logging in (the server's ok reply is the last
+// text message)
+enum Protocol {
+  PROTO_TEXT,   // "tag:data\n", at most MAX_LEN characters in all
+  PROTO_BINARY, // tag id (1 byte), data length (varint), data
+};
+
+// tag ids used by the binary protocol
+enum TagId {
+  TAG_ID_ERR = 1,
+  TAG_ID_OK,
+  TAG_ID_SLOGIN,
+  TAG_ID_RLOGIN,
+  TAG_ID_JOIN,
+  TAG_ID_LEAVE,
+  TAG_ID_SENDALL,
+  TAG_ID_SENDUSER,
+  TAG_ID_QUIT,
+  TAG_ID_DELIVERY,
+  TAG_ID_EMPTY,
+  TAG_ID_PROTO,
+};
 
 #endif // MESSAGE_H
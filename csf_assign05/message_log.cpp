@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "message.h"
+#include "guard.h"
+#include "message_log.h"
+
+namespace
+{
+
+  //a record is a header followed by its payload: the room, the sender
+  //(each preceded by a 2-byte length) and the text; a record whose
+  //length is 0 marks the end of the data in a segment
+  struct RecordHeader
+  {
+    uint32_t length;   //of the payload
+    uint32_t checksum; //CRC-32 of the payload
+  };
+
+  const size_t NAME_DIGITS = 20;
+
+  //add len bytes to a CRC-32 (which starts out as 0)
+  uint32_t crc32(uint32_t crc, const char *data, size_t len)
+  {
+    static uint32_t table[256];
+    static bool initialized = [] {
+      for (uint32_t i = 0; i < 256; i++)
+      {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+          c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        table[i] = c;
+      }
+      return true;
+    }();
+    (void)initialized;
+
+    crc ^= 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+      crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+  }
+
+  void put_name(char *&p, const std::string &name)
+  {
+    uint16_t n = name.size();
+    memcpy(p, &n, sizeof(n));
+    memcpy(p + sizeof(n), name.data(), n);
+    p += sizeof(n) + n;
+  }
+
+  uint32_t crc32_name(uint32_t crc, const std::string &name)
+  {
+    uint16_t n = name.size();
+    crc = crc32(crc, (const char *)&n, sizeof(n));
+    return crc32(crc, name.data(), n);
+  }
+
+  bool get_name(const char *&p, const char *end, Slice &name)
+  {
+    uint16_t n;
+    if (end - p < (ssize_t)sizeof(n))
+      return false;
+    memcpy(&n, p, sizeof(n));
+    if (end - p - (ssize_t)sizeof(n) < n)
+      return false;
+    name = Slice(p + sizeof(n), n);
+    p += sizeof(n) + n;
+    return true;
+  }
+
+}
+
+MessageLog::MessageLog(const std::string &dir)
+    : m_dir(dir), m_written(0), m_durable(0), m_flusher_idle(false),
+      m_failed(false), m_stopping(false), m_started(false)
+{
+  pthread_mutex_init(&m_lock, nullptr);
+  pthread_cond_init(&m_dirty, nullptr);
+  pthread_cond_init(&m_flushed, nullptr);
+}
+
+MessageLog::~MessageLog()
+{
+  if (m_started)
+  {
+    {
+      Guard g(m_lock);
+      m_stopping = true;
+      pthread_cond_signal(&m_dirty);
+    }
+    pthread_join(m_flusher, nullptr);
+  }
+  for (Segment &segment : m_segments)
+    close_segment(segment);
+  pthread_cond_destroy(&m_flushed);
+  pthread_cond_destroy(&m_dirty);
+  pthread_mutex_destroy(&m_lock);
+}
+
+std::string MessageLog::segment_path(uint64_t base) const
+{
+  char name[NAME_DIGITS + 8];
+  snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)base);
+  return m_dir + "/" + name;
+}
+
+bool MessageLog::open(RecoverFn fn, void *arg)
+{
+  mkdir(m_dir.c_str(), 0755);
+  DIR *dir = opendir(m_dir.c_str());
+  if (!dir)
+    return false;
+
+  //find the existing segments (named by their base, in decimal)
+  std::vector<uint64_t> bases;
+  while (struct dirent *entry = readdir(dir))
+  {
+    const char *name = entry->d_name;
+    if (strlen(name) != NAME_DIGITS + 4 || strcmp(name + NAME_DIGITS, ".log") != 0)
+      continue;
+    bases.push_back(strtoull(name, nullptr, 10));
+  }
+  closedir(dir);
+  std::sort(bases.begin(), bases.end());
+
+  size_t end = 0;
+  for (uint64_t base : bases)
+  {
+    if (!recover_segment(segment_path(base), fn, arg, end))
+      return false;
+    m_files.push_back(base);
+  }
+
+  //new messages go after the data recovered in the last segment
+  //(overwriting whatever follows it, such as a partly written record),
+  //or in a new one
+  if (!bases.empty())
+    m_files.pop_back();
+  uint64_t base = bases.empty() ? 0 : bases.back();
+  if (!add_segment(base, end))
+    return false;
+  m_written = m_durable = base + end;
+
+  if (pthread_create(&m_flusher, nullptr, run_flusher, this) != 0)
+    return false;
+  m_started = true;
+  return true;
+}
+
+bool MessageLog::recover_segment(const std::string &path, RecoverFn fn, void *arg, size_t &end)
+{
+  end = 0;
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0)
+  {
+    ::close(fd);
+    return st.st_size == 0;
+  }
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  //read records up to the end marker, or the first one that wasn't
+  //completely written before the server stopped
+  const char *data = static_cast<const char *>(map);
+  size_t pos = 0;
+  while (pos + sizeof(RecordHeader) <= (size_t)st.st_size)
+  {
+    RecordHeader header;
+    memcpy(&header, data + pos, sizeof(header));
+    const char *payload = data + pos + sizeof(header);
+    if (header.length == 0 || header.length > st.st_size - pos - sizeof(header) ||
+        crc32(0, payload, header.length) != header.checksum)
+      break;
+
+    const char *p = payload;
+    const char *payload_end = payload + header.length;
+    Slice room, sender;
+    if (!get_name(p, payload_end, room) || !get_name(p, payload_end, sender))
+      break;
+    fn(room, sender, Slice(p, payload_end - p), arg);
+    pos += sizeof(header) + header.length;
+  }
+  end = pos;
+  munmap(map, st.st_size);
+  return true;
+}
+
+bool MessageLog::add_segment(uint64_t base, size_t keep)
+{
+  Segment segment;
+  segment.base = base;
+  int flags = O_RDWR | O_CREAT | O_CLOEXEC | (keep == 0 ? O_TRUNC : 0);
+  segment.fd = ::open(segment_path(base).c_str(), flags, 0644);
+  if (segment.fd < 0)
+    return false;
+
+  //allocate the whole file up front, so a full disk is an error here
+  //rather than a SIGBUS when writing to the mapping
+  void *map = MAP_FAILED;
+  if (posix_fallocate(segment.fd, 0, SEGMENT_SIZE) == 0)
+    map = mmap(nullptr, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+  if (map == MAP_FAILED)
+  {
+    ::close(segment.fd);
+    if (keep == 0)
+      unlink(segment_path(base).c_str());
+    return false;
+  }
+  segment.data = static_cast<char *>(map);
+  if (keep > 0)
+    memset(segment.data + keep, 0, SEGMENT_SIZE - keep);
+  m_segments.push_back(segment);
+
+  //drop the oldest segments (long since flushed)
+  m_files.push_back(base);
+  while (m_files.size() > MAX_SEGMENTS)
+  {
+    unlink(segment_path(m_files.front()).c_str());
+    m_files.pop_front();
+  }
+  return true;
+}
+
+void MessageLog::close_segment(Segment &segment)
+{
+  munmap(segment.data, SEGMENT_SIZE);
+  ::close(segment.fd);
+}
+
+uint64_t MessageLog::append(const std::string &room, const std::string &sender, const Slice &text)
+{
+  if (room.size() > UINT16_MAX || sender.size() > UINT16_MAX)
+    return 0;
+
+  RecordHeader header;
+  header.length = 2 + room.size() + 2 + sender.size() + text.len;
+  header.checksum = crc32(crc32_name(crc32_name(0, room), sender), text.data, text.len);
+  size_t size = sizeof(RecordHeader) + header.length;
+
+  Guard g(m_lock);
+  if (m_failed)
+    return 0;
+
+  //a record that doesn't fit goes at the start of a new segment (the
+  //rest of the current one is left as zeroes, which ends it)
+  Segment *segment = &m_segments.back();
+  if (m_written - segment->base + size > SEGMENT_SIZE)
+  {
+    if (!add_segment(segment->base + SEGMENT_SIZE))
+      return 0;
+    segment = &m_segments.back();
+    m_written = segment->base;
+  }
+
+  //(if the server stops before a record is completely on disk, its
+  //checksum won't match, and recovery stops there)
+  char *p = segment->data + (m_written - segment->base);
+  memcpy(p, &header, sizeof(header));
+  p += sizeof(header);
+  put_name(p, room);
+  put_name(p, sender);
+  memcpy(p, text.data, text.len);
+
+  m_written += size;
+  if (m_flusher_idle)
+  {
+    m_flusher_idle = false;
+    pthread_cond_signal(&m_dirty);
+  }
+  return m_written;
+}
+
+bool MessageLog::wait(uint64_t lsn)
+{
+  Guard g(m_lock);
+  while (m_durable < lsn && !m_failed)
+    pthread_cond_wait(&m_flushed, &m_lock);
+  return m_durable >= lsn;
+}
+
+bool MessageLog::is_durable(uint64_t lsn) const
+{
+  Guard g(m_lock);
+  return m_durable >= lsn;
+}
+
+bool MessageLog::has_failed() const
+{
+  Guard g(m_lock);
+  return m_failed;
+}
+
+void MessageLog::add_listener(Listener *listener)
+{
+  Guard g(m_lock);
+  m_listeners.push_back(listener);
+}
+
+void *MessageLog::run_flusher(void *arg)
+{
+  static_cast<MessageLog *>(arg)->flush_loop();
+  return nullptr;
+}
+
+void MessageLog::flush_loop()
+{
+  static const uint64_t PAGE_SIZE = sysconf(_SC_PAGESIZE);
+
+  while (true)
+  {
+    //take everything appended so far as one batch
+    uint64_t start, end;
+    std::vector<Segment> segments;
+    {
+      Guard g(m_lock);
+      while (m_written == m_durable && !m_stopping && !m_failed)
+      {
+        m_flusher_idle = true;
+        pthread_cond_wait(&m_dirty, &m_lock);
+      }
+      m_flusher_idle = false;
+      if (m_written == m_durable || m_failed)
+        break;
+      start = m_durable;
+      end = m_written;
+      for (const Segment &segment : m_segments)
+      {
+        if (segment.base < end && segment.base + SEGMENT_SIZE > start)
+          segments.push_back(segment);
+      }
+    }
+
+    //write it out without the lock, so appends carry on meanwhile
+    //(only this thread unmaps segments)
+    bool ok = true;
+    for (const Segment &segment : segments)
+    {
+      uint64_t from = std::max(start, segment.base) - segment.base;
+      uint64_t to = std::min(end, segment.base + SEGMENT_SIZE) - segment.base;
+      from -= from % PAGE_SIZE;
+      if (msync(segment.data + from, to - from, MS_SYNC) < 0)
+        ok = false;
+    }
+
+    std::vector<Listener *> listeners;
+    {
+      Guard g(m_lock);
+      if (ok)
+        m_durable = end;
+      else
+        m_failed = true;
+
+      //segments before the current one are done with once flushed
+      while (m_segments.size() > 1 && m_segments.front().base + SEGMENT_SIZE <= m_durable)
+      {
+        close_segment(m_segments.front());
+        m_segments.pop_front();
+      }
+      pthread_cond_broadcast(&m_flushed);
+      listeners = m_listeners;
+    }
+    for (Listener *listener : listeners)
+      listener->log_flushed();
+  }
+}
@@ -0,0 +1,107 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+struct Slice;
+
+// Durable record of every message broadcast to a room, so the rooms'
+// recent history survives a restart. The log is a directory of
+// fixed-size segment files, each mapped into memory: appending a
+// message is just copying it into the current segment (with the lock
+// held), and a flusher thread writes the new data to disk with msync.
+// A sender's reply waits until its message is on disk, but the flusher
+// takes everything appended while it was busy with the previous flush,
+// so however many senders are waiting, there is one flush per batch
+// (group commit) rather than one per message. Only the reply waits:
+// the message is broadcast as soon as it is appended, so receivers may
+// see a message that is lost if the server crashes before the flush
+// (the sender, though, never gets "ok" for a message that's lost).
+//
+// Positions in the log (LSNs) are byte offsets over all segments, and
+// a segment's file is named after the position it starts at. Only the
+// last MAX_SEGMENTS segments are kept.
+class MessageLog {
+public:
+  // notified (by the flusher thread) after each flush
+  class Listener {
+  public:
+    virtual ~Listener() { }
+    virtual void log_flushed() = 0;
+  };
+
+  // called by recover for each message found in the log, oldest first
+  typedef void (*RecoverFn)(const Slice &room, const Slice &sender,
+                            const Slice &text, void *arg);
+
+  MessageLog(const std::string &dir);
+  ~MessageLog();
+
+  // read back the messages in the existing segments (if any), then
+  // start a new segment and the flusher thread; false on error
+  bool open(RecoverFn fn, void *arg);
+
+  // append a message, returning the position it ends at, which
+  // becomes durable (see wait) once a flush gets that far (0 if the
+  // message couldn't be appended)
+  uint64_t append(const std::string &room, const std::string &sender, const Slice &text);
+
+  // block until the log is durable up to lsn, false if it never will
+  // be (because writing it failed)
+  bool wait(uint64_t lsn);
+
+  // non-blocking versions of wait: true if the log is durable up to
+  // lsn, and whether flushing has failed
+  bool is_durable(uint64_t lsn) const;
+  bool has_failed() const;
+
+  // the listener is told about every flush (for an event loop, which
+  // can't block in wait); listeners can't be removed
+  void add_listener(Listener *listener);
+
+  enum { SEGMENT_SIZE = 8 << 20, MAX_SEGMENTS = 4 };
+
+private:
+  // prohibit value semantics
+  MessageLog(const MessageLog &);
+  MessageLog &operator=(const MessageLog &);
+
+  struct Segment {
+    uint64_t base;  // position of its first byte
+    int fd;
+    char *data;     // mapping of the whole file
+  };
+
+  std::string segment_path(uint64_t base) const;
+  // end is set to the end of the valid records in the segment
+  bool recover_segment(const std::string &path, RecoverFn fn, void *arg, size_t &end);
+
+  // start the current segment at base, keeping the first keep bytes
+  // of its file (if it exists) and clearing the rest; m_lock must be
+  // held (except during open)
+  bool add_segment(uint64_t base, size_t keep = 0);
+  static void close_segment(Segment &segment);
+
+  static void *run_flusher(void *arg);
+  void flush_loop();
+
+  std::string m_dir;
+  mutable pthread_mutex_t m_lock;
+  pthread_cond_t m_dirty;   // the flusher waits for appends
+  pthread_cond_t m_flushed; // senders wait for flushes
+  std::deque<Segment> m_segments; // mapped segments, the last is current
+  std::deque<uint64_t> m_files;   // bases of the segment files kept
+  uint64_t m_written;       // end of the data appended so far
+  uint64_t m_durable;       // end of the data flushed so far
+  bool m_flusher_idle;
+  bool m_failed;
+  bool m_stopping;
+  bool m_started;
+  pthread_t m_flusher;
+  std::vector<Listener *> m_listeners;
+};
+
+#endif // MESSAGE_LOG_H
@@ -1,72 +1,177 @@
 #include <cassert>
-#include <ctime>
+#include "frame.h"
+#include "guard.h"
+#include "metrics.h"
+#include "mpsc_message_queue.h"
 #include "message_queue.h"
 
-MessageQueue::MessageQueue()
+////////////////////////////////////////////////////////////////////////
+// MessageQueue (common to both implementations)
+////////////////////////////////////////////////////////////////////////
+
+MessageQueue *MessageQueue::create(Kind kind, size_t capacity, OverflowPolicy policy)
+{
+  if (kind == LOCK_FREE)
+    return new MpscMessageQueue(capacity, policy);
+  return new LockedMessageQueue(capacity, policy);
+}
+
+MessageQueue::MessageQueue(size_t capacity, OverflowPolicy policy)
+    : m_closed(false), m_aborted(false), m_listener(nullptr),
+      m_capacity(capacity), m_policy(policy)
 {
-  // TODO: initialize the mutex and the semaphore
+  // TODO: initialize the mutex and the condition variable
   pthread_mutex_init(&m_lock, nullptr);
-  sem_init(&m_avail, 0, 0);
+  pthread_cond_init(&m_avail, nullptr);
 }
 
 MessageQueue::~MessageQueue()
 {
-  // TODO: destroy the mutex and the semaphore
+  // TODO: destroy the mutex and the condition variable
+  pthread_cond_destroy(&m_avail);
+  pthread_mutex_destroy(&m_lock);
+}
+
+Frame *MessageQueue::try_dequeue()
+{
+  Frame *frame;
+  return dequeue_batch(&frame, 1) ? frame : nullptr;
+}
+
+void MessageQueue::close()
+{
+  Guard g(m_lock);
+  m_closed = true;
+  notify_locked();
+}
+
+bool MessageQueue::is_closed() const
+{
+  return m_closed.load(std::memory_order_acquire);
+}
+
+bool MessageQueue::is_aborted() const
+{
+  Guard g(m_lock);
+  return m_aborted;
+}
+
+void MessageQueue::set_listener(MessageQueueListener *listener)
+{
+  Guard g(m_lock);
+  m_listener = listener;
+}
+
+void MessageQueue::notify_locked()
+{
+  pthread_cond_broadcast(&m_avail);
+  if (m_listener)
+    m_listener->message_available();
+}
+
+void MessageQueue::abort_locked()
+{
+  if (m_closed)
+    return;
+  m_closed = true;
+  m_aborted = true;
+  pthread_cond_broadcast(&m_avail);
+  if (m_listener)
+    m_listener->disconnect();
+}
+
+////////////////////////////////////////////////////////////////////////
+// LockedMessageQueue
+////////////////////////////////////////////////////////////////////////
+
+LockedMessageQueue::LockedMessageQueue(size_t capacity, OverflowPolicy policy)
+    : MessageQueue(capacity, policy)
+{
+}
+
+LockedMessageQueue::~LockedMessageQueue()
+{
   // clear messages first, then handle destruction
+  Metrics::add(Metrics::QUEUED_MESSAGES, -(int64_t)m_messages.size());
   while (!m_messages.empty())
   {
-    Message *msg = m_messages.front();
+    m_messages.front()->unref();
     m_messages.pop_front();
-    delete msg;
   }
-  //semaphore and mutex destruction
-  sem_destroy(&m_avail);
-  pthread_mutex_destroy(&m_lock);
 }
 
-void MessageQueue::enqueue(Message *msg)
+size_t LockedMessageQueue::enqueue(Frame *frame)
 {
   // TODO: put the specified message on the queue
 
-  // be sure to notify any thread waiting for a message to be
-  // available by calling sem_post
-  pthread_mutex_lock(&m_lock);
-  m_messages.push_back(msg);
-  pthread_mutex_unlock(&m_lock);
+  Guard g(m_lock);
+  if (m_closed)
+  {
+    frame->unref();
+    return 1;
+  }
 
-  // notify any waiting threads
-  sem_post(&m_avail);
-}
+  //a full queue means the receiver isn't keeping up
+  if (m_capacity > 0 && m_messages.size() >= m_capacity)
+  {
+    if (m_policy == DROP_NEWEST)
+    {
+      frame->unref();
+      return 1;
+    }
+    if (m_policy == DROP_OLDEST)
+    {
+      m_messages.front()->unref();
+      m_messages.pop_front();
+      m_messages.push_back(frame);
+      return 1;
+    }
 
-Message *MessageQueue::dequeue()
-{
-  struct timespec ts;
+    //DISCONNECT: free everything right away, even if the consumer
+    //is stuck writing to its client
+    size_t dropped = m_messages.size() + 1;
+    for (Frame *queued : m_messages)
+      queued->unref();
+    m_messages.clear();
+    frame->unref();
+    abort_locked();
+    return dropped;
+  }
 
-  // get the current time using clock_gettime:
-  // we don't check the return value because the only reason
-  // this call would fail is if we specify a clock that doesn't
-  // exist
-  clock_gettime(CLOCK_REALTIME, &ts);
+  // be sure to notify any thread waiting for a message to be
+  // available (a listener only needs to hear about the first one,
+  // since the consumer always empties the queue before waiting again)
+  m_messages.push_back(frame);
+  if (m_messages.size() == 1)
+    notify_locked();
+  return 0;
+}
 
-  // compute a time one second in the future
-  ts.tv_sec += 1;
+Frame *LockedMessageQueue::dequeue()
+{
+  // TODO: wait (without a timeout) until a message is available or the
+  //       queue is closed, then remove the next message and return it
+  Guard g(m_lock);
+  while (m_messages.empty() && !m_closed)
+    pthread_cond_wait(&m_avail, &m_lock);
 
-  // TODO: call sem_timedwait to wait up to 1 second for a message
-  //       to be available, return nullptr if no message is available
-  int ret = sem_timedwait(&m_avail, &ts);
-  if (ret != 0)
-  {
-    // timeout or error
+  //closed and drained
+  if (m_messages.empty())
     return nullptr;
-  }
 
-  // TODO: remove the next message from the queue, return it
-  //lock before removing, then make sure not empty and remove, then unlock
-  pthread_mutex_lock(&m_lock);
-  assert(!m_messages.empty());
-  Message *msg = m_messages.front();
+  Frame *frame = m_messages.front();
   m_messages.pop_front();
-  pthread_mutex_unlock(&m_lock);
+  return frame;
+}
 
-  return msg;
+size_t LockedMessageQueue::dequeue_batch(Frame **frames, size_t max)
+{
+  Guard g(m_lock);
+  size_t n = 0;
+  while (n < max && !m_messages.empty())
+  {
+    frames[n++] = m_messages.front();
+    m_messages.pop_front();
+  }
+  return n;
 }
@@ -2,32 +2,126 @@
 #define MESSAGE_QUEUE_H
 
 #include <deque>
+#include <atomic>
+#include <cstddef>
 #include <pthread.h>
-#include <semaphore.h>
-struct Message;
+#include "pool.h"
+class Frame;
 
-// This data type represents a queue of Messages waiting to
-// be delivered to a receiver
+// Interface for an object that wants to be told when a message is
+// added to a MessageQueue, rather than having a thread block in
+// dequeue (this is how the epoll engine learns that a receiver
+// has pending deliveries, and how a receiver thread waits for
+// messages and its socket at the same time)
+class MessageQueueListener {
+public:
+  virtual ~MessageQueueListener() { }
+
+  // called by the enqueuing thread (with the queue's mutex held) when
+  // a message is added to an empty queue, or when the queue is closed
+  virtual void message_available() = 0;
+
+  // called (also with the queue's mutex held) when the queue overflowed
+  // under the DISCONNECT policy: the consumer should drop its client
+  // without waiting to finish writing whatever it is writing
+  virtual void disconnect() { message_available(); }
+};
+
+// This data type represents a queue of Messages (already encoded
+// as delivery Frames) waiting to be delivered to a receiver. Any
+// number of threads may enqueue, but only one thread (the receiver's)
+// may dequeue. There are two implementations, chosen at startup.
 class MessageQueue {
 public:
-  MessageQueue();
-  ~MessageQueue();
+  enum Kind {
+    LOCKED,    // std::deque guarded by a mutex
+    LOCK_FREE, // lock-free multi-producer/single-consumer linked list
+  };
+
+  // what enqueue does when a bounded queue is full
+  enum OverflowPolicy {
+    DROP_OLDEST, // discard the oldest queued message to make room
+    DROP_NEWEST, // discard the message being enqueued
+    DISCONNECT,  // discard everything and disconnect the (slow) receiver
+  };
+
+  // create a queue holding at most capacity messages (0 means no limit)
+  static MessageQueue *create(Kind kind, size_t capacity = 0,
+                              OverflowPolicy policy = DROP_OLDEST);
+
+  virtual ~MessageQueue();
+
+  // queues are pooled (a receiver's queue comes and goes with it)
+  static void *operator new(size_t size) { return Pool::allocate(size); }
+  static void operator delete(void *p, size_t size) { Pool::deallocate(p, size); }
+
+  // the queue takes over the caller's reference to an enqueued frame,
+  // and the caller of dequeue takes over the queue's reference;
+  // enqueue returns the number of messages that had to be dropped
+  // (because the queue was full, or is closed)
+  virtual size_t enqueue(Frame *frame) = 0; // will not block
+  virtual Frame *dequeue() = 0;   // blocks until a message is available or
+                                  // the queue is closed (then nullptr)
+  Frame *try_dequeue();           // will not block, nullptr if queue is empty
+
+  // remove up to max frames at once (without blocking), returns how many
+  virtual size_t dequeue_batch(Frame **frames, size_t max) = 0;
+
+  // wake up the consumer for good: once the queue is closed (and the
+  // messages already in it have been dequeued) dequeue returns nullptr
+  void close();
+  bool is_closed() const;
 
-  void enqueue(Message *msg); // will not block
-  Message *dequeue();         // blocks for at most a finite amount of time
+  // true if the queue was closed by overflowing under DISCONNECT
+  bool is_aborted() const;
+
+  // set (or clear, if nullptr) the listener notified by enqueue;
+  // once this returns, the previous listener won't be called again
+  void set_listener(MessageQueueListener *listener);
+
+protected:
+  MessageQueue(size_t capacity, OverflowPolicy policy);
+
+  // wake the consumer (signal m_avail and call the listener),
+  // m_lock must be held
+  void notify_locked();
+
+  // close the queue because it overflowed under DISCONNECT (the
+  // caller discards the queued messages), m_lock must be held
+  void abort_locked();
+
+  // the condition variable is signaled whenever a message is added
+  // to an empty queue (or the queue is closed), so a consumer blocked
+  // in dequeue sleeps until there is something to do rather than polling
+
+  mutable pthread_mutex_t m_lock;
+  pthread_cond_t m_avail;
+  std::atomic<bool> m_closed; // only changed with m_lock held
+  bool m_aborted;
+  MessageQueueListener *m_listener;
+
+  const size_t m_capacity;
+  const OverflowPolicy m_policy;
 
 private:
   // value semantics prohibited
   MessageQueue(const MessageQueue &);
   MessageQueue &operator=(const MessageQueue &);
+};
 
-  // these data members are sufficient to implement the
-  // enqueue and dequeue operations: the idea is that the semaphore
-  // keeps a count of how many messages are currently in the queue
+// MessageQueue implementation where m_lock must be held while
+// accessing the queue
+class LockedMessageQueue : public MessageQueue {
+public:
+  LockedMessageQueue(size_t capacity, OverflowPolicy policy);
+  virtual ~LockedMessageQueue();
 
-  pthread_mutex_t m_lock; // must be held while accessing queue
-  sem_t m_avail;
-  std::deque<Message *> m_messages;
+  virtual size_t enqueue(Frame *frame);
+  virtual Frame *dequeue();
+  virtual size_t dequeue_batch(Frame **frames, size_t max);
+
+private:
+  std::deque<Frame *, PoolAllocator<Frame *> > m_messages;
 };
 
 #endif // MESSAGE_QUEUE_H
@@ -0,0 +1,245 @@
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include "guard.h"
+#include "metrics.h"
+
+namespace
+{
+
+  //one thread's values, written only by that thread (so an update is
+  //a relaxed load and store rather than an atomic read-modify-write)
+  struct Block
+  {
+    std::atomic<int64_t> counters[Metrics::NUM_COUNTERS];
+    std::atomic<uint64_t> buckets[Metrics::NUM_HISTOGRAMS][Metrics::NUM_BUCKETS];
+    std::atomic<uint64_t> sums[Metrics::NUM_HISTOGRAMS];
+    unsigned samples;
+
+    Block() : samples(0)
+    {
+      for (auto &counter : counters)
+        counter.store(0, std::memory_order_relaxed);
+      for (auto &histogram : buckets)
+        for (auto &bucket : histogram)
+          bucket.store(0, std::memory_order_relaxed);
+      for (auto &sum : sums)
+        sum.store(0, std::memory_order_relaxed);
+    }
+  };
+
+  //the blocks of running threads, and the totals of exited ones
+  pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+  std::vector<Block *> blocks;
+  Block retired;
+
+  template <typename T>
+  void bump(std::atomic<T> &value, T n)
+  {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  //registers the thread's block when it is first used, and retires
+  //it when the thread exits
+  struct ThreadBlock
+  {
+    Block *block;
+
+    ThreadBlock() : block(new Block)
+    {
+      Guard g(blocks_lock);
+      blocks.push_back(block);
+    }
+
+    ~ThreadBlock()
+    {
+      Guard g(blocks_lock);
+      blocks.erase(std::find(blocks.begin(), blocks.end(), block));
+      for (int c = 0; c < Metrics::NUM_COUNTERS; c++)
+        bump(retired.counters[c], block->counters[c].load(std::memory_order_relaxed));
+      for (int h = 0; h < Metrics::NUM_HISTOGRAMS; h++)
+      {
+        for (int b = 0; b < Metrics::NUM_BUCKETS; b++)
+          bump(retired.buckets[h][b], block->buckets[h][b].load(std::memory_order_relaxed));
+        bump(retired.sums[h], block->sums[h].load(std::memory_order_relaxed));
+      }
+      delete block;
+    }
+  };
+
+  Block &local()
+  {
+    static thread_local ThreadBlock thread_block;
+    return *thread_block.block;
+  }
+
+  struct CounterInfo
+  {
+    const char *name;
+    const char *type;
+    const char *help;
+  };
+
+  const CounterInfo COUNTERS[Metrics::NUM_COUNTERS] = {
+    { "chat_connections_total", "counter", "Connections accepted" },
+    { "chat_disconnections_total", "counter", "Connections closed" },
+    { "chat_rejections_total", "counter", "Connections turned away for want of a worker thread" },
+    { "chat_rooms", "gauge", "Rooms in existence" },
+    { "chat_messages_received_total", "counter", "Messages received from clients" },
+    { "chat_invalid_messages_total", "counter", "Invalid messages received from clients" },
+    { "chat_broadcasts_total", "counter", "Messages broadcast to a room" },
+    { "chat_direct_messages_total", "counter", "Messages sent to a specific user" },
+    { "chat_deliveries_queued_total", "counter", "Deliveries added to receiver queues" },
+    { "chat_deliveries_dropped_total", "counter", "Deliveries dropped by full or closed queues" },
+    { "chat_deliveries_sent_total", "counter", "Deliveries taken from queues to be written" },
+    { "chat_queued_messages", "gauge", "Deliveries waiting in receiver queues" },
+    { "chat_room_lock_contended_total", "counter", "Room lock acquisitions that had to wait" },
+    { "chat_worker_threads", "gauge", "Threads in the worker pool" },
+  };
+
+  struct HistogramInfo
+  {
+    const char *name;
+    const char *help;
+    bool seconds; //values are nanoseconds, reported as seconds
+  };
+
+  const HistogramInfo HISTOGRAMS[Metrics::NUM_HISTOGRAMS] = {
+    { "chat_request_seconds", "Time to handle a received message", true },
+    { "chat_send_seconds", "Time to write replies and deliveries to a socket", true },
+    { "chat_broadcast_seconds", "Time to broadcast a message to a room", true },
+    { "chat_broadcast_fanout", "Receivers a broadcast was queued for", false },
+    { "chat_enqueue_seconds", "Time to add a delivery to a queue (sampled)", true },
+    { "chat_queue_delay_seconds", "Time from creating a delivery to dequeueing it", true },
+    { "chat_room_lock_wait_seconds", "Time spent waiting for a contended room lock", true },
+  };
+
+  void render_value(std::string &out, double value)
+  {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", value);
+    out += buf;
+  }
+
+}
+
+void Metrics::add(Counter counter, int64_t n)
+{
+  bump(local().counters[counter], n);
+}
+
+void Metrics::observe(Histogram histogram, uint64_t value)
+{
+  //bucket b holds values in [2^(b-1), 2^b), and bucket 0 holds 0
+  int b = value == 0 ? 0 : 64 - __builtin_clzll(value);
+  if (b >= NUM_BUCKETS)
+    b = NUM_BUCKETS - 1;
+  Block &block = local();
+  bump(block.buckets[histogram][b], (uint64_t)1);
+  bump(block.sums[histogram], value);
+}
+
+int64_t Metrics::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+bool Metrics::sample()
+{
+  return ++local().samples % ENQUEUE_SAMPLE == 0;
+}
+
+int64_t Metrics::total(Counter counter)
+{
+  Guard g(blocks_lock);
+  int64_t sum = retired.counters[counter].load(std::memory_order_relaxed);
+  for (Block *block : blocks)
+    sum += block->counters[counter].load(std::memory_order_relaxed);
+  return sum;
+}
+
+void Metrics::render(std::string &out)
+{
+  //add up the blocks (a thread's values may be a moment out of date)
+  int64_t counters[NUM_COUNTERS];
+  uint64_t buckets[NUM_HISTOGRAMS][NUM_BUCKETS];
+  uint64_t sums[NUM_HISTOGRAMS];
+  {
+    Guard g(blocks_lock);
+    for (int c = 0; c < NUM_COUNTERS; c++)
+      counters[c] = retired.counters[c].load(std::memory_order_relaxed);
+    for (int h = 0; h < NUM_HISTOGRAMS; h++)
+    {
+      for (int b = 0; b < NUM_BUCKETS; b++)
+        buckets[h][b] = retired.buckets[h][b].load(std::memory_order_relaxed);
+      sums[h] = retired.sums[h].load(std::memory_order_relaxed);
+    }
+    for (Block *block : blocks)
+    {
+      for (int c = 0; c < NUM_COUNTERS; c++)
+        counters[c] += block->counters[c].load(std::memory_order_relaxed);
+      for (int h = 0; h < NUM_HISTOGRAMS; h++)
+      {
+        for (int b = 0; b < NUM_BUCKETS; b++)
+          buckets[h][b] += block->buckets[h][b].load(std::memory_order_relaxed);
+        sums[h] += block->sums[h].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  for (int c = 0; c < NUM_COUNTERS; c++)
+  {
+    out += std::string("# HELP ") + COUNTERS[c].name + " " + COUNTERS[c].help + "\n";
+    out += std::string("# TYPE ") + COUNTERS[c].name + " " + COUNTERS[c].type + "\n";
+    out += std::string(COUNTERS[c].name) + " " + std::to_string(counters[c]) + "\n";
+  }
+
+  //the (derived) number of open connections
+  out += "# HELP chat_connections_open Connections currently open\n";
+  out += "# TYPE chat_connections_open gauge\n";
+  out += "chat_connections_open " +
+         std::to_string(counters[CONNECTIONS] - counters[DISCONNECTIONS]) + "\n";
+
+  for (int h = 0; h < NUM_HISTOGRAMS; h++)
+  {
+    const HistogramInfo &info = HISTOGRAMS[h];
+    double scale = info.seconds ? 1e-9 : 1.0;
+    out += std::string("# HELP ") + info.name + " " + info.help + "\n";
+    out += std::string("# TYPE ") + info.name + " histogram\n";
+    uint64_t count = 0;
+    for (int b = 0; b < NUM_BUCKETS - 1; b++)
+    {
+      count += buckets[h][b];
+      out += std::string(info.name) + "_bucket{le=\"";
+      render_value(out, (double)(1ULL << b) * scale);
+      out += "\"} " + std::to_string(count) + "\n";
+    }
+    count += buckets[h][NUM_BUCKETS - 1];
+    out += std::string(info.name) + "_bucket{le=\"+Inf\"} " + std::to_string(count) + "\n";
+    out += std::string(info.name) + "_sum ";
+    render_value(out, sums[h] * scale);
+    out += "\n";
+    out += std::string(info.name) + "_count " + std::to_string(count) + "\n";
+  }
+}
+
+void Metrics::render_labeled(std::string &out, const char *name,
+                             const char *label, const std::string &value,
+                             int64_t n)
+{
+  out += std::string(name) + "{" + label + "=\"";
+  for (char c : value)
+  {
+    if (c == '\\' || c == '"')
+      out += '\\';
+    if (c == '\n')
+      out += "\\n";
+    else
+      out += c;
+  }
+  out += "\"} " + std::to_string(n) + "\n";
+}
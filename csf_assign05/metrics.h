@@ -0,0 +1,103 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <cstdint>
+#include <pthread.h>
+
+// Counters and histograms describing what the server is doing, cheap
+// enough to keep up to date on its hot paths. Every thread updates its
+// own block of values (relaxed atomic stores, no shared cache lines),
+// and the blocks are only added up when the values are reported. A
+// thread's block is folded into a global total when the thread exits,
+// so nothing is lost when a client's thread goes away.
+//
+// A counter may go down as well as up (so it can also track something
+// like the number of queued messages), and a histogram counts values
+// in power-of-two buckets: usually durations in nanoseconds.
+class Metrics {
+public:
+  enum Counter {
+    CONNECTIONS,        // connections accepted
+    DISCONNECTIONS,     // connections closed
+    REJECTIONS,         // ...of which were turned away (no thread to serve them)
+    ROOMS,              // rooms in existence
+    MESSAGES_RECEIVED,  // messages received from clients
+    INVALID_MESSAGES,   // ...of which were invalid
+    BROADCASTS,         // messages broadcast to a room
+    DIRECT_MESSAGES,    // messages sent to a user (senduser)
+    DELIVERIES_QUEUED,  // deliveries added to receivers' queues
+    DELIVERIES_DROPPED, // deliveries dropped by full (or closed) queues
+    DELIVERIES_SENT,    // deliveries taken from queues to be written
+    QUEUED_MESSAGES,    // deliveries currently sitting in queues
+    LOCK_CONTENDED,     // room lock acquisitions that had to wait
+    WORKER_THREADS,     // threads in the thread engine's worker pool
+    NUM_COUNTERS
+  };
+
+  enum Histogram {
+    REQUEST_TIME,    // handling a received message (until its reply)
+    SEND_TIME,       // writing replies and deliveries to a socket
+    BROADCAST_TIME,  // Room::broadcast_message
+    BROADCAST_FANOUT,// receivers a broadcast was queued for (a count)
+    ENQUEUE_TIME,    // MessageQueue::enqueue (one in ENQUEUE_SAMPLE)
+    QUEUE_DELAY,     // from creating a delivery to dequeueing it
+    LOCK_WAIT,       // waiting for a contended room lock
+    NUM_HISTOGRAMS
+  };
+
+  // values in the last bucket are at least 2^(NUM_BUCKETS-2)
+  enum { NUM_BUCKETS = 36, ENQUEUE_SAMPLE = 16 };
+
+  // add to (or subtract from) a counter
+  static void add(Counter counter, int64_t n = 1);
+
+  // record a value in a histogram
+  static void observe(Histogram histogram, uint64_t value);
+
+  // current monotonic time in nanoseconds, for measuring durations
+  static int64_t now();
+
+  // true once every ENQUEUE_SAMPLE calls (per thread), to decide
+  // whether to time an operation too frequent to time every time
+  static bool sample();
+
+  // append every counter and histogram to out in the Prometheus text
+  // exposition format
+  static void render(std::string &out);
+
+  // current total of a counter (over all threads)
+  static int64_t total(Counter counter);
+
+  // append a line "name{label="value"} n" with value escaped for use
+  // in a label
+  static void render_labeled(std::string &out, const char *name,
+                             const char *label, const std::string &value,
+                             int64_t n);
+};
+
+// Like Guard, but counts the acquisitions that found the mutex held,
+// and how long they waited
+class MeasuredGuard {
+public:
+  MeasuredGuard(pthread_mutex_t &lock)
+    : lock(lock) {
+    if (pthread_mutex_trylock(&lock) != 0) {
+      int64_t start = Metrics::now();
+      pthread_mutex_lock(&lock);
+      Metrics::add(Metrics::LOCK_CONTENDED);
+      Metrics::observe(Metrics::LOCK_WAIT, Metrics::now() - start);
+    }
+  }
+
+  ~MeasuredGuard() {
+    pthread_mutex_unlock(&lock);
+  }
+
+private:
+  MeasuredGuard(const MeasuredGuard &);
+  MeasuredGuard &operator=(const MeasuredGuard &);
+  pthread_mutex_t &lock;
+};
+
+#endif // METRICS_H
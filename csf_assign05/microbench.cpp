@@ -0,0 +1,817 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "frame.h"
+#include "message_queue.h"
+#include "user.h"
+#include "room.h"
+#include "room_registry.h"
+#include "guard.h"
+#include "message.h"
+#include "connection.h"
+#include "pool.h"
+#include "message_log.h"
+
+// Microbenchmarks for the server's hot paths, run outside the server
+// so that no network or scheduling noise gets in the way.
+//
+// Usage: ./microbench queue|room|join|parse|alloc|log|receiver [count]
+
+// every heap allocation the benchmarks make is counted
+static std::atomic<long> g_allocations(0);
+
+void *operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+namespace {
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// report the given percentile of (sorted) latencies in microseconds
+double percentile_us(const std::vector<long long> &sorted, double pct) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t idx = (size_t)(pct / 100.0 * (sorted.size() - 1));
+  return sorted[idx] / 1000.0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// queue: MessageQueue throughput and latency, many producers
+////////////////////////////////////////////////////////////////////////
+
+struct ProducerArgs {
+  MessageQueue *queue;
+  long count;
+};
+
+void *producer(void *arg) {
+  ProducerArgs *args = static_cast<ProducerArgs *>(arg);
+  for (long i = 0; i < args->count; i++) {
+    // each frame carries the time it was enqueued
+    long long ts = now_ns();
+    args->queue->enqueue(Frame::create("t", std::string((const char *)&ts, sizeof(ts))));
+  }
+  return nullptr;
+}
+
+void bench_queue_kind(MessageQueue::Kind kind, int num_producers, long total) {
+  MessageQueue *queue = MessageQueue::create(kind);
+  long per_producer = total / num_producers;
+  total = per_producer * num_producers;
+
+  std::vector<long long> latencies;
+  latencies.reserve(total);
+
+  std::vector<pthread_t> threads(num_producers);
+  std::vector<ProducerArgs> args(num_producers);
+  long long start = now_ns();
+  for (int i = 0; i < num_producers; i++) {
+    args[i].queue = queue;
+    args[i].count = per_producer;
+    pthread_create(&threads[i], nullptr, producer, &args[i]);
+  }
+
+  // this thread is the single consumer
+  for (long i = 0; i < total; i++) {
+    Frame *frame = queue->dequeue();
+    long long ts;
+    memcpy(&ts, frame->data() + 2, sizeof(ts));
+    latencies.push_back(now_ns() - ts);
+    frame->unref();
+  }
+  long long elapsed = now_ns() - start;
+
+  for (int i = 0; i < num_producers; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  delete queue;
+
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << std::setw(9) << (kind == MessageQueue::LOCKED ? "locked" : "lockfree")
+            << std::setw(11) << num_producers
+            << std::setw(14) << (long)(total / (elapsed / 1e9))
+            << std::fixed << std::setprecision(1)
+            << std::setw(11) << percentile_us(latencies, 50)
+            << std::setw(11) << percentile_us(latencies, 99)
+            << std::setw(11) << percentile_us(latencies, 99.9)
+            << "\n";
+}
+
+void bench_queue(long total) {
+  std::cout << "     kind  producers      msgs/sec    p50(us)    p99(us)   p999(us)\n";
+  const int producer_counts[] = { 1, 8, 64 };
+  for (int num_producers : producer_counts) {
+    bench_queue_kind(MessageQueue::LOCKED, num_producers, total);
+    bench_queue_kind(MessageQueue::LOCK_FREE, num_producers, total);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// room: many senders broadcasting into one hot room
+////////////////////////////////////////////////////////////////////////
+
+const int ROOM_MEMBERS = 16;
+
+struct SenderArgs {
+  Room *room;
+  long count;
+  std::atomic<int> *running;
+};
+
+void *sender(void *arg) {
+  SenderArgs *args = static_cast<SenderArgs *>(arg);
+  std::string text(64, 'x');
+  for (long i = 0; i < args->count; i++) {
+    args->room->broadcast_message("sender", text);
+  }
+  args->running->fetch_sub(1);
+  return nullptr;
+}
+
+void bench_room_senders(int num_senders, long total, size_t history) {
+  // the receivers never read, so bound their queues (dropping the
+  // oldest message costs about what a dequeue would)
+  Room room("hot", history);
+  std::vector<User *> users;
+  for (int i = 0; i < ROOM_MEMBERS; i++) {
+    users.push_back(new User("r" + std::to_string(i),
+                             MessageQueue::create(MessageQueue::LOCKED, 1024)));
+    room.add_member(users.back());
+  }
+
+  long per_sender = total / num_senders;
+  total = per_sender * num_senders;
+  std::vector<pthread_t> threads(num_senders);
+  std::vector<SenderArgs> args(num_senders);
+  std::atomic<int> running(num_senders);
+  long long start = now_ns();
+  for (int i = 0; i < num_senders; i++) {
+    args[i].room = &room;
+    args[i].count = per_sender;
+    args[i].running = &running;
+    pthread_create(&threads[i], nullptr, sender, &args[i]);
+  }
+
+  // meanwhile, receivers keep joining and leaving (and are caught up
+  // on the history, if there is one)
+  long churn = 0;
+  std::vector<Frame *> replay;
+  while (running.load() > 0) {
+    User *user = users[churn++ % ROOM_MEMBERS];
+    room.remove_member(user);
+    room.add_member(user, history / 10, &replay);
+    for (Frame *frame : replay) {
+      frame->unref();
+    }
+    replay.clear();
+    sched_yield();
+  }
+  long long elapsed = now_ns() - start;
+
+  for (int i = 0; i < num_senders; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  for (User *user : users) {
+    room.remove_member(user);
+    user->unref();
+  }
+
+  std::cout << std::setw(9) << history
+            << std::setw(9) << num_senders
+            << std::setw(16) << (long)(total / (elapsed / 1e9))
+            << std::setw(16) << (long)(total * ROOM_MEMBERS / (elapsed / 1e9))
+            << std::setw(10) << churn
+            << "\n";
+}
+
+void bench_room(long total) {
+  std::cout << "  history  senders  broadcasts/sec  deliveries/sec  rejoins\n";
+  const int sender_counts[] = { 1, 4, 16, 64 };
+  for (size_t history : { 0, 100 }) {
+    for (int num_senders : sender_counts) {
+      bench_room_senders(num_senders, total, history);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// join: room lookups (find_or_create_room) from many threads, each
+// joining a room that has members and leaving it again
+////////////////////////////////////////////////////////////////////////
+
+const int NUM_ROOM_NAMES = 50000;
+
+// the registry the server used to have: one map, one lock
+class MapRegistry {
+public:
+  MapRegistry() { pthread_mutex_init(&m_lock, nullptr); }
+  ~MapRegistry() {
+    for (auto &pair : m_rooms) {
+      delete pair.second;
+    }
+    pthread_mutex_destroy(&m_lock);
+  }
+
+  Room *acquire(const std::string &room_name) {
+    Guard g(m_lock);
+    auto it = m_rooms.find(room_name);
+    if (it != m_rooms.end()) {
+      return it->second;
+    }
+    Room *room = new Room(room_name);
+    m_rooms[room_name] = room;
+    return room;
+  }
+
+  // rooms were never removed
+  void release(Room *) { }
+
+private:
+  std::map<std::string, Room *> m_rooms;
+  pthread_mutex_t m_lock;
+};
+
+template<typename Registry>
+struct JoinArgs {
+  Registry *registry;
+  const std::vector<std::string> *names;
+  long count;
+  unsigned seed;
+};
+
+template<typename Registry>
+void *joiner(void *arg) {
+  JoinArgs<Registry> *args = static_cast<JoinArgs<Registry> *>(arg);
+  unsigned x = args->seed;
+  for (long i = 0; i < args->count; i++) {
+    // xorshift, so picking a name costs next to nothing
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    Room *room = args->registry->acquire((*args->names)[x % args->names->size()]);
+    args->registry->release(room);
+  }
+  return nullptr;
+}
+
+template<typename Registry>
+void bench_join_registry(const char *kind, const std::vector<std::string> &names,
+                         int num_threads, long total) {
+  Registry registry;
+  std::vector<Room *> rooms;
+  for (const std::string &name : names) {
+    rooms.push_back(registry.acquire(name));
+  }
+  long per_thread = total / num_threads;
+  total = per_thread * num_threads;
+
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<JoinArgs<Registry> > args(num_threads);
+  long long start = now_ns();
+  for (int i = 0; i < num_threads; i++) {
+    args[i].registry = &registry;
+    args[i].names = &names;
+    args[i].count = per_thread;
+    args[i].seed = 2463534242u + i;
+    pthread_create(&threads[i], nullptr, joiner<Registry>, &args[i]);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  long long elapsed = now_ns() - start;
+  for (Room *room : rooms) {
+    registry.release(room);
+  }
+
+  std::cout << std::setw(9) << kind
+            << std::setw(9) << num_threads
+            << std::setw(14) << (long)(total / (elapsed / 1e9))
+            << "\n";
+}
+
+void bench_join(long total) {
+  std::vector<std::string> names;
+  for (int i = 0; i < NUM_ROOM_NAMES; i++) {
+    names.push_back("room" + std::to_string(i));
+  }
+
+  std::cout << "     kind  threads     joins/sec\n";
+  const int thread_counts[] = { 1, 4, 16, 64 };
+  for (int num_threads : thread_counts) {
+    bench_join_registry<MapRegistry>("map", names, num_threads, total);
+    bench_join_registry<RoomRegistry>("sharded", names, num_threads, total);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// parse: Connection::receive vs. receive_view on a stream of sendalls
+////////////////////////////////////////////////////////////////////////
+
+struct WriterArgs {
+  int fd;
+  const std::string *data;
+};
+
+void *writer(void *arg) {
+  WriterArgs *args = static_cast<WriterArgs *>(arg);
+  rio_writen(args->fd, args->data->data(), args->data->size());
+  close(args->fd);
+  return nullptr;
+}
+
+// how Connection::receive used to parse: rio_readlineb into a buffer,
+// then a std::string, then substr for the tag and data
+bool receive_line(rio_t *rio, Message &msg) {
+  char buf[Message::MAX_LEN + 1];
+  ssize_t n = rio_readlineb(rio, buf, Message::MAX_LEN + 1);
+  if (n <= 0) {
+    return false;
+  }
+  std::string line(buf, n);
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+    line.pop_back();
+  }
+  size_t colon = line.find(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  msg.tag = line.substr(0, colon);
+  msg.data = line.substr(colon + 1);
+  return true;
+}
+
+enum ParseMode { PARSE_LINE, PARSE_COPY, PARSE_VIEW };
+
+void bench_parse_mode(ParseMode mode, const std::string &input, long total) {
+  int fds[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  WriterArgs args = { fds[1], &input };
+  pthread_t thread;
+  pthread_create(&thread, nullptr, writer, &args);
+
+  Connection conn(fds[0]);
+  rio_t rio;
+  rio_readinitb(&rio, fds[0]);
+  long count = 0;
+  long allocations = 0;
+  long long start = now_ns();
+  if (mode == PARSE_VIEW) {
+    MessageView msg;
+    long before = g_allocations.load();
+    while (conn.receive_view(msg)) {
+      count++;
+    }
+    allocations = g_allocations.load() - before;
+  } else {
+    Message msg;
+    long before = g_allocations.load();
+    while (mode == PARSE_COPY ? conn.receive(msg) : receive_line(&rio, msg)) {
+      count++;
+    }
+    allocations = g_allocations.load() - before;
+  }
+  long long elapsed = now_ns() - start;
+  pthread_join(thread, nullptr);
+
+  if (count != total) {
+    std::cerr << "parsed " << count << " of " << total << " messages\n";
+  }
+  const char *names[] = { "line", "copy", "view" };
+  std::cout << std::setw(9) << names[mode]
+            << std::setw(14) << (long)(count / (elapsed / 1e9))
+            << std::fixed << std::setprecision(2)
+            << std::setw(12) << (double)allocations / count
+            << "\n";
+}
+
+void bench_parse(long total) {
+  // a typical sender's traffic, already encoded
+  std::string input;
+  std::string text = "sendall:" + std::string(60, 'x') + "\n";
+  for (long i = 0; i < total; i++) {
+    input += text;
+  }
+
+  std::cout << "     mode      msgs/sec  allocs/msg\n";
+  bench_parse_mode(PARSE_LINE, input, total);
+  bench_parse_mode(PARSE_COPY, input, total);
+  bench_parse_mode(PARSE_VIEW, input, total);
+}
+
+////////////////////////////////////////////////////////////////////////
+// alloc: heap allocations per delivery and per login, pooled or not
+////////////////////////////////////////////////////////////////////////
+
+const int ALLOC_MEMBERS = 8;
+const int ALLOC_ROUNDS = 4;
+
+void *drain(void *arg) {
+  // a receiver thread: writing is left out, but freeing isn't
+  MessageQueue *queue = static_cast<MessageQueue *>(arg);
+  Frame *frame;
+  while ((frame = queue->dequeue())) {
+    frame->unref();
+  }
+  return nullptr;
+}
+
+void bench_alloc_deliveries(MessageQueue::Kind kind, bool pooled, long total) {
+  Pool::set_enabled(pooled);
+  Room room("hot");
+  std::vector<User *> users;
+  std::vector<pthread_t> threads(ALLOC_MEMBERS);
+  for (int i = 0; i < ALLOC_MEMBERS; i++) {
+    users.push_back(new User("r" + std::to_string(i), MessageQueue::create(kind)));
+    room.add_member(users.back());
+    pthread_create(&threads[i], nullptr, drain, users.back()->mqueue);
+  }
+
+  // the receivers run the whole time, so every round after the first
+  // can reuse what the previous one freed
+  std::string text(64, 'x');
+  long per_round = total / ALLOC_ROUNDS;
+  long allocations = 0;
+  long long start = now_ns();
+  for (int round = 0; round < ALLOC_ROUNDS; round++) {
+    long before = g_allocations.load();
+    for (long i = 0; i < per_round; i++) {
+      room.broadcast_message("sender", text);
+      if (i % 256 == 255) {
+        sched_yield(); // let the receivers catch up
+      }
+    }
+    if (round > 0) {
+      allocations += g_allocations.load() - before;
+    }
+  }
+  long long elapsed = now_ns() - start;
+
+  for (User *user : users) {
+    user->mqueue->close();
+  }
+  for (int i = 0; i < ALLOC_MEMBERS; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  for (User *user : users) {
+    room.remove_member(user);
+    user->unref();
+  }
+
+  long deliveries = per_round * (ALLOC_ROUNDS - 1) * ALLOC_MEMBERS;
+  std::cout << std::setw(9) << (kind == MessageQueue::LOCKED ? "locked" : "lockfree")
+            << std::setw(8) << (pooled ? "yes" : "no")
+            << std::setw(16) << (long)(per_round * ALLOC_ROUNDS * ALLOC_MEMBERS / (elapsed / 1e9))
+            << std::fixed << std::setprecision(3)
+            << std::setw(17) << (double)allocations / deliveries
+            << "\n";
+}
+
+struct LoginArgs {
+  Room *room;
+  long count;
+};
+
+void *login_churn(void *arg) {
+  // what the server allocates for a receiver that logs in, joins a
+  // room and leaves again (but not its thread)
+  LoginArgs *args = static_cast<LoginArgs *>(arg);
+  for (long i = 0; i < args->count; i++) {
+    Connection *conn = new Connection(-1);
+    User *user = new User("receiver", MessageQueue::create(MessageQueue::LOCKED));
+    args->room->add_member(user);
+    args->room->remove_member(user);
+    user->unref();
+    delete conn;
+  }
+  return nullptr;
+}
+
+void bench_alloc_logins(bool pooled, long total) {
+  Pool::set_enabled(pooled);
+  Room room("lobby");
+  LoginArgs args = { &room, total / 2 };
+
+  // once to warm up the pools, then measured (each in its own thread,
+  // as the server's clients would be)
+  pthread_t thread;
+  pthread_create(&thread, nullptr, login_churn, &args);
+  pthread_join(thread, nullptr);
+
+  long before = g_allocations.load();
+  long long start = now_ns();
+  pthread_create(&thread, nullptr, login_churn, &args);
+  pthread_join(thread, nullptr);
+  long long elapsed = now_ns() - start;
+  long allocations = g_allocations.load() - before;
+
+  std::cout << std::setw(9) << "login"
+            << std::setw(8) << (pooled ? "yes" : "no")
+            << std::setw(16) << (long)(args.count / (elapsed / 1e9))
+            << std::fixed << std::setprecision(3)
+            << std::setw(17) << (double)allocations / args.count
+            << "\n";
+}
+
+void bench_alloc(long total) {
+  std::cout << "     kind  pooled         ops/sec  allocs/op\n";
+  bench_alloc_deliveries(MessageQueue::LOCKED, false, total);
+  bench_alloc_deliveries(MessageQueue::LOCKED, true, total);
+  bench_alloc_deliveries(MessageQueue::LOCK_FREE, false, total);
+  bench_alloc_deliveries(MessageQueue::LOCK_FREE, true, total);
+  bench_alloc_logins(false, total / 10);
+  bench_alloc_logins(true, total / 10);
+}
+
+////////////////////////////////////////////////////////////////////////
+// log: senders whose messages are saved in the message log before
+// they're acknowledged
+////////////////////////////////////////////////////////////////////////
+
+struct FlushCounter : MessageLog::Listener {
+  std::atomic<long> flushes;
+  FlushCounter() : flushes(0) { }
+  void log_flushed() { flushes.fetch_add(1); }
+};
+
+struct LogSenderArgs {
+  Room *room;
+  MessageLog *log;
+  long count;
+};
+
+void *log_sender(void *arg) {
+  // what a sendall does: append, broadcast, then wait for the flush
+  LogSenderArgs *args = static_cast<LogSenderArgs *>(arg);
+  std::string text(64, 'x');
+  for (long i = 0; i < args->count; i++) {
+    uint64_t lsn = args->log ? args->log->append("hot", "sender", text) : 0;
+    args->room->broadcast_message("sender", text);
+    if (lsn) {
+      args->log->wait(lsn);
+    }
+  }
+  return nullptr;
+}
+
+void remove_dir(const std::string &path) {
+  if (DIR *dir = opendir(path.c_str())) {
+    while (struct dirent *entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        unlink((path + "/" + entry->d_name).c_str());
+      }
+    }
+    closedir(dir);
+  }
+  rmdir(path.c_str());
+}
+
+void bench_log_senders(bool durable, int num_senders, long total) {
+  char dir[] = "/tmp/microbench-log-XXXXXX";
+  if (!mkdtemp(dir)) {
+    std::cerr << "Could not create a directory for the log\n";
+    return;
+  }
+  MessageLog *log = nullptr;
+  FlushCounter counter;
+  if (durable) {
+    log = new MessageLog(dir);
+    if (!log->open(nullptr, nullptr)) {
+      std::cerr << "Could not open the log in " << dir << "\n";
+      delete log;
+      remove_dir(dir);
+      return;
+    }
+    log->add_listener(&counter);
+  }
+
+  Room room("hot");
+  User *receiver = new User("receiver", MessageQueue::create(MessageQueue::LOCKED, 1024));
+  room.add_member(receiver);
+
+  long per_sender = total / num_senders;
+  total = per_sender * num_senders;
+  std::vector<pthread_t> threads(num_senders);
+  LogSenderArgs args = { &room, log, per_sender };
+  long long start = now_ns();
+  for (int i = 0; i < num_senders; i++) {
+    pthread_create(&threads[i], nullptr, log_sender, &args);
+  }
+  for (int i = 0; i < num_senders; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  long long elapsed = now_ns() - start;
+
+  room.remove_member(receiver);
+  receiver->unref();
+  delete log;
+  remove_dir(dir);
+
+  long flushes = counter.flushes.load();
+  std::cout << std::setw(9) << (durable ? "yes" : "no")
+            << std::setw(9) << num_senders
+            << std::setw(14) << (long)(total / (elapsed / 1e9));
+  if (durable) {
+    std::cout << std::fixed << std::setprecision(1)
+              << std::setw(16) << (double)total / (flushes ? flushes : 1);
+  }
+  std::cout << "\n";
+}
+
+void bench_log(long total) {
+  std::cout << "  durable  senders  messages/sec  msgs per flush\n";
+  const int sender_counts[] = { 1, 8, 64 };
+  for (int num_senders : sender_counts) {
+    bench_log_senders(false, num_senders, total);
+    bench_log_senders(true, num_senders, total);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// receiver: how fast the receiver client can take deliveries (this
+// plays the server, and runs ./receiver with its output in a pipe)
+////////////////////////////////////////////////////////////////////////
+
+struct PipeCounter {
+  int fd;
+  long lines;
+};
+
+void *count_lines(void *arg) {
+  PipeCounter *counter = static_cast<PipeCounter *>(arg);
+  std::vector<char> buf(64 * 1024);
+  ssize_t n;
+  while ((n = read(counter->fd, buf.data(), buf.size())) > 0) {
+    counter->lines += std::count(buf.data(), buf.data() + n, '\n');
+  }
+  return nullptr;
+}
+
+// the deliveries a burst is made of, encoded for the protocol
+std::string encode_deliveries(Protocol protocol, int count) {
+  std::string encoded;
+  for (int i = 0; i < count; i++) {
+    Message msg(TAG_DELIVERY, "tail:logger:" + std::string(40, 'a' + i % 26));
+    if (protocol == PROTO_BINARY) {
+      char header[Connection::MAX_BINARY_HEADER];
+      encoded.append(header, Connection::encode_binary_header(
+          Connection::tag_id(msg.tag), msg.data.size(), header));
+      encoded += msg.data;
+    } else {
+      std::string line;
+      Connection::encode(msg, line);
+      encoded += line;
+    }
+  }
+  return encoded;
+}
+
+void bench_receiver_mode(bool binary, bool fast, long total) {
+  int lsock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lsock, 1) < 0 ||
+      getsockname(lsock, (struct sockaddr *)&addr, &addr_len) < 0) {
+    std::cerr << "Could not listen for the receiver\n";
+    close(lsock);
+    return;
+  }
+
+  int out[2];
+  if (pipe(out) < 0) {
+    close(lsock);
+    return;
+  }
+  std::string port = std::to_string(ntohs(addr.sin_port));
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(out[1], STDOUT_FILENO);
+    close(out[0]);
+    close(out[1]);
+    close(lsock);
+    std::vector<const char *> args = { "./receiver" };
+    if (binary) {
+      args.push_back("-b");
+    }
+    if (fast) {
+      args.push_back("-f");
+    }
+    for (const char *arg : { "localhost", port.c_str(), "tailer", "tail" }) {
+      args.push_back(arg);
+    }
+    args.push_back(nullptr);
+    execv(args[0], const_cast<char **>(args.data()));
+    _exit(127);
+  }
+  close(out[1]);
+  PipeCounter counter = { out[0], 0 };
+  pthread_t thread;
+  pthread_create(&thread, nullptr, count_lines, &counter);
+
+  // answer the receiver's proto, rlogin and join
+  Connection conn(accept(lsock, nullptr, nullptr));
+  close(lsock);
+  Message request;
+  int replies = binary ? 3 : 2;
+  for (int i = 0; i < replies && conn.receive(request); i++) {
+    conn.send(Message(TAG_OK, "ok"));
+    if (request.tag == TAG_PROTO) {
+      conn.set_protocol(PROTO_BINARY);
+    }
+  }
+
+  // then deliver as fast as the receiver reads
+  const int BURST = 1000;
+  std::string burst = encode_deliveries(conn.get_protocol(), BURST);
+  long bursts = total / BURST;
+  long long start = now_ns();
+  for (long i = 0; i < bursts; i++) {
+    if (rio_writen(conn.get_fd(), &burst[0], burst.size()) != (ssize_t)burst.size()) {
+      break;
+    }
+  }
+  conn.close();
+  waitpid(pid, nullptr, 0);
+  pthread_join(thread, nullptr);
+  long long elapsed = now_ns() - start;
+  close(out[0]);
+
+  std::cout << std::setw(9) << (binary ? "binary" : "text")
+            << std::setw(6) << (fast ? "yes" : "no")
+            << std::setw(16) << (long)(counter.lines / (elapsed / 1e9))
+            << std::setw(12) << counter.lines
+            << "\n";
+}
+
+void bench_receiver(long total) {
+  std::cout << " protocol  fast  messages/sec   displayed\n";
+  bench_receiver_mode(false, false, total);
+  bench_receiver_mode(false, true, total);
+  bench_receiver_mode(true, false, total);
+  bench_receiver_mode(true, true, total);
+}
+
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "Usage: ./microbench queue|room|join|parse|alloc|log|receiver [count]\n";
+    return 1;
+  }
+  std::string which = argv[1];
+  long count = argc > 2 ? std::stol(argv[2]) : 1000000;
+
+  if (which == "queue") {
+    bench_queue(count);
+  } else if (which == "room") {
+    bench_room(count);
+  } else if (which == "join") {
+    bench_join(count);
+  } else if (which == "parse") {
+    bench_parse(count);
+  } else if (which == "alloc") {
+    bench_alloc(count);
+  } else if (which == "log") {
+    bench_log(count);
+  } else if (which == "receiver") {
+    bench_receiver(count);
+  } else {
+    std::cerr << "Unknown benchmark " << which << "\n";
+    return 1;
+  }
+  return 0;
+}
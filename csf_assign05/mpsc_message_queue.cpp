@@ -0,0 +1,173 @@
+#include <sched.h>
+#include "frame.h"
+#include "guard.h"
+#include "metrics.h"
+#include "mpsc_message_queue.h"
+
+MpscMessageQueue::MpscMessageQueue(size_t capacity, OverflowPolicy policy)
+    : MessageQueue(capacity, policy), m_count(0),
+      m_producers_pop(capacity > 0 && policy != DROP_NEWEST)
+{
+  pthread_mutex_init(&m_pop_lock, nullptr);
+
+  //the list always contains a dummy node
+  Node *stub = new Node;
+  stub->next.store(nullptr, std::memory_order_relaxed);
+  stub->frame = nullptr;
+  m_head.store(stub, std::memory_order_relaxed);
+  m_tail = stub;
+}
+
+MpscMessageQueue::~MpscMessageQueue()
+{
+  Frame *frame;
+  int64_t discarded = 0;
+  while ((frame = pop()))
+  {
+    frame->unref();
+    discarded++;
+  }
+  Metrics::add(Metrics::QUEUED_MESSAGES, -discarded);
+  delete m_tail;
+  pthread_mutex_destroy(&m_pop_lock);
+}
+
+size_t MpscMessageQueue::enqueue(Frame *frame)
+{
+  if (m_closed.load(std::memory_order_acquire))
+  {
+    frame->unref();
+    return 1;
+  }
+
+  //the count is only approximate while producers race, so a full
+  //queue can briefly hold a few more than m_capacity messages
+  size_t dropped = 0;
+  if (m_capacity > 0 && m_count.load(std::memory_order_relaxed) >= (long)m_capacity)
+  {
+    dropped = overflow(frame);
+    if (m_policy != DROP_OLDEST)
+      return dropped;
+  }
+
+  Node *node = new Node;
+  node->next.store(nullptr, std::memory_order_relaxed);
+  node->frame = frame;
+
+  //swap in the new head, then link the old head to it; until the link
+  //is stored the consumer can't see this node (or any added after it)
+  Node *prev = m_head.exchange(node, std::memory_order_acq_rel);
+  prev->next.store(node, std::memory_order_release);
+
+  //the producer that makes the queue non-empty wakes the consumer
+  if (m_count.fetch_add(1, std::memory_order_acq_rel) == 0)
+  {
+    Guard g(m_lock);
+    notify_locked();
+  }
+  return dropped;
+}
+
+size_t MpscMessageQueue::overflow(Frame *frame)
+{
+  if (m_policy == DROP_NEWEST)
+  {
+    frame->unref();
+    return 1;
+  }
+
+  if (m_policy == DROP_OLDEST)
+  {
+    //make room, and let enqueue go on to add the new message
+    Guard p(m_pop_lock);
+    Frame *oldest = pop();
+    if (!oldest)
+      return 0; //the oldest message isn't linked in yet
+    m_count.fetch_sub(1, std::memory_order_acq_rel);
+    oldest->unref();
+    return 1;
+  }
+
+  //DISCONNECT: free everything right away, even if the consumer
+  //is stuck writing to its client
+  Guard g(m_lock);
+  frame->unref();
+  if (m_closed)
+    return 1;
+  size_t dropped = 1;
+  {
+    Guard p(m_pop_lock);
+    Frame *queued;
+    while ((queued = pop()))
+    {
+      queued->unref();
+      dropped++;
+    }
+  }
+  m_count.fetch_sub(dropped - 1, std::memory_order_acq_rel);
+  abort_locked();
+  return dropped;
+}
+
+Frame *MpscMessageQueue::pop()
+{
+  Node *tail = m_tail;
+  Node *next = tail->next.load(std::memory_order_acquire);
+  if (!next)
+    return nullptr;
+
+  //next becomes the new dummy node
+  Frame *frame = next->frame;
+  next->frame = nullptr;
+  m_tail = next;
+  delete tail;
+  return frame;
+}
+
+Frame *MpscMessageQueue::dequeue()
+{
+  Frame *frame;
+  while (dequeue_batch(&frame, 1) == 0)
+  {
+    //m_count can only go from 0 to 1 while we hold the lock if the
+    //producer doing it then waits for us to release it in cond_wait
+    Guard g(m_lock);
+    if (m_count.load(std::memory_order_acquire) > 0)
+      continue;
+    if (m_closed)
+      return nullptr;
+    pthread_cond_wait(&m_avail, &m_lock);
+  }
+  return frame;
+}
+
+size_t MpscMessageQueue::dequeue_batch(Frame **frames, size_t max)
+{
+  while (true)
+  {
+    size_t n = pop_batch(frames, max);
+
+    //nothing reachable: if a message has been counted, a producer is
+    //between its exchange and its link, which only takes a moment;
+    //report the queue as empty only when it really is, otherwise the
+    //consumer could go to sleep and miss its wakeup (the wait is
+    //without m_pop_lock, which overflowing producers may need)
+    if (n > 0 || max == 0 || m_count.load(std::memory_order_acquire) <= 0)
+      return n;
+    sched_yield();
+  }
+}
+
+size_t MpscMessageQueue::pop_batch(Frame **frames, size_t max)
+{
+  if (m_producers_pop)
+    pthread_mutex_lock(&m_pop_lock);
+  size_t n = 0;
+  Frame *frame;
+  while (n < max && (frame = pop()))
+    frames[n++] = frame;
+  m_count.fetch_sub(n, std::memory_order_acq_rel);
+  if (m_producers_pop)
+    pthread_mutex_unlock(&m_pop_lock);
+  return n;
+}
@@ -0,0 +1,73 @@
+#ifndef MPSC_MESSAGE_QUEUE_H
+#define MPSC_MESSAGE_QUEUE_H
+
+#include <atomic>
+#include "message_queue.h"
+#include "pool.h"
+
+// MessageQueue implementation that producers (senders broadcasting to
+// the room) never lock: it is a linked list where enqueue atomically
+// swaps in a new head node and then links the previous head to it,
+// and the single consumer follows the links from the tail (this is
+// Dmitry Vyukov's MPSC queue). Since one Frame sits in many queues at
+// once, the links can't live in the Frame, so each queue has its own
+// small nodes.
+//
+// m_lock and the condition variable are only used when the queue is
+// empty: a producer that adds a message to an empty queue takes the
+// lock to wake the consumer, and the consumer takes it to go to sleep.
+//
+// A bounded queue that is full under DROP_OLDEST (or DISCONNECT) has a
+// producer pop the oldest messages itself, so in a queue like that,
+// popping is serialized by m_pop_lock (which is only contended when the
+// queue overflows). In any other queue only the consumer pops, and it
+// takes no lock.
+class MpscMessageQueue : public MessageQueue {
+public:
+  MpscMessageQueue(size_t capacity, OverflowPolicy policy);
+  virtual ~MpscMessageQueue();
+
+  virtual size_t enqueue(Frame *frame);
+  virtual Frame *dequeue();
+  virtual size_t dequeue_batch(Frame **frames, size_t max);
+
+private:
+  struct Node {
+    std::atomic<Node *> next;
+    Frame *frame;
+
+    // a node is allocated for every enqueue, so they are pooled
+    static void *operator new(size_t size) { return Pool::allocate(size); }
+    static void operator delete(void *p, size_t size) { Pool::deallocate(p, size); }
+  };
+
+  // remove the oldest node's frame, nullptr if none is reachable
+  // (m_pop_lock must be held if producers pop, except in the destructor)
+  Frame *pop();
+
+  // pop up to max frames (taking m_pop_lock if producers pop)
+  size_t pop_batch(Frame **frames, size_t max);
+
+  // called by enqueue when the queue is full
+  size_t overflow(Frame *frame);
+
+  // producers swap themselves in at the head
+  std::atomic<Node *> m_head;
+
+  // number of messages enqueued minus number dequeued; a producer
+  // counts its message only after linking it, so the consumer knows
+  // not to sleep while a count > 0 says a message is still being
+  // linked in (and the producer that takes the count from 0 to 1 is
+  // the one that wakes the consumer)
+  std::atomic<long> m_count;
+
+  // only the consumer touches the tail (a dummy node whose
+  // successor is the oldest message), so keep it off the producers'
+  // cache line
+  char m_pad[64];
+  bool m_producers_pop; // overflowing producers pop (see above)
+  pthread_mutex_t m_pop_lock;
+  Node *m_tail;
+};
+
+#endif // MPSC_MESSAGE_QUEUE_H
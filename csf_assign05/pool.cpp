@@ -0,0 +1,190 @@
+#include <new>
+#include <atomic>
+#include <cassert>
+#include "guard.h"
+#include "pool.h"
+
+namespace
+{
+
+  //each pool's depot holds at most this many batches, beyond which
+  //freed blocks go back to the heap
+  const size_t MAX_DEPOT = 64;
+
+  //a batch is about this many bytes (but 4 to 64 blocks)
+  const size_t BATCH_BYTES = 32 * 1024;
+
+  std::atomic<int> num_pools(0);
+  Pool *pools[32];
+  std::atomic<bool> pooling(true);
+
+  //a thread's caches are flushed by a key destructor, which is only
+  //called for threads that have set the key
+  pthread_key_t exit_key;
+  pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+  thread_local bool registered = false;
+
+  //block sizes of the size classes, which are powers of two
+  const size_t MIN_CLASS_SIZE = 16;
+  const int NUM_CLASSES = 8;
+
+  Pool &size_class(size_t size)
+  {
+    static Pool classes[NUM_CLASSES] = {
+      {16}, {32}, {64}, {128}, {256}, {512}, {1024}, {2048}
+    };
+    int c = size <= MIN_CLASS_SIZE ? 0 : 64 - __builtin_clzll(size - 1) - 4;
+    return classes[c];
+  }
+
+  void **next_of(void *block)
+  {
+    return static_cast<void **>(block);
+  }
+
+}
+
+thread_local Pool::Cache Pool::t_caches[MAX_POOLS];
+
+Pool::Pool(size_t block_size)
+    : m_block_size(block_size < sizeof(void *) ? sizeof(void *) : block_size),
+      m_batch(BATCH_BYTES / m_block_size),
+      m_id(num_pools.fetch_add(1))
+{
+  static_assert(sizeof(pools) / sizeof(pools[0]) == MAX_POOLS, "pool limit doesn't match");
+  assert(m_id < MAX_POOLS);
+  if (m_batch < 4)
+    m_batch = 4;
+  if (m_batch > 64)
+    m_batch = 64;
+  pthread_mutex_init(&m_lock, nullptr);
+  m_depot.reserve(MAX_DEPOT);
+  pools[m_id] = this;
+}
+
+void *Pool::allocate()
+{
+  if (!pooling.load(std::memory_order_relaxed))
+    return ::operator new(m_block_size);
+
+  Cache &cache = t_caches[m_id];
+  if (!cache.head)
+  {
+    refill(cache);
+    if (!cache.head)
+      return ::operator new(m_block_size);
+  }
+  void *block = cache.head;
+  cache.head = *next_of(block);
+  cache.count--;
+  return block;
+}
+
+void Pool::deallocate(void *block)
+{
+  if (!pooling.load(std::memory_order_relaxed))
+  {
+    ::operator delete(block);
+    return;
+  }
+
+  if (!registered)
+    register_thread();
+
+  Cache &cache = t_caches[m_id];
+  *next_of(block) = cache.head;
+  cache.head = block;
+  if (++cache.count >= 2 * m_batch)
+    flush(cache);
+}
+
+void *Pool::allocate(size_t size)
+{
+  if (size > MAX_SIZE)
+    return ::operator new(size);
+  return size_class(size).allocate();
+}
+
+void Pool::deallocate(void *block, size_t size)
+{
+  if (size > MAX_SIZE)
+    ::operator delete(block);
+  else
+    size_class(size).deallocate(block);
+}
+
+void Pool::set_enabled(bool enabled)
+{
+  pooling.store(enabled, std::memory_order_relaxed);
+}
+
+void Pool::refill(Cache &cache)
+{
+  if (!registered)
+    register_thread();
+
+  //take a batch from the depot (its blocks are already linked)
+  Guard g(m_lock);
+  if (m_depot.empty())
+    return;
+  cache.head = m_depot.back();
+  cache.count = m_batch;
+  m_depot.pop_back();
+}
+
+void Pool::flush(Cache &cache)
+{
+  //split a batch off the front of the thread's list
+  void *batch = cache.head;
+  void *last = batch;
+  for (size_t i = 1; i < m_batch; i++)
+    last = *next_of(last);
+  cache.head = *next_of(last);
+  cache.count -= m_batch;
+  *next_of(last) = nullptr;
+
+  {
+    Guard g(m_lock);
+    if (m_depot.size() < MAX_DEPOT)
+    {
+      m_depot.push_back(batch);
+      return;
+    }
+  }
+
+  //the depot is full
+  while (batch)
+  {
+    void *next = *next_of(batch);
+    ::operator delete(batch);
+    batch = next;
+  }
+}
+
+void Pool::register_thread()
+{
+  pthread_once(&exit_key_once, [] { pthread_key_create(&exit_key, thread_exit); });
+  pthread_setspecific(exit_key, &registered);
+  registered = true;
+}
+
+void Pool::thread_exit(void *)
+{
+  //whole batches go to the depots, and the rest back to the heap
+  registered = false;
+  int n = num_pools.load();
+  for (int i = 0; i < n; i++)
+  {
+    Pool *pool = pools[i];
+    Cache &cache = t_caches[i];
+    while (cache.count >= pool->m_batch)
+      pool->flush(cache);
+    while (cache.head)
+    {
+      void *next = *next_of(cache.head);
+      ::operator delete(cache.head);
+      cache.head = next;
+    }
+    cache.count = 0;
+  }
+}
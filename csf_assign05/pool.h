@@ -0,0 +1,96 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <cstddef>
+#include <vector>
+#include <pthread.h>
+
+// A Pool hands out fixed-size blocks of memory, recycling freed blocks
+// rather than returning them to the heap. Each thread keeps its own
+// free list of blocks, so allocating and freeing usually take no lock
+// at all. Since a block is often freed by a different thread than the
+// one that allocated it (a broadcast's Frame is allocated by the
+// sender's thread and freed by the last receiver to write it), a
+// thread whose free list grows too long moves a batch of blocks to a
+// shared depot, and a thread whose list is empty takes a batch from
+// it, so the lock is only taken once per batch. A thread's free lists
+// are moved to the depot when it exits.
+//
+// Pools must have static storage duration: they are never destroyed
+// (their blocks are only given back to the heap if the depot is full).
+class Pool {
+public:
+  Pool(size_t block_size);
+
+  void *allocate();
+  void deallocate(void *block);
+
+  size_t get_block_size() const { return m_block_size; }
+
+  // allocate a block of at least size bytes from the pool for its
+  // size class (or from the heap, for sizes bigger than MAX_SIZE);
+  // it must be freed with the same size
+  static void *allocate(size_t size);
+  static void deallocate(void *block, size_t size);
+
+  enum { MAX_SIZE = 2048 };
+
+  // turn pooling off (or back on), so that every allocation goes to
+  // the heap: only meant for benchmarks comparing the two
+  static void set_enabled(bool enabled);
+
+private:
+  // prohibit value semantics
+  Pool(const Pool &);
+  Pool &operator=(const Pool &);
+
+  enum { MAX_POOLS = 32 };
+
+  // a thread's free list for a pool, linked through the blocks' first
+  // words
+  struct Cache {
+    void *head;
+    size_t count;
+  };
+
+  void refill(Cache &cache);
+  void flush(Cache &cache);
+
+  // arrange for the thread's cached blocks (of every pool) to be
+  // moved to the depots when it exits
+  static void register_thread();
+  static void thread_exit(void *);
+
+  size_t m_block_size;
+  size_t m_batch;          // blocks moved to or from the depot at once
+  int m_id;                // index of this pool in the caches
+  pthread_mutex_t m_lock;  // protects the depot
+  std::vector<void *> m_depot; // lists of exactly m_batch free blocks
+
+  static thread_local Cache t_caches[MAX_POOLS];
+};
+
+// std::allocator replacement that draws from the size class pools,
+// for containers whose nodes are allocated and freed all the time
+template <typename T>
+class PoolAllocator {
+public:
+  typedef T value_type;
+
+  PoolAllocator() { }
+  template <typename U> PoolAllocator(const PoolAllocator<U> &) { }
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(Pool::allocate(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) {
+    Pool::deallocate(p, n * sizeof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) { return false; }
+
+#endif // POOL_H
@@ -2,14 +2,327 @@
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <cerrno>
+#include <ctime>
+#include <poll.h>
 #include "csapp.h"
 #include "message.h"
 #include "connection.h"
 #include "client_util.h"
 
+namespace {
+
+// In fast mode (-f), the receiver reads deliveries in big chunks,
+// parses them where they are in its input buffer, and collects its
+// output in a big buffer that is written out once it has FLUSH_SIZE
+// bytes, once FLUSH_INTERVAL_NS has passed since the last write, or
+// whenever there's no more input waiting (so a quiet room's messages
+// still show up right away).
+const size_t INPUT_SIZE = 256 * 1024;
+const size_t OUTPUT_SIZE = 256 * 1024;
+const size_t FLUSH_SIZE = 64 * 1024;
+const long long FLUSH_INTERVAL_NS = 50 * 1000000LL;
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+class Output {
+public:
+  Output() : m_len(0), m_last_flush(now_ns()) { }
+
+  void append(const char *data, size_t len) {
+    if (m_len + len > OUTPUT_SIZE) {
+      flush();
+    }
+    //(a single piece bigger than the buffer is written straight out)
+    if (len > OUTPUT_SIZE) {
+      write_all(data, len);
+      return;
+    }
+    memcpy(m_buf + m_len, data, len);
+    m_len += len;
+  }
+
+  bool is_empty() const { return m_len == 0; }
+
+  bool is_due() const {
+    return m_len >= FLUSH_SIZE || now_ns() - m_last_flush >= FLUSH_INTERVAL_NS;
+  }
+
+  void flush() {
+    write_all(m_buf, m_len);
+    m_len = 0;
+    m_last_flush = now_ns();
+  }
+
+private:
+  static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+      ssize_t n = write(STDOUT_FILENO, data, len);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return;
+      }
+      data += n;
+      len -= n;
+    }
+  }
+
+  char m_buf[OUTPUT_SIZE];
+  size_t m_len;
+  long long m_last_flush;
+};
+
+// With -s, the receiver checks the numbers a server started with -n
+// puts on a room's deliveries ("room@seq" in place of the room's
+// name), and reports on stderr every gap (messages the server dropped
+// because this receiver fell behind), and at the end how many messages
+// were missed or arrived out of order. Each room is numbered on its
+// own. Messages from senders broadcasting at the same time can arrive
+// in either order, so a gap is only reported once REORDER_WINDOW later
+// messages from its room have arrived without filling it (or at the
+// end).
+class SequenceCheck {
+public:
+  SequenceCheck() : m_received(0), m_missing(0), m_gaps(0), m_reordered(0) { }
+
+  // check the room field of a delivery (ignored if it isn't numbered)
+  void check(const char *room, size_t len) {
+    const char *at = static_cast<const char *>(memchr(room, '@', len));
+    if (!at || at + 1 == room + len) {
+      return;
+    }
+    unsigned long long seq = 0;
+    for (const char *p = at + 1; p < room + len; p++) {
+      if (*p < '0' || *p > '9') {
+        return;
+      }
+      seq = seq * 10 + (*p - '0');
+    }
+
+    m_received++;
+    Stream &stream = m_streams[std::string(room, at - room)];
+    if (!stream.started || seq == stream.next) {
+      //(the first message's number depends on when this receiver joined)
+      stream.started = true;
+      stream.next = seq + 1;
+    } else if (seq > stream.next) {
+      stream.open[stream.next] = seq - 1;
+      stream.next = seq + 1;
+    } else {
+      fill(stream, seq);
+    }
+    while (!stream.open.empty() && stream.open.begin()->second + REORDER_WINDOW < stream.next) {
+      report_gap(stream, at - room, room);
+    }
+  }
+
+  void report() {
+    for (auto &stream : m_streams) {
+      while (!stream.second.open.empty()) {
+        report_gap(stream.second, stream.first.size(), stream.first.data());
+      }
+    }
+    std::cerr << "sequence: " << m_received << " numbered messages, " << m_missing
+              << " missing (in " << m_gaps << " gaps), " << m_reordered << " out of order\n";
+  }
+
+private:
+  enum { REORDER_WINDOW = 1000 };
+
+  // open gaps, first number -> last number
+  typedef std::map<unsigned long long, unsigned long long> Gaps;
+
+  // what has arrived from one room
+  struct Stream {
+    Stream() : started(false), next(0) { }
+    bool started;
+    unsigned long long next;  // one past the highest number so far
+    Gaps open;
+  };
+
+  // a message from before the latest one arrived: it's either in a
+  // gap, which it splits, or a duplicate
+  void fill(Stream &stream, unsigned long long seq) {
+    Gaps::iterator i = stream.open.upper_bound(seq);
+    if (i == stream.open.begin()) {
+      return;
+    }
+    --i;
+    if (seq > i->second) {
+      return;
+    }
+    m_reordered++;
+    unsigned long long first = i->first, last = i->second;
+    stream.open.erase(i);
+    if (first < seq) {
+      stream.open[first] = seq - 1;
+    }
+    if (seq < last) {
+      stream.open[seq + 1] = last;
+    }
+  }
+
+  // report (and forget) the stream's oldest gap
+  void report_gap(Stream &stream, size_t name_len, const char *name) {
+    Gaps::iterator gap = stream.open.begin();
+    std::cerr << "gap: ";
+    std::cerr.write(name, name_len);
+    std::cerr << " messages " << gap->first << " to " << gap->second << " missing\n";
+    m_gaps++;
+    m_missing += gap->second - gap->first + 1;
+    stream.open.erase(gap);
+  }
+
+  std::map<std::string, Stream> m_streams; // by room
+  unsigned long long m_received;
+  unsigned long long m_missing;
+  unsigned long long m_gaps;
+  unsigned long long m_reordered;
+};
+
+// display a message the way the normal receive loop does (checking
+// its number if seq isn't nullptr, and showing its room if show_room)
+void output_message(Output &out, const MessageView &msg, SequenceCheck *seq, bool show_room) {
+  if (msg.tag == TAG_DELIVERY) {
+    //"room:sender:message_text" becomes "sender: message_text" (or
+    //"[room] sender: message_text")
+    const char *end = msg.data.data + msg.data.len;
+    const char *first_colon = static_cast<const char *>(memchr(msg.data.data, ':', msg.data.len));
+    if (!first_colon) {
+      return;
+    }
+    if (seq) {
+      seq->check(msg.data.data, first_colon - msg.data.data);
+    }
+    const char *sender = first_colon + 1;
+    const char *second_colon = static_cast<const char *>(memchr(sender, ':', end - sender));
+    if (!second_colon) {
+      return;
+    }
+    if (show_room) {
+      const char *at = static_cast<const char *>(memchr(msg.data.data, '@', first_colon - msg.data.data));
+      out.append("[", 1);
+      out.append(msg.data.data, (at ? at : first_colon) - msg.data.data);
+      out.append("] ", 2);
+    }
+    out.append(sender, second_colon - sender);
+    out.append(": ", 2);
+    out.append(second_colon + 1, end - second_colon - 1);
+    out.append("\n", 1);
+  } else if (msg.tag == TAG_ERR) {
+    //errors go to std::cerr, after the messages before them
+    out.flush();
+    std::cerr << msg.data.str() << "\n";
+  }
+}
+
+// parse as many whole messages as there are in buf, returning how many
+// bytes they took up, or -1 if the input is invalid
+ssize_t parse_messages(const char *buf, size_t len, Protocol protocol, Output &out, SequenceCheck *seq,
+                       bool show_room) {
+  size_t pos = 0;
+  while (pos < len) {
+    MessageView msg;
+    if (protocol == PROTO_BINARY) {
+      ssize_t n = Connection::decode_binary(buf + pos, len - pos, msg);
+      if (n < 0) {
+        return -1;
+      }
+      if (n == 0) {
+        break;
+      }
+      pos += n;
+    } else {
+      //(a line can't be longer than MAX_LEN, including its newline)
+      size_t avail = std::min(len - pos, (size_t)Message::MAX_LEN);
+      const char *nl = static_cast<const char *>(memchr(buf + pos, '\n', avail));
+      if (!nl) {
+        if (avail == Message::MAX_LEN) {
+          return -1;
+        }
+        break;
+      }
+      size_t line_len = nl - (buf + pos) + 1;
+      if (Connection::decode(buf + pos, line_len, msg) != Connection::SUCCESS) {
+        return -1;
+      }
+      pos += line_len;
+    }
+    output_message(out, msg, seq, show_room);
+  }
+  return pos;
+}
+
+// the fast receive loop, until EOF (or invalid input, as for the
+// normal loop)
+void receive_fast(Connection &conn, SequenceCheck *seq, bool show_room) {
+  std::vector<char> in(INPUT_SIZE);
+  Output out;
+  size_t len = conn.take_input(in.data(), in.size());
+  int fd = conn.get_fd();
+
+  while (true) {
+    ssize_t used = parse_messages(in.data(), len, conn.get_protocol(), out, seq, show_room);
+    if (used < 0) {
+      break;
+    }
+    //keep the start of an incomplete message for the next read
+    len -= used;
+    memmove(in.data(), in.data() + used, len);
+
+    //write the output before waiting for more input, or once it's due
+    if (!out.is_empty()) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if (out.is_due() || poll(&pfd, 1, 0) == 0) {
+        out.flush();
+      }
+    }
+
+    ssize_t n = read(fd, in.data() + len, in.size() - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+  }
+
+  out.flush();
+}
+
+}
+
 int main(int argc, char **argv) {
+  //-b asks the server to use the binary protocol, -f selects the
+  //high-throughput receive loop, and -s checks messages' numbers
+  bool binary = false;
+  bool fast = false;
+  bool check_seq = false;
+  while (argc > 1 && (std::string(argv[1]) == "-b" || std::string(argv[1]) == "-f" ||
+                      std::string(argv[1]) == "-s")) {
+    if (std::string(argv[1]) == "-b") {
+      binary = true;
+    } else if (std::string(argv[1]) == "-f") {
+      fast = true;
+    } else {
+      check_seq = true;
+    }
+    argc--;
+    argv++;
+  }
+
   if (argc != 5) {
-    std::cerr << "Usage: ./receiver [server_address] [port] [username] [room]\n";
+    std::cerr << "Usage: ./receiver [-b] [-f] [-s] [server_address] [port] [username] [room]\n";
     return 1;
   }
 
@@ -17,6 +330,9 @@ int main(int argc, char **argv) {
   int server_port = std::stoi(argv[2]);
   std::string username = argv[3];
   std::string room_name = argv[4];
+  //the room can also be a list of rooms and patterns ("a,b,metrics*"),
+  //in which case each message is shown with the room it was sent to
+  bool show_room = room_name.find_first_of(",*") != std::string::npos;
 
   //connect to server
   Connection conn;
@@ -28,6 +344,12 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  //switch protocols before logging in
+  if (binary && !use_binary_protocol(conn)) {
+    std::cerr << "Error: server does not support the binary protocol\n";
+    return 1;
+  }
+
   //send rlogin message
   Message login_msg(TAG_RLOGIN, username);
   //if login message not sent successfully, throw error
@@ -79,6 +401,15 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  SequenceCheck seq;
+  if (fast) {
+    receive_fast(conn, check_seq ? &seq : nullptr, show_room);
+    if (check_seq) {
+      seq.report();
+    }
+    return 0;
+  }
+
   //loop waiting for messages from server
   while (true) {
     Message msg;
@@ -105,12 +436,20 @@ int main(int argc, char **argv) {
         continue;
       }
 
+      if (check_seq) {
+        seq.check(payload.data(), first_colon);
+      }
+
       //isolate sender and message text by using colons 
       std::string sender = payload.substr(first_colon + 1, second_colon - first_colon - 1);
       //isolate message text by using second colon
       std::string message_text = payload.substr(second_colon + 1);
 
       //display message as "sender: message_text"
+      if (show_room) {
+        size_t at = payload.find('@');
+        std::cout << "[" << payload.substr(0, std::min(at, first_colon)) << "] ";
+      }
       std::cout << sender << ": " << message_text << "\n";
     } else if (msg.tag == TAG_ERR) {
       //if error message, print to std:cerr
@@ -118,5 +457,8 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (check_seq) {
+    seq.report();
+  }
   return 0;
 }
@@ -1,11 +1,70 @@
+#include <algorithm>
 #include "guard.h"
+#include "metrics.h"
 #include "message.h"
+#include "frame.h"
 #include "message_queue.h"
 #include "user.h"
+#include "room_history.h"
 #include "room.h"
 
-Room::Room(const std::string &room_name)
-    : room_name(room_name)
+Room::MemberList::MemberList(const MemberList &other)
+    : users(other.users), by_name(other.by_name)
+{
+  for (User *user : users)
+    user->ref();
+}
+
+void Room::MemberList::add(User *user)
+{
+  users.push_back(user);
+  by_name.emplace(user->username, user);
+}
+
+void Room::MemberList::remove(User *user)
+{
+  users.erase(std::find(users.begin(), users.end(), user));
+  auto range = by_name.equal_range(user->username);
+  for (auto i = range.first; i != range.second; ++i)
+  {
+    if (i->second == user)
+    {
+      by_name.erase(i);
+      break;
+    }
+  }
+}
+
+bool Room::MemberList::contains(User *user) const
+{
+  auto range = by_name.equal_range(user->username);
+  for (auto i = range.first; i != range.second; ++i)
+  {
+    if (i->second == user)
+      return true;
+  }
+  return false;
+}
+
+Room::MemberList::~MemberList()
+{
+  for (User *user : users)
+    user->unref();
+}
+
+std::shared_ptr<Room::MemberList> Room::copy_members(const MemberList *list)
+{
+  PoolAllocator<MemberList> alloc;
+  if (!list)
+    return std::allocate_shared<MemberList>(alloc);
+  return std::allocate_shared<MemberList>(alloc, *list);
+}
+
+Room::Room(const std::string &room_name, size_t history_messages, size_t history_bytes,
+           bool numbered)
+    : room_name(room_name), refs(0), dropped(0), next_seq(0), numbered(numbered),
+      history(history_messages > 0 ? new RoomHistory(history_messages, history_bytes) : nullptr),
+      members(copy_members(nullptr))
 {
   // TODO: initialize the mutex
   pthread_mutex_init(&lock, nullptr);
@@ -15,39 +74,161 @@ Room::~Room()
 {
   // TODO: destroy the mutex
   pthread_mutex_destroy(&lock);
+  delete history;
 }
 
-void Room::add_member(User *user)
+void Room::add_member(User *user, size_t replay, std::vector<Frame *> *replay_frames)
 {
   // TODO: add User to the room
-  //critical section needing guard
-  Guard g(lock);
-  members.insert(user);
+  uint64_t joined_seq;
+  {
+    //critical section needing guard (writers publish a new list, so
+    //they still exclude each other)
+    MeasuredGuard g(lock);
+    joined_seq = next_seq;
+    //(the list is only copied if it actually changes)
+    if (members->contains(user))
+      return;
+    std::shared_ptr<MemberList> updated = copy_members(members.get());
+    user->ref();
+    updated->add(user);
+    members = updated;
+  }
+
+  //every message numbered from joined_seq on goes to the new member
+  //directly, so catch it up on the ones before from the history (which
+  //waits for those whose broadcasts haven't added them yet)
+  if (history && replay > 0 && replay_frames)
+    history->get(joined_seq > replay ? joined_seq - replay : 0, joined_seq, *replay_frames);
 }
 
 void Room::remove_member(User *user)
 {
   // TODO: remove User from the room
   //critical section needing guard
+  MeasuredGuard g(lock);
+  if (!members->contains(user))
+    return;
+  std::shared_ptr<MemberList> updated = copy_members(members.get());
+  updated->remove(user);
+  user->unref();
+  members = updated;
+}
+
+void Room::restore_message(const std::string &sender_username, const Slice &message_text)
+{
+  uint64_t seq;
+  {
+    Guard g(lock);
+    seq = next_seq++;
+  }
+  if (history)
+    history->append(seq, create_delivery(seq, sender_username, message_text));
+}
+
+Frame *Room::create_delivery(uint64_t seq, const std::string &sender_username,
+                             const Slice &message_text) const
+{
+  if (numbered)
+    return Frame::create_delivery(room_name, seq, sender_username, message_text);
+  return Frame::create_delivery(room_name, sender_username, message_text);
+}
+
+bool Room::has_history() const
+{
+  if (!history)
+    return false;
   Guard g(lock);
-  members.erase(user);
+  return next_seq > 0;
 }
 
-void Room::broadcast_message(const std::string &sender_username, const std::string &message_text)
+size_t Room::send_to_user(const std::string &sender_username, const std::string &recipient,
+                          const Slice &message_text)
+{
+  std::shared_ptr<const MemberList> snapshot;
+  {
+    MeasuredGuard g(lock);
+    snapshot = members;
+  }
+  auto range = snapshot->by_name.equal_range(recipient);
+  if (range.first == range.second)
+    return 0;
+
+  //direct messages aren't numbered or kept in the history
+  Frame *frame = Frame::create_delivery(room_name, sender_username, message_text);
+  size_t fanout = 0, num_dropped = 0;
+  for (auto i = range.first; i != range.second; ++i)
+  {
+    frame->ref();
+    num_dropped += i->second->mqueue->enqueue(frame);
+    fanout++;
+  }
+  frame->unref();
+  if (num_dropped > 0)
+    dropped.fetch_add(num_dropped, std::memory_order_relaxed);
+
+  Metrics::add(Metrics::DIRECT_MESSAGES);
+  Metrics::add(Metrics::DELIVERIES_QUEUED, fanout);
+  Metrics::add(Metrics::DELIVERIES_DROPPED, num_dropped);
+  Metrics::add(Metrics::QUEUED_MESSAGES, (int64_t)fanout - (int64_t)num_dropped);
+  return fanout;
+}
+
+void Room::broadcast_message(const std::string &sender_username, const Slice &message_text)
 {
   // TODO: send a message to every (receiver) User in the room
-  // Format: room:sender:message_text
-  std::string delivery_data = room_name + ":" + sender_username + ":" + message_text;
-  Message *msg = new Message(TAG_DELIVERY, delivery_data);
+  // Format: room:sender:message_text, encoded once as a delivery
+  // frame that every member's queue shares
+  int64_t start = Metrics::now();
 
-  //broadcasting message is a critical section which requires guard
-  Guard g(lock);
-  for (User *user : members)
+  //only taking a reference to the current member list (and a number)
+  //is a critical section: the list itself never changes, so other
+  //senders can broadcast into the room (and receivers can join or
+  //leave) while this one is encoding and enqueueing
+  std::shared_ptr<const MemberList> snapshot;
+  uint64_t seq;
   {
-    //each user has own message queue, push copy for each user
-    user->mqueue.enqueue(new Message(*msg));
+    MeasuredGuard g(lock);
+    snapshot = members;
+    seq = next_seq++;
   }
+  Frame *frame = create_delivery(seq, sender_username, message_text);
+
+  //a receiver joining after the number was taken waits for the message
+  //to be in the history, so add it before anything that can block
+  if (history)
+  {
+    frame->ref();
+    history->append(seq, frame);
+  }
+
+  size_t num_dropped = 0;
+  for (User *user : snapshot->users)
+  {
+    //each user has own message queue, which gets its own reference
+    //(a receiver that can't keep up may have messages dropped)
+    frame->ref();
+    if (Metrics::sample())
+    {
+      int64_t enqueue_start = Metrics::now();
+      num_dropped += user->mqueue->enqueue(frame);
+      Metrics::observe(Metrics::ENQUEUE_TIME, Metrics::now() - enqueue_start);
+    }
+    else
+      num_dropped += user->mqueue->enqueue(frame);
+  }
+  if (num_dropped > 0)
+    dropped.fetch_add(num_dropped, std::memory_order_relaxed);
+
+  //every enqueue adds a message to a queue, and every drop removes one
+  size_t fanout = snapshot->users.size();
+  Metrics::add(Metrics::BROADCASTS);
+  Metrics::add(Metrics::DELIVERIES_QUEUED, fanout);
+  Metrics::add(Metrics::DELIVERIES_DROPPED, num_dropped);
+  Metrics::add(Metrics::QUEUED_MESSAGES, (int64_t)fanout - (int64_t)num_dropped);
+  Metrics::observe(Metrics::BROADCAST_FANOUT, fanout);
+  Metrics::observe(Metrics::BROADCAST_TIME, Metrics::now() - start);
 
-  //cleanup original temporary message
-  delete msg;
+  //drop the reference from create_delivery
+  frame->unref();
 }
@@ -2,32 +2,136 @@
 #define ROOM_H
 
 #include <string>
-#include <set>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <cstdint>
 #include <pthread.h>
+#include "pool.h"
 
 struct User;
+struct Slice;
+class Frame;
+class RoomHistory;
 
 // A Room object is a representation of a chat room.
 // At a minimum, it should keep track of the User objects representing
 // receivers who have joined the room.
+//
+// The members are kept in an immutable list that add_member and
+// remove_member replace with a modified copy (copy-on-write), so a
+// broadcast only needs the lock long enough to take a reference to the
+// current list, and then fans the message out without holding it.
+//
+// A room can also keep a history of its most recent messages, so that
+// a receiver joining the room can be sent what it missed. Each message
+// is numbered in the same critical section that takes the snapshot of
+// members it goes to, and a joining receiver notes the next number in
+// the one that adds it to the members. So it gets the messages
+// numbered before it joined from the history (as many as the history
+// still holds, waiting for any still being added to it), and those
+// numbered after it joined through its queue, with none in between
+// missed or repeated. The message is encoded and added to the history
+// after the lock is released, so that is all a broadcast holds it for.
+//
+// If the room numbers its deliveries, each message's number goes out
+// with it (as "room@seq" in place of the room's name), so a receiver
+// can tell if it missed any (dropped from its queue), or got them out
+// of order: senders broadcasting at the same time each take a number
+// under the lock, but fan out without it, so their messages can reach
+// a receiver's queue in either order. The numbering starts over if
+// the room is removed (once empty) and created again.
+//
+// The member list also indexes the members by username, so a message
+// to one user in the room (senduser) is a hash lookup in the current
+// list rather than a scan of it.
 class Room {
 public:
-  Room(const std::string &room_name);
+  // keep up to history_messages messages (and, if history_bytes isn't
+  // 0, at most about that many bytes of them) for replaying, and send
+  // the messages' numbers along with them if numbered
+  Room(const std::string &room_name,
+       size_t history_messages = 0, size_t history_bytes = 0, bool numbered = false);
   ~Room();
 
   std::string get_room_name() const { return room_name; }
 
-  void add_member(User *user);
+  // add the user to the room; if replay isn't 0, the frames of (up to)
+  // the last replay messages sent to the room before the user joined
+  // are added to replay_frames, oldest first, with a reference for the
+  // caller
+  void add_member(User *user, size_t replay = 0,
+                  std::vector<Frame *> *replay_frames = nullptr);
   void remove_member(User *user);
 
-  void broadcast_message(const std::string &sender_username, const std::string &message_text);
+  void broadcast_message(const std::string &sender_username, const Slice &message_text);
+
+  // send a message to the members with the given username, returning
+  // how many there were (0 if the user isn't in the room)
+  size_t send_to_user(const std::string &sender_username, const std::string &recipient,
+                      const Slice &message_text);
+
+  // add a message sent before the server restarted to the history
+  // (without sending it to anyone)
+  void restore_message(const std::string &sender_username, const Slice &message_text);
+
+  // number of messages dropped from members' (full) queues so far
+  unsigned long get_dropped_count() const { return dropped.load(std::memory_order_relaxed); }
+
+  // true if the room has messages in its history (which a receiver
+  // joining later would be sent, so the room is kept while empty)
+  bool has_history() const;
 
 private:
+  friend class RoomRegistry;
+
   std::string room_name;
-  pthread_mutex_t lock;
+  std::atomic<long> refs; // references handed out by RoomRegistry
+  mutable pthread_mutex_t lock;
+  std::atomic<unsigned long> dropped;
+  uint64_t next_seq;     // number of the next message (lock held)
+  bool numbered;         // deliveries carry their message's number
+  RoomHistory *history;  // nullptr if the room keeps no history
+
+  // a snapshot of the members, which holds a reference to each User
+  // for as long as a broadcast may still be using the snapshot
+  class MemberList {
+  public:
+    MemberList() { }
+    MemberList(const MemberList &other);
+    ~MemberList();
+
+    std::vector<User *, PoolAllocator<User *> > users;
+
+    // the users by username (several receivers may log in with the
+    // same name)
+    typedef std::unordered_multimap<std::string, User *, std::hash<std::string>,
+                                    std::equal_to<std::string>,
+                                    PoolAllocator<std::pair<const std::string, User *> > > Index;
+    Index by_name;
+
+    // add or remove a user, which must (or mustn't) be in the list,
+    // keeping the index up to date (but not the reference counts)
+    void add(User *user);
+    void remove(User *user);
+
+    // whether the user is in the list (looked up by name)
+    bool contains(User *user) const;
+
+  private:
+    MemberList &operator=(const MemberList &);
+  };
+
+  // the delivery frame for message number seq
+  Frame *create_delivery(uint64_t seq, const std::string &sender_username, const Slice &message_text) const;
+
+  // copy the given list (or make an empty one, for nullptr) for
+  // publishing; lists are pooled, since every join and leave makes one
+  static std::shared_ptr<MemberList> copy_members(const MemberList *list);
 
-  typedef std::set<User *> UserSet;
-  UserSet members;
+  // only replaced (never modified) once published, with the lock held
+  std::shared_ptr<const MemberList> members;
 };
 
 #endif // ROOM_H
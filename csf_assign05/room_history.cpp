@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <sched.h>
+#include "frame.h"
+#include "room_history.h"
+
+RoomHistory::RoomHistory(size_t max_messages, size_t max_bytes)
+    : m_max_messages(max_messages), m_max_bytes(max_bytes),
+      m_slots(new Slot[max_messages]), m_bytes(0), m_oldest(0)
+{
+  for (size_t i = 0; i < m_max_messages; i++)
+  {
+    m_slots[i].busy.store(false, std::memory_order_relaxed);
+    m_slots[i].end = 0;
+    m_slots[i].frame = nullptr;
+    m_slots[i].bytes = 0;
+  }
+}
+
+RoomHistory::~RoomHistory()
+{
+  for (size_t i = 0; i < m_max_messages; i++)
+  {
+    if (m_slots[i].frame)
+      m_slots[i].frame->unref();
+  }
+  delete[] m_slots;
+}
+
+RoomHistory::Slot &RoomHistory::lock_slot(uint64_t seq)
+{
+  //(only appends max_messages apart, or a reader, can find it held)
+  Slot &slot = m_slots[seq % m_max_messages];
+  while (slot.busy.exchange(true, std::memory_order_acquire))
+    sched_yield();
+  return slot;
+}
+
+void RoomHistory::append(uint64_t seq, Frame *frame)
+{
+  //the messages max_messages before this one are no longer kept
+  uint64_t oldest = m_oldest.load();
+  while (seq + 1 > m_max_messages && oldest < seq + 1 - m_max_messages &&
+         !m_oldest.compare_exchange_weak(oldest, seq + 1 - m_max_messages))
+    ;
+
+  //the message takes the slot of the one max_messages before it,
+  //unless a newer message has got there first (or it has been evicted
+  //already, by appends that got ahead of it)
+  size_t bytes = std::max(frame->size(PROTO_TEXT), frame->size(PROTO_BINARY));
+  Frame *old;
+  Slot &slot = lock_slot(seq);
+  if (slot.end > seq + 1 || seq < m_oldest.load())
+    old = frame;
+  else
+  {
+    old = slot.frame;
+    if (old)
+      m_bytes.fetch_sub(slot.bytes);
+    slot.end = seq + 1;
+    slot.frame = frame;
+    slot.bytes = bytes;
+    m_bytes.fetch_add(bytes);
+  }
+  unlock_slot(slot);
+  if (old)
+    old->unref();
+
+  if (m_max_bytes > 0 && m_bytes.load() > m_max_bytes)
+    evict(seq);
+}
+
+void RoomHistory::evict(uint64_t seq)
+{
+  //each message is evicted by whoever moves m_oldest past it (but a
+  //message never evicts itself)
+  while (m_bytes.load() > m_max_bytes)
+  {
+    uint64_t oldest = m_oldest.load();
+    if (oldest >= seq)
+      break;
+    if (!m_oldest.compare_exchange_weak(oldest, oldest + 1))
+      continue;
+
+    Frame *frame = nullptr;
+    Slot &slot = lock_slot(oldest);
+    if (slot.end == oldest + 1 && slot.frame)
+    {
+      frame = slot.frame;
+      slot.frame = nullptr;
+      m_bytes.fetch_sub(slot.bytes);
+    }
+    unlock_slot(slot);
+    if (frame)
+      frame->unref();
+  }
+}
+
+void RoomHistory::get(uint64_t first, uint64_t end, std::vector<Frame *> &frames)
+{
+  if (end - first > m_max_messages)
+    first = end - m_max_messages;
+  for (uint64_t seq = first; seq < end; seq++)
+  {
+    while (seq >= m_oldest.load())
+    {
+      Slot &slot = lock_slot(seq);
+      uint64_t slot_end = slot.end;
+      if (slot_end == seq + 1 && slot.frame)
+      {
+        slot.frame->ref();
+        frames.push_back(slot.frame);
+      }
+      unlock_slot(slot);
+
+      //found (or evicted), or overwritten by a newer message; otherwise
+      //its broadcast has numbered it but not appended it yet
+      if (slot_end >= seq + 1)
+        break;
+      sched_yield();
+    }
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef ROOM_HISTORY_H
+#define ROOM_HISTORY_H
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+class Frame;
+
+// The most recent delivery frames broadcast to a Room, kept so they
+// can be replayed to a receiver that has just joined. It is a ring of
+// max_messages slots, indexed by the room's sequence number for each
+// message, so appending just replaces the entry in the message's slot.
+// Once the frames held add up to more than max_bytes (if not 0), the
+// oldest are evicted early.
+//
+// The Room numbers a message under its lock, but makes its frame and
+// appends it after, so appends for different messages run at the same
+// time (and finish in any order). Each slot has a flag of its own,
+// held just long enough to swap a frame in or take a reference to it,
+// so appends only contend if they are max_messages apart. A reader
+// waits for the messages it asks for that have been numbered but not
+// appended yet (whose broadcasts are between the two, which never
+// blocks).
+class RoomHistory {
+public:
+  RoomHistory(size_t max_messages, size_t max_bytes);
+  ~RoomHistory();
+
+  // add the frame for the message with the given sequence number,
+  // taking over the caller's reference to it (which is just dropped if
+  // the message is already too old to keep)
+  void append(uint64_t seq, Frame *frame);
+
+  // append the frames of the messages numbered first up to (but not
+  // including) end that are still in the history to frames, oldest
+  // first, with a reference for the caller; every message before end
+  // must have been numbered
+  void get(uint64_t first, uint64_t end, std::vector<Frame *> &frames);
+
+  size_t get_max_messages() const { return m_max_messages; }
+
+private:
+  // prohibit value semantics
+  RoomHistory(const RoomHistory &);
+  RoomHistory &operator=(const RoomHistory &);
+
+  struct Slot {
+    std::atomic<bool> busy; // held while the rest is read or changed
+    uint64_t end;           // seq + 1 of the message last put here (0 if none)
+    Frame *frame;           // nullptr if that message was evicted
+    size_t bytes;
+  };
+
+  Slot &lock_slot(uint64_t seq);
+  static void unlock_slot(Slot &slot) { slot.busy.store(false, std::memory_order_release); }
+
+  // evict messages older than seq until the size limit is met
+  void evict(uint64_t seq);
+
+  const size_t m_max_messages;
+  const size_t m_max_bytes;
+  Slot *m_slots;
+  std::atomic<size_t> m_bytes;
+  std::atomic<uint64_t> m_oldest; // messages before this are gone (or going)
+};
+
+#endif // ROOM_HISTORY_H
@@ -0,0 +1,309 @@
+#include <functional>
+#include <algorithm>
+#include "guard.h"
+#include "metrics.h"
+#include "room.h"
+#include "subscription.h"
+#include "room_registry.h"
+
+namespace
+{
+
+  //the low bits of the hash pick the stripe, the rest pick the bucket
+  const int STRIPE_BITS = 6;
+
+}
+
+RoomRegistry::Table::Table(size_t num_buckets)
+    : mask(num_buckets - 1), buckets(new std::atomic<Node *>[num_buckets])
+{
+  for (size_t i = 0; i < num_buckets; i++)
+    buckets[i].store(nullptr, std::memory_order_relaxed);
+}
+
+RoomRegistry::Table::~Table()
+{
+  for (size_t i = 0; i <= mask; i++)
+  {
+    Node *node = buckets[i].load(std::memory_order_relaxed);
+    while (node)
+    {
+      Node *next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+  delete[] buckets;
+}
+
+RoomRegistry::RoomRegistry(size_t history_messages, size_t history_bytes, bool numbered,
+                           size_t max_idle_rooms)
+    : m_history_messages(history_messages), m_history_bytes(history_bytes), m_numbered(numbered),
+      m_idle_per_stripe((max_idle_rooms + NUM_STRIPES - 1) / NUM_STRIPES)
+{
+  static_assert((1 << STRIPE_BITS) == NUM_STRIPES, "stripe bits don't match");
+  for (Stripe &stripe : m_stripes)
+  {
+    pthread_mutex_init(&stripe.lock, nullptr);
+    stripe.table.store(new Table(INITIAL_BUCKETS), std::memory_order_relaxed);
+    stripe.readers.store(0, std::memory_order_relaxed);
+    stripe.count = 0;
+  }
+  pthread_rwlock_init(&m_subscriptions_lock, nullptr);
+}
+
+RoomRegistry::~RoomRegistry()
+{
+  for (Stripe &stripe : m_stripes)
+  {
+    //the current table has every room (retired tables only have copies)
+    Table *table = stripe.table.load(std::memory_order_relaxed);
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+      for (Node *node = table->buckets[i].load(std::memory_order_relaxed); node; node = node->next)
+        delete node->room;
+    }
+    delete table;
+    reclaim(stripe);
+    pthread_mutex_destroy(&stripe.lock);
+  }
+  pthread_rwlock_destroy(&m_subscriptions_lock);
+}
+
+//lookups and changes to the tables are sequentially consistent, so
+//once a change has been made, a lookup that starts after the stripe's
+//count of lookups is seen to be 0 is sure to see it (see reclaim)
+
+Room *RoomRegistry::acquire(const std::string &room_name)
+{
+  size_t hash = std::hash<std::string>()(room_name);
+  Stripe &stripe = get_stripe(hash);
+
+  //the common case: the room exists, and has members
+  stripe.readers.fetch_add(1);
+  Room *room = lookup(stripe.table.load(), hash, room_name);
+  bool found = room && try_ref(room);
+  stripe.readers.fetch_sub(1);
+  if (found)
+    return room;
+
+  //look again with the stripe locked, since another thread may have
+  //created (or removed) the room or grown the table since, and a room
+  //without references can only be taken with the lock held
+  Guard g(stripe.lock);
+  reclaim(stripe);
+  Table *table = stripe.table.load();
+  room = lookup(table, hash, room_name);
+  if (room)
+  {
+    //(a room without references is one kept for its history)
+    if (room->refs.fetch_add(1) == 0)
+      stripe.idle.erase(std::find(stripe.idle.begin(), stripe.idle.end(), room));
+    return room;
+  }
+
+  room = new Room(room_name, m_history_messages, m_history_bytes, m_numbered);
+  room->refs.store(1);
+
+  //the subscribers whose patterns match join the room before anyone
+  //can find it, and no pattern is added until it can be found, so a
+  //subscription made meanwhile finds the room itself (see subscribe)
+  pthread_rwlock_rdlock(&m_subscriptions_lock);
+  m_subscriptions.for_each_match(room_name, [room](Subscription *sub) {
+    room->refs.fetch_add(1);
+    if (!sub->add_room(room))
+      room->refs.fetch_sub(1);
+  });
+  insert(table, hash, room_name, room);
+  pthread_rwlock_unlock(&m_subscriptions_lock);
+  Metrics::add(Metrics::ROOMS);
+  if (++stripe.count > table->mask + 1)
+    grow(stripe);
+  return room;
+}
+
+void RoomRegistry::release(Room *room)
+{
+  //dropping a reference that isn't the last doesn't lock anything
+  long n = room->refs.load();
+  while (n > 1)
+  {
+    if (room->refs.compare_exchange_weak(n, n - 1))
+      return;
+  }
+
+  //the last one is dropped with the stripe locked, so the room can't
+  //be taken again (only a locked acquire can take a room without
+  //references) before it is removed
+  size_t hash = std::hash<std::string>()(room->room_name);
+  Stripe &stripe = get_stripe(hash);
+  Guard g(stripe.lock);
+  if (room->refs.fetch_sub(1) > 1)
+    return;
+
+  //a room with history is kept for a receiver joining later, in place
+  //of the one in its stripe that has been empty longest
+  if (room->has_history() && m_idle_per_stripe > 0)
+  {
+    stripe.idle.push_back(room);
+    if (stripe.idle.size() <= m_idle_per_stripe)
+      return;
+    room = stripe.idle.front();
+    stripe.idle.pop_front();
+    hash = std::hash<std::string>()(room->room_name);
+  }
+  unlink(stripe, hash, room);
+}
+
+void RoomRegistry::subscribe(Subscription *sub, const std::string &pattern, size_t replay,
+                             std::vector<Frame *> *replay_frames)
+{
+  if (pattern.empty() || pattern.back() != '*')
+  {
+    Room *room = acquire(pattern);
+    if (!sub->add_room(room, replay, replay_frames))
+      release(room);
+    return;
+  }
+
+  std::string prefix = pattern.substr(0, pattern.size() - 1);
+  if (!sub->add_prefix(prefix))
+    return;
+  pthread_rwlock_wrlock(&m_subscriptions_lock);
+  m_subscriptions.add(prefix, sub);
+  pthread_rwlock_unlock(&m_subscriptions_lock);
+
+  //rooms created from now on are added as they're created, so any
+  //other room is in the tables by now (a room found both ways is only
+  //added once, and the subscription's references keep it from being
+  //removed, so it's the same room both times)
+  std::vector<std::string> names;
+  for_each([&](Room *room) {
+    if (room->room_name.compare(0, prefix.size(), prefix) == 0)
+      names.push_back(room->room_name);
+  });
+  for (const std::string &name : names)
+  {
+    Room *room = acquire(name);
+    if (!sub->add_room(room, replay, replay_frames))
+      release(room);
+  }
+}
+
+void RoomRegistry::unsubscribe(Subscription *sub)
+{
+  //once out of the trie, no room being created can still be adding
+  //the subscription's user to itself
+  if (!sub->get_prefixes().empty())
+  {
+    pthread_rwlock_wrlock(&m_subscriptions_lock);
+    for (const std::string &prefix : sub->get_prefixes())
+      m_subscriptions.remove(prefix, sub);
+    pthread_rwlock_unlock(&m_subscriptions_lock);
+  }
+
+  std::vector<Room *> rooms;
+  sub->close(rooms);
+  for (Room *room : rooms)
+  {
+    room->remove_member(sub->get_user());
+    release(room);
+  }
+}
+
+Room *RoomRegistry::lookup(const Table *table, size_t hash, const std::string &room_name)
+{
+  const Node *node = table->buckets[(hash >> STRIPE_BITS) & table->mask].load();
+  for (; node; node = node->next)
+  {
+    if (node->name == room_name)
+      return node->room;
+  }
+  return nullptr;
+}
+
+bool RoomRegistry::try_ref(Room *room)
+{
+  long n = room->refs.load();
+  while (n > 0)
+  {
+    if (room->refs.compare_exchange_weak(n, n + 1))
+      return true;
+  }
+  return false;
+}
+
+void RoomRegistry::insert(Table *table, size_t hash, const std::string &room_name, Room *room)
+{
+  std::atomic<Node *> &bucket = table->buckets[(hash >> STRIPE_BITS) & table->mask];
+
+  //the node must be complete before a lookup can reach it
+  Node *node = new Node;
+  node->name = room_name;
+  node->room = room;
+  node->next = bucket.load(std::memory_order_relaxed);
+  bucket.store(node);
+}
+
+void RoomRegistry::unlink(Stripe &stripe, size_t hash, Room *room)
+{
+  //the stripe's lock must be held; the nodes in front of the room's
+  //are replaced with copies, and the chain after it is shared
+  Table *table = stripe.table.load(std::memory_order_relaxed);
+  std::atomic<Node *> &bucket = table->buckets[(hash >> STRIPE_BITS) & table->mask];
+  Node *head = nullptr;
+  Node **tail = &head;
+  Node *node = bucket.load(std::memory_order_relaxed);
+  for (; node->room != room; node = node->next)
+  {
+    Node *copy = new Node;
+    copy->name = node->name;
+    copy->room = node->room;
+    *tail = copy;
+    tail = &copy->next;
+    stripe.retired_nodes.push_back(node);
+  }
+  *tail = node->next;
+  bucket.store(head);
+
+  stripe.retired_nodes.push_back(node);
+  stripe.retired_rooms.push_back(room);
+  stripe.count--;
+  Metrics::add(Metrics::ROOMS, -1);
+  reclaim(stripe);
+}
+
+void RoomRegistry::grow(Stripe &stripe)
+{
+  //the stripe's lock must be held
+  Table *old = stripe.table.load(std::memory_order_relaxed);
+  Table *table = new Table((old->mask + 1) * 2);
+  for (size_t i = 0; i <= old->mask; i++)
+  {
+    for (Node *node = old->buckets[i].load(std::memory_order_relaxed); node; node = node->next)
+      insert(table, std::hash<std::string>()(node->name), node->name, node->room);
+  }
+  stripe.table.store(table);
+  stripe.retired_tables.push_back(old);
+  reclaim(stripe);
+}
+
+void RoomRegistry::reclaim(Stripe &stripe)
+{
+  //the stripe's lock must be held; what was retired has been unlinked,
+  //so once no lookup is in progress, none can still reach it (if one
+  //is, it is left for next time)
+  if (stripe.retired_nodes.empty() && stripe.retired_tables.empty())
+    return;
+  if (stripe.readers.load() != 0)
+    return;
+  for (Room *room : stripe.retired_rooms)
+    delete room;
+  for (Node *node : stripe.retired_nodes)
+    delete node;
+  for (Table *table : stripe.retired_tables)
+    delete table;
+  stripe.retired_rooms.clear();
+  stripe.retired_nodes.clear();
+  stripe.retired_tables.clear();
+}
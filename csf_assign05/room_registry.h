@@ -0,0 +1,147 @@
+#ifndef ROOM_REGISTRY_H
+#define ROOM_REGISTRY_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <pthread.h>
+#include "subscription_trie.h"
+class Room;
+class Frame;
+class Subscription;
+
+// The server's set of rooms, by name. Joins are far more common than
+// room creation, so looking up an existing room takes no lock: the
+// names are hashed into NUM_STRIPES independent hash tables whose
+// chains are never modified once reachable (a new node goes at the
+// front), and a lookup just follows them. Creating a room locks only
+// its name's stripe, so joins to rooms in different stripes never
+// wait for each other.
+//
+// Rooms are reference counted (acquire and release), and a room is
+// removed once its last reference is released. A room with history
+// to replay to a receiver joining later is kept while empty, but only
+// up to max_idle_rooms of those (the ones emptied longest ago are
+// removed first), so short-lived rooms don't pile up. A lookup only takes a
+// reference to a room that already has one; otherwise it retries with
+// the stripe locked, which is also where the last reference to a room
+// is dropped, so a room is never removed while being joined.
+//
+// A removed room's node is unlinked by replacing the nodes before it
+// in its chain with copies, and a stripe's table is replaced by one
+// twice the size (with its own copies of the nodes) as it fills up.
+// A lookup still walking the old nodes sees consistent (if stale)
+// chains: lookups are counted per stripe, and what was unlinked is
+// only freed once no lookup is in progress in the stripe. A lookup
+// that misses in a stale chain just retries with the stripe locked.
+//
+// Receivers can also subscribe to every room whose name starts with a
+// prefix (a pattern like "metrics*"), including rooms created later.
+// The patterns are kept in a trie, which is only consulted when a
+// room is created: the subscribers whose patterns match join the room
+// there and then, so a broadcast still only goes to the room's member
+// list, and costs nothing more however many patterns there are.
+class RoomRegistry {
+public:
+  // rooms are created with the given history and numbering settings
+  // (see Room), and at most (about) max_idle_rooms empty rooms are
+  // kept for their history
+  RoomRegistry(size_t history_messages = 0, size_t history_bytes = 0, bool numbered = false,
+               size_t max_idle_rooms = 0);
+  ~RoomRegistry(); // also deletes the rooms
+
+  // return the named room, creating it if necessary, with a reference
+  // the caller must give back with release
+  Room *acquire(const std::string &room_name);
+
+  // drop a reference to a room (from acquire), which removes and
+  // deletes the room if it was the last one (unless the room has
+  // history, and is kept instead of the one emptied longest ago)
+  void release(Room *room);
+
+  // add the named room to a subscription, or for a pattern (a prefix
+  // followed by '*'), every room whose name starts with the prefix,
+  // now and once created; replay is as for Room::add_member
+  void subscribe(Subscription *sub, const std::string &pattern, size_t replay = 0,
+                 std::vector<Frame *> *replay_frames = nullptr);
+
+  // remove a subscription's patterns, and its user from its rooms,
+  // releasing them (after which the subscription can be deleted)
+  void unsubscribe(Subscription *sub);
+
+  // call fn(room) for every room (never blocks, so rooms created or
+  // removed while this is running may or may not be visited)
+  template <typename Fn> void for_each(Fn fn) const;
+
+private:
+  // prohibit value semantics
+  RoomRegistry(const RoomRegistry &);
+  RoomRegistry &operator=(const RoomRegistry &);
+
+  enum { NUM_STRIPES = 64, INITIAL_BUCKETS = 16 };
+
+  struct Node {
+    std::string name;
+    Room *room;
+    Node *next; // never changes once the node is reachable
+  };
+
+  struct Table {
+    Table(size_t num_buckets);
+    ~Table(); // deletes the nodes (but not the rooms)
+
+    size_t mask; // number of buckets - 1
+    std::atomic<Node *> *buckets;
+  };
+
+  struct Stripe {
+    pthread_mutex_t lock;         // held while changing the table
+    std::atomic<Table *> table;
+    mutable std::atomic<int> readers; // lookups in progress
+    size_t count;                 // rooms in this stripe
+    std::deque<Room *> idle;      // empty rooms kept for their history,
+                                  // the longest empty first
+
+    // unlinked, but lookups may still be using them
+    std::vector<Table *> retired_tables;
+    std::vector<Node *> retired_nodes;
+    std::vector<Room *> retired_rooms;
+    char pad[64];                 // keep stripes off each other's cache lines
+  };
+
+  Stripe &get_stripe(size_t hash) { return m_stripes[hash & (NUM_STRIPES - 1)]; }
+  static Room *lookup(const Table *table, size_t hash, const std::string &room_name);
+  static bool try_ref(Room *room);
+  static void insert(Table *table, size_t hash, const std::string &room_name, Room *room);
+  void unlink(Stripe &stripe, size_t hash, Room *room);
+  void grow(Stripe &stripe);
+  static void reclaim(Stripe &stripe);
+
+  Stripe m_stripes[NUM_STRIPES];
+  size_t m_history_messages;
+  size_t m_history_bytes;
+  bool m_numbered;
+  size_t m_idle_per_stripe;
+
+  // pattern subscriptions: read locked while a room is being created,
+  // write locked to change them
+  pthread_rwlock_t m_subscriptions_lock;
+  SubscriptionTrie m_subscriptions;
+};
+
+template <typename Fn>
+void RoomRegistry::for_each(Fn fn) const {
+  for (const Stripe &stripe : m_stripes) {
+    //counted as a lookup, so no room it can reach is deleted meanwhile
+    stripe.readers.fetch_add(1);
+    const Table *table = stripe.table.load();
+    for (size_t i = 0; i <= table->mask; i++) {
+      for (const Node *node = table->buckets[i].load(); node; node = node->next)
+        fn(node->room);
+    }
+    stripe.readers.fetch_sub(1);
+  }
+}
+
+#endif // ROOM_REGISTRY_H
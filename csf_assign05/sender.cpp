@@ -2,14 +2,156 @@
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <vector>
+#include <cstdlib>
+#include <poll.h>
 #include "csapp.h"
 #include "message.h"
 #include "connection.h"
 #include "client_util.h"
 
+namespace {
+
+// turn a line the user typed into the message for it, returns false
+// (after explaining why) if there's nothing to send
+bool parse_command(const std::string &trimmed, Message &msg) {
+  if (trimmed == "/quit") {
+    msg = Message(TAG_QUIT, "");
+  } else if (trimmed == "/leave") {
+    msg = Message(TAG_LEAVE, "");
+    //if the line starts with "/join"
+  } else if (trimmed.substr(0, 6) == "/join ") {
+    //get room name by trimming everything after /join
+    std::string room_name = trim(trimmed.substr(6));
+    //if room name empty, throw error
+    if (room_name.empty()) {
+      std::cerr << "Error: room name cannot be empty\n";
+      return false;
+    }
+    msg = Message(TAG_JOIN, room_name);
+    //"/senduser user text" sends text to just that user
+  } else if (trimmed.substr(0, 10) == "/senduser ") {
+    std::string rest = trim(trimmed.substr(10));
+    size_t space = rest.find(' ');
+    if (space == std::string::npos) {
+      std::cerr << "Error: usage is /senduser <username> <message>\n";
+      return false;
+    }
+    msg = Message(TAG_SENDUSER, rest.substr(0, space) + ":" + trim(rest.substr(space + 1)));
+  } else {
+    //otherwise, regular messagse that sent to all users in room
+    msg = Message(TAG_SENDALL, trimmed);
+  }
+  return true;
+}
+
+void handle_response(const Message &response) {
+  //check if error from the server
+  if (response.tag == TAG_ERR) {
+    std::cerr << response.data << "\n";
+  } else if (response.tag != TAG_OK) {
+    //if response is not ok or err, something unexpected happened
+    std::cerr << "Error: unexpected response from server\n";
+  }
+  //if response is ok, silently continue (success)
+}
+
+// true if a response can be received without waiting for one
+bool response_ready(Connection &conn) {
+  struct pollfd pfd = { conn.get_fd(), POLLIN, 0 };
+  return conn.has_buffered_message() || poll(&pfd, 1, 0) > 0;
+}
+
+// the pipelined loop (-w window): up to window commands are sent
+// without waiting for their responses, which are matched up with them
+// (in order) as they arrive, so sending a file of messages isn't held
+// up by a round trip per message
+int send_pipelined(Connection &conn, size_t window) {
+  //let std::cin buffer its input, so we can tell when there's more
+  std::ios::sync_with_stdio(false);
+
+  std::vector<Message> batch;
+  size_t outstanding = 0;
+  bool quit = false;
+  bool done = false;
+  std::string line;
+  Message response;
+  while (!done) {
+    if (!quit && std::getline(std::cin, line)) {
+      std::string trimmed = trim(line);
+      Message msg;
+      if (!trimmed.empty() && parse_command(trimmed, msg)) {
+        //a message too long to send would never get a response
+        size_t limit = conn.get_protocol() == PROTO_BINARY ? Message::MAX_BINARY_LEN
+                                                          : Message::MAX_LEN - msg.tag.size() - 2;
+        if (msg.data.size() > limit) {
+          std::cerr << "Error: message too long\n";
+        } else {
+          quit = msg.tag == TAG_QUIT;
+          batch.push_back(msg);
+        }
+      }
+    } else {
+      done = true;
+    }
+
+    //send the commands read so far in one write once there are no more
+    //lines buffered (or the window is full, or that's all)
+    if (!batch.empty() && (done || quit || outstanding + batch.size() >= window ||
+                           std::cin.rdbuf()->in_avail() <= 0)) {
+      if (!conn.send(batch.data(), batch.size())) {
+        std::cerr << "Error: failed to send message\n";
+        return 1;
+      }
+      outstanding += batch.size();
+      batch.clear();
+    }
+
+    //handle the responses that have arrived, waiting for them if the
+    //window is full (or until the last one, at the end)
+    while (outstanding > 0 && (done || quit || outstanding >= window || response_ready(conn))) {
+      if (!conn.receive(response)) {
+        //the server may close the connection right after the quit
+        if (quit) {
+          return 0;
+        }
+        std::cerr << "Error: failed to receive server response\n";
+        return 1;
+      }
+      outstanding--;
+      handle_response(response);
+    }
+    if (quit) {
+      done = true;
+    }
+  }
+  return 0;
+}
+
+}
+
 int main(int argc, char **argv) {
+  //-b asks the server to use the binary protocol, and -w sends up to
+  //that many commands before waiting for a response
+  bool binary = false;
+  size_t window = 0;
+  while (argc > 1 && argv[1][0] == '-') {
+    std::string flag = argv[1];
+    if (flag == "-b") {
+      binary = true;
+    } else if (flag == "-w" && argc > 2 && std::atoi(argv[2]) > 0) {
+      window = std::atoi(argv[2]);
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+    argc--;
+    argv++;
+  }
+
   if (argc != 4) {
-    std::cerr << "Usage: ./sender [server_address] [port] [username]\n";
+    std::cerr << "Usage: ./sender [-b] [-w window] [server_address] [port] [username]\n";
     return 1;
   }
 
@@ -31,6 +173,12 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  //switch protocols before logging in
+  if (binary && !use_binary_protocol(conn)) {
+    std::cerr << "Error: server does not support the binary protocol\n";
+    return 1;
+  }
+
   //send login message
   Message login_msg(TAG_SLOGIN, username); 
   //if login message not sent successfully, throw error
@@ -58,6 +206,10 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (window > 0) {
+    return send_pipelined(conn, window);
+  }
+
   //loop to read commands from user
   std::string line;
   //read line until EOF
@@ -72,50 +224,16 @@ int main(int argc, char **argv) {
 
     //create message to send to server
     Message msg;
-    //create boolean to check if user wants to quit
-    bool should_quit = false;
-
-    //parse commands
-    if (trimmed == "/quit") {
-      msg = Message(TAG_QUIT, "");
-      //throw error if not sent successfully
-      if (!conn.send(msg)) {
-        std::cerr << "Error: failed to send quit message\n";
-        return 1;
-      }
-      should_quit = true;
-    } else if (trimmed == "/leave") {
-      //send leave message
-      msg = Message(TAG_LEAVE, "");
-      //throw error if not sent successfully
-      if (!conn.send(msg)) {
-        std::cerr << "Error: failed to send leave message\n";
-        return 1;
-      }
-      //if the line starts with "/join"
-    } else if (trimmed.substr(0, 6) == "/join ") {
-      //get room name by trimming everything after /join
-      std::string room_name = trim(trimmed.substr(6));
-      //if room name empty, throw error
-      if (room_name.empty()) {
-        std::cerr << "Error: room name cannot be empty\n";
-        continue;
-      }
-      //create join message with name
-      msg = Message(TAG_JOIN, room_name);
-      //throw error if not sent successfully
-      if (!conn.send(msg)) {
-        std::cerr << "Error: failed to send join message\n";
-        return 1;
-      }
-    } else {
-      //otherwise, regular messagse that sent to all users in room
-      msg = Message(TAG_SENDALL, trimmed);
-      //throw error if not sent successfully
-      if (!conn.send(msg)) {
-        std::cerr << "Error: failed to send message\n";
-        return 1;
-      }
+    if (!parse_command(trimmed, msg)) {
+      continue;
+    }
+    //check if user wants to quit
+    bool should_quit = msg.tag == TAG_QUIT;
+
+    //throw error if not sent successfully
+    if (!conn.send(msg)) {
+      std::cerr << "Error: failed to send message\n";
+      return 1;
     }
 
     //receive response from server
@@ -128,15 +246,7 @@ int main(int argc, char **argv) {
       std::cerr << "Error: failed to receive server response\n";
       return 1;
     }
-
-    //check if error from the server
-    if (response.tag == TAG_ERR) {
-      std::cerr << response.data << "\n";
-    } else if (response.tag != TAG_OK) {
-      //if response is not ok or err, something unexpected happened
-      std::cerr << "Error: unexpected response from server\n";
-    }
-    //if response is ok, silently continue (success)
+    handle_response(response);
 
     //if should_quit is true, exit loop after receiving response
     if (should_quit) {
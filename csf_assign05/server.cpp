@@ -6,11 +6,30 @@
 #include <vector>
 #include <cctype>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/eventfd.h>
 #include "message.h"
+#include "frame.h"
 #include "connection.h"
+#include "message_queue.h"
 #include "user.h"
 #include "room.h"
 #include "guard.h"
+#include "session.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "pool.h"
+#include "message_log.h"
+#include "worker_pool.h"
 #include "server.h"
 
 ////////////////////////////////////////////////////////////////////////
@@ -20,11 +39,27 @@
 // TODO: add any additional data types that might be helpful
 //       for implementing the Server member functions
 
+//how often draining checks whether the clients are done
+static const long DRAIN_POLL_US = 10000;
+
+//how long an acceptor waits before retrying when out of descriptors
+static const int ACCEPT_RETRY_MS = 10;
+
 //connection data that has server and connection within
 struct ConnData
+{
+  static void *operator new(size_t size) { return Pool::allocate(size); }
+  static void operator delete(void *p, size_t size) { Pool::deallocate(p, size); }
+
+  Server *server;
+  Server::WorkerClient *client;
+};
+
+//an acceptor thread's server and listening socket
+struct AcceptorData
 {
   Server *server;
-  Connection *conn;
+  size_t index;
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -34,272 +69,336 @@ struct ConnData
 namespace
 {
 
-  //hlper function to validate username/room name 
-  bool is_valid_name(const std::string &name)
+  //wakes a receiver thread (blocked in poll on its socket and this
+  //eventfd) when a message is added to its queue
+  class ReceiverWakeup : public MessageQueueListener
   {
-    if (name.empty())
-      return false;
-    for (char c : name)
+  public:
+    ReceiverWakeup(int sock) : fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), sock(sock) { }
+    ~ReceiverWakeup() { close(fd); }
+
+    virtual void message_available()
     {
-      if (!std::isalnum(c))
-        return false;
+      eventfd_write(fd, 1);
     }
-    return true;
-  }
 
-  //function that handles chatting with receiver
-  void chat_with_receiver(User *user, Connection *conn, Room *room)
-  {
-    while (true)
+    //a slow receiver may be stuck in a write that won't finish,
+    //so shut its socket down to get it out
+    virtual void disconnect()
     {
-      Message *msg = user->mqueue.dequeue();
-      // wait for message
-      if (!msg)
-        continue;
-      Message delivery(TAG_DELIVERY, msg->data);
-      //break out on delivery failure
-      if (!conn->send(delivery))
-      {
-        delete msg;
-        break;
-      }
-      delete msg;
+      shutdown(sock, SHUT_RDWR);
+      eventfd_write(fd, 1);
     }
-    //remove user from room upon disconnecting
-    if (room)
+
+    void clear()
     {
-      room->remove_member(user);
+      eventfd_t count;
+      eventfd_read(fd, &count);
     }
+
+    int fd;
+    int sock;
+  };
+
+  //check on a receiver's socket, returns false if the client is gone
+  bool receiver_still_connected(Connection *conn)
+  {
+    //receivers don't send anything once they have joined, so any
+    //input is discarded; EOF or an error means the client left
+    char buf[256];
+    ssize_t n = recv(conn->get_fd(), buf, sizeof(buf), MSG_DONTWAIT);
+    return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
   }
 
-  //function to handle chatting with sender
-  void chat_with_sender(User *sender, Server *server, Connection *conn, Room *&current_room)
+  //time left (in microseconds) until the latency bound for a batch
+  //whose first message was dequeued at start
+  long batch_time_left(const struct timespec &start, long delay_us)
   {
-    while (true)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_us = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+    return delay_us - elapsed_us;
+  }
+
+  //function that handles chatting with receiver
+  void chat_with_receiver(User *user, Connection *conn, const ServerConfig &config)
+  {
+    //sleep until either a message arrives or the client's socket has
+    //something to say (usually that it has disconnected), so an idle
+    //receiver uses no CPU and a departed one is reaped right away
+    ReceiverWakeup wakeup(conn->get_fd());
+    if (wakeup.fd < 0)
+      return;
+    user->mqueue->set_listener(&wakeup);
+
+    struct pollfd fds[2];
+    fds[0].fd = conn->get_fd();
+    fds[0].events = POLLIN | POLLRDHUP;
+    fds[1].fd = wakeup.fd;
+    fds[1].events = POLLIN;
+
+    //queued messages are delivered in batches of up to batch_size
+    //frames per write; a partial batch is held back for at most
+    //batch_delay_us (from when its first message was dequeued) in
+    //case more messages arrive to fill it
+    std::vector<Frame *> batch(config.batch_size);
+    size_t count = 0;
+    struct timespec batch_start;
+
+    bool connected = true;
+    while (connected)
     {
-      Message msg;
-      if (!conn->receive(msg))
+      if (count == 0)
+        clock_gettime(CLOCK_MONOTONIC, &batch_start);
+      size_t n = user->mqueue->dequeue_batch(&batch[count], batch.size() - count);
+      if (n > 0)
       {
-        //check if invalid message (should send err) or connection error (disconnect)
-        if (conn->get_last_result() == Connection::INVALID_MSG)
-        {
-          Message err(TAG_ERR, "Invalid message format");
-          if (!conn->send(err))
-            break;
-          continue;
-        }
-        //otherwise, connection error so disconnect
-        break;
+        Metrics::add(Metrics::DELIVERIES_SENT, n);
+        Metrics::add(Metrics::QUEUED_MESSAGES, -(int64_t)n);
+        Metrics::observe(Metrics::QUEUE_DELAY, Metrics::now() - batch[count]->get_created());
+        count += n;
       }
+      bool closed = user->mqueue->is_closed();
+      if (closed && user->mqueue->is_aborted())
+        break;
+
+      long time_left = 0;
+      if (count > 0 && count < batch.size() && !closed)
+        time_left = batch_time_left(batch_start, config.batch_delay_us);
 
-      //check for empty tag (invalid message)
-      if (msg.tag.empty())
+      //deliver the batch if it is full, or has waited long enough
+      if (count > 0 && time_left <= 0)
       {
-        Message err(TAG_ERR, "Invalid message format");
-        if (!conn->send(err))
-          break;
+        //break out on delivery failure (a delivery too long for a text
+        //receiver is just skipped, as the event loops do)
+        int64_t send_start = Metrics::now();
+        connected = conn->send(batch.data(), count) ||
+                    conn->get_last_result() == Connection::INVALID_MSG;
+        Metrics::observe(Metrics::SEND_TIME, Metrics::now() - send_start);
+        for (size_t i = 0; i < count; i++)
+          batch[i]->unref();
+        count = 0;
         continue;
       }
+      if (closed)
+        break;
 
-      if (msg.tag == TAG_SENDALL)
-      {
-        if (!current_room)
-        {
-          Message err(TAG_ERR, "Not in a room");
-          if (!conn->send(err))
-            break;
-          continue;
-        }
-        current_room->broadcast_message(sender->username, msg.data);
-        Message ok(TAG_OK, "Message sent");
-        if (!conn->send(ok))
-          break;
-      }
-      else if (msg.tag == TAG_JOIN)
-      {
-        if (!is_valid_name(msg.data))
-        {
-          Message err(TAG_ERR, "Invalid room name");
-          if (!conn->send(err))
-            break;
-          continue;
-        }
-        //leave current room if in one
-        if (current_room)
-        {
-          //senders don't need to be removed from room (only receivers are members)
-        }
-        //join new room
-        current_room = server->find_or_create_room(msg.data);
-        Message ok(TAG_OK, "Joined room");
-        if (!conn->send(ok))
-          break;
-      }
-      else if (msg.tag == TAG_LEAVE)
+      //wait for more messages (with a timeout if holding a batch)
+      struct timespec timeout;
+      timeout.tv_sec = time_left / 1000000L;
+      timeout.tv_nsec = (time_left % 1000000L) * 1000;
+      if (ppoll(fds, 2, count > 0 ? &timeout : nullptr, nullptr) < 0)
       {
-        if (!current_room)
-        {
-          //if not in room to leave, error
-          Message err(TAG_ERR, "Not in a room");
-          if (!conn->send(err))
-            break;
+        if (errno == EINTR)
           continue;
-        }
-        current_room = nullptr;
-        Message ok(TAG_OK, "Left room");
-        if (!conn->send(ok))
-          break;
-      }
-      else if (msg.tag == TAG_QUIT)
-      {
-        Message ok(TAG_OK, "Goodbye");
-        conn->send(ok);
         break;
       }
-      else
-      {
-        //if none of above tags, unknown command
-        Message err(TAG_ERR, "Unknown command");
-        if (!conn->send(err))
-          break;
-      }
+      if (fds[0].revents)
+        connected = receiver_still_connected(conn);
+      if (fds[1].revents)
+        wakeup.clear();
     }
+
+    for (size_t i = 0; i < count; i++)
+      batch[i]->unref();
+
+    //the wakeup must not be used once this function returns
+    user->mqueue->set_listener(nullptr);
   }
 
-  void *worker(void *arg)
+  //send the replies held back (once every message they acknowledge
+  //is on disk, if there's a message log)
+  bool send_replies(Server *server, Connection *conn, ReplyBatch &replies)
   {
-    pthread_detach(pthread_self());
+    int64_t start = Metrics::now();
+    if (replies.get_durable_lsn() && !server->get_log()->wait(replies.get_durable_lsn()))
+      replies.set_failed();
+    bool sent = conn->send(replies.get_replies(), replies.size());
+    Metrics::observe(Metrics::SEND_TIME, Metrics::now() - start);
+    replies.clear();
+    return sent;
+  }
 
+  //run by one of the worker pool's threads for as long as the client
+  //is connected
+  void serve_client(void *arg)
+  {
     // TODO: use a static cast to convert arg from a void* to
     //       whatever pointer type describes the object(s) needed
     //       to communicate with a client (sender or receiver)
     ConnData *data = static_cast<ConnData *>(arg);
     Server *server = data->server;
-    Connection *conn = data->conn;
+    Server::WorkerClient *client = data->client;
+    Connection *conn = client->conn;
     delete data;
 
-    // TODO: read login message (should be tagged either with
-    //       TAG_SLOGIN or TAG_RLOGIN), send response
-    Message login;
-    if (!conn->receive(login))
+    // the Session handles login, join, and the sender commands;
+    // this thread just feeds it messages and sends back its replies
+    Session session(server);
+    ReplyBatch replies;
+    while (true)
     {
-      //if invalid message format, send error before disconnecting
-      if (conn->get_last_result() == Connection::INVALID_MSG)
+      MessageView msg;
+      Message reply;
+      bool keep_open;
+      bool received = conn->receive_view(msg);
+      if (!received && conn->get_last_result() != Connection::INVALID_MSG)
+        break; //connection error so disconnect
+
+      int64_t start = Metrics::now();
+      Metrics::add(Metrics::MESSAGES_RECEIVED);
+      if (received)
+        keep_open = session.handle(msg, reply);
+      else
       {
-        Message err(TAG_ERR, "Invalid message format");
-        conn->send(err);
+        Metrics::add(Metrics::INVALID_MESSAGES);
+        keep_open = session.handle_invalid(reply);
       }
-      delete conn;
-      return nullptr;
-    }
-
-    //validate login tag
-    if (login.tag != TAG_SLOGIN && login.tag != TAG_RLOGIN)
-    {
-      Message err(TAG_ERR, "Invalid login tag");
-      conn->send(err);
-      delete conn;
-      return nullptr;
-    }
-
-    //validate username
-    if (!is_valid_name(login.data))
-    {
-      Message err(TAG_ERR, "Invalid username");
-      conn->send(err);
-      delete conn;
-      return nullptr;
-    }
-
-    // TODO: depending on whether the client logged in as a sender or
-    //       receiver, communicate with the client (implementing
-    //       separate helper functions for each of these possibilities
-    //       is a good idea)
-    if (login.tag == TAG_RLOGIN)
-    {
-      User *user = new User(login.data);
-      Message ok(TAG_OK, "Logged in as receiver");
-      if (!conn->send(ok))
+      Metrics::observe(Metrics::REQUEST_TIME, Metrics::now() - start);
+
+      //the replies to requests the client has pipelined are sent
+      //together once there are no more whole requests to handle (or
+      //the protocol or the session's state changes), rather than one
+      //write per request; and a sendall isn't acknowledged until its
+      //message is on disk, so a batch of them shares one flush
+      replies.add(session, reply);
+      if (!keep_open || replies.size() >= ReplyBatch::MAX_SIZE ||
+          session.get_protocol() != conn->get_protocol() ||
+          session.get_state() == Session::RECEIVING || !conn->has_buffered_message())
       {
-        delete user;
-        delete conn;
-        return nullptr;
+        if (!send_replies(server, conn, replies))
+          break;
       }
+      if (!keep_open)
+        break;
+      conn->set_protocol(session.get_protocol());
 
-      //wait for join message from receiver
-      Message join_msg;
-      if (!conn->receive(join_msg))
+      //once a receiver has joined its room, all that's left
+      //is delivering its messages
+      if (session.get_state() == Session::RECEIVING)
       {
-        //if invalid message format, send error before disconnecting
-        if (conn->get_last_result() == Connection::INVALID_MSG)
-        {
-          Message err(TAG_ERR, "Invalid message format");
-          conn->send(err);
-        }
-        delete user;
-        delete conn;
-        return nullptr;
+        //first catch the receiver up on the room's recent messages,
+        //in one write
+        std::vector<Frame *> replay;
+        session.take_replay(replay);
+        bool sent = replay.empty() || conn->send(replay.data(), replay.size()) ||
+                    conn->get_last_result() == Connection::INVALID_MSG;
+        for (Frame *frame : replay)
+          frame->unref();
+        if (!sent)
+          break;
+        server->start_receiving(client, session.get_user()->mqueue);
+        chat_with_receiver(session.get_user(), conn, server->get_config());
+        break;
       }
+    }
 
-      if (join_msg.tag != TAG_JOIN)
-      {
-        Message err(TAG_ERR, "Expected join message");
-        conn->send(err);
-        delete user;
-        delete conn;
-        return nullptr;
-      }
+    //session destructor removes a receiver from its room (after the
+    //server has forgotten about its queue)
+    server->remove_worker(client);
+    delete client;
+    delete conn;
+    Metrics::add(Metrics::DISCONNECTIONS);
+  }
 
-      //validate room name
-      if (!is_valid_name(join_msg.data))
-      {
-        Message err(TAG_ERR, "Invalid room name");
-        conn->send(err);
-        delete user;
-        delete conn;
-        return nullptr;
-      }
+  //put a message read back from the message log into its room's history
+  void recover_message(const Slice &room, const Slice &sender, const Slice &text, void *arg)
+  {
+    Server *server = static_cast<Server *>(arg);
+    Room *restored = server->find_or_create_room(room.str());
+    restored->restore_message(sender.str(), text);
+    server->release_room(restored);
+  }
 
-      //join room
-      Room *room = server->find_or_create_room(join_msg.data);
-      room->add_member(user);
-      Message join_ok(TAG_OK, "Joined room");
-      if (!conn->send(join_ok))
-      {
-        room->remove_member(user);
-        delete user;
-        delete conn;
-        return nullptr;
-      }
+  //run by each acceptor thread but the first
+  void *acceptor(void *arg)
+  {
+    AcceptorData *data = static_cast<AcceptorData *>(arg);
+    data->server->accept_clients(data->index);
+    return nullptr;
+  }
 
-      chat_with_receiver(user, conn, room);
-      delete user;
-      delete conn;
-    }
-    else if (login.tag == TAG_SLOGIN)
+  //like open_listenfd, but the socket is non-blocking (so acceptors
+  //can take every connection waiting without polling in between), has
+  //a backlog as long as the system allows (so a burst of connections
+  //isn't turned away while they're accepted), and is opened with
+  //SO_REUSEPORT if reuse_port, so others can listen on the port too
+  int open_listener(const std::string &port, bool reuse_port)
+  {
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(nullptr, port.c_str(), &hints, &addrs) != 0)
+      return -1;
+
+    int ssock = -1;
+    for (struct addrinfo *p = addrs; p; p = p->ai_next)
     {
-      User *sender = new User(login.data);
-      Message ok(TAG_OK, "Logged in as sender");
-      if (!conn->send(ok))
-      {
-        delete sender;
-        delete conn;
-        return nullptr;
-      }
-
-      //sender starts with no room
-      Room *current_room = nullptr;
-      chat_with_sender(sender, server, conn, current_room);
-      delete sender;
-      delete conn;
+      ssock = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+      if (ssock < 0)
+        continue;
+      int one = 1;
+      setsockopt(ssock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if ((!reuse_port || setsockopt(ssock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0) &&
+          bind(ssock, p->ai_addr, p->ai_addrlen) == 0 && ::listen(ssock, SOMAXCONN) == 0)
+        break;
+      close(ssock);
+      ssock = -1;
     }
-    else
+    freeaddrinfo(addrs);
+    return ssock;
+  }
+
+  //answer scrapes of the metrics port (one request per connection)
+  //until a shutdown is requested (the server joins the thread before
+  //it frees what the metrics are rendered from)
+  void *serve_metrics(void *arg)
+  {
+    Server *server = static_cast<Server *>(arg);
+    int ssock = server->get_metrics_socket();
+    struct pollfd fds[2];
+    fds[0].fd = ssock;
+    fds[0].events = POLLIN;
+    fds[1].fd = server->get_stop_fd();
+    fds[1].events = POLLIN;
+    bool full = false;
+    while (true)
     {
-      Message err(TAG_ERR, "Invalid login tag");
-      conn->send(err);
-      delete conn;
-    }
+      //out of descriptors, the socket stays readable: wait a moment (for
+      //the stop eventfd only) rather than spin, as the acceptors do
+      if (poll(full ? &fds[1] : fds, full ? 1 : 2, full ? ACCEPT_RETRY_MS : -1) < 0 && errno != EINTR)
+        break;
+      if (fds[1].revents)
+        break;
+      int csock = accept4(ssock, nullptr, nullptr, SOCK_CLOEXEC);
+      full = csock < 0 && (errno == EMFILE || errno == ENFILE);
+      if (csock < 0 && (errno == EBADF || errno == EINVAL))
+        break;
+      if (csock < 0)
+        continue;
 
+      //the request itself doesn't matter (whatever is asked for gets
+      //the metrics), but a client that never sends one is given up on
+      struct timeval timeout = { 1, 0 };
+      setsockopt(csock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      std::string request;
+      char buf[1024];
+      ssize_t n;
+      while (request.find("\r\n\r\n") == std::string::npos &&
+             request.find("\n\n") == std::string::npos &&
+             request.size() < 8192 && (n = read(csock, buf, sizeof(buf))) > 0)
+        request.append(buf, n);
+
+      std::string body;
+      server->render_metrics(body);
+      std::string response = "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                             "Connection: close\r\n\r\n" + body;
+      rio_writen(csock, const_cast<char *>(response.data()), response.size());
+      close(csock);
+    }
     return nullptr;
   }
 
@@ -309,62 +408,424 @@ namespace
 // Server member function implementation
 ////////////////////////////////////////////////////////////////////////
 
-Server::Server(int port)
-    : m_port(port), m_ssock(-1)
+Server::Server(int port, const ServerConfig &config)
+    : m_port(port), m_metrics_sock(-1), m_config(config),
+      m_rooms(config.history_messages, config.history_bytes, config.numbered, config.idle_rooms),
+      m_pool(nullptr), m_log(nullptr),
+      m_stop_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), m_stopping(false), m_next_loop(0),
+      m_queues_closed(false)
 {
   // TODO: initialize mutex
-  pthread_mutex_init(&m_lock, nullptr);
+  //(the room registry has its own locks)
+  pthread_mutex_init(&m_workers_lock, nullptr);
 }
 
 Server::~Server()
 {
   // TODO: destroy mutex
-  pthread_mutex_destroy(&m_lock);
-  for (auto &pair : m_rooms)
-    delete pair.second;
+  //(the room registry deletes the rooms; the log goes first, since its
+  //flusher notifies the event loops)
+  delete m_log;
+  for (EventLoop *loop : m_loops)
+    delete loop;
+  delete m_pool;
+  for (int ssock : m_ssocks)
+  {
+    if (ssock >= 0)
+      close(ssock);
+  }
+  if (m_metrics_sock >= 0)
+    close(m_metrics_sock);
+  close(m_stop_fd);
+  pthread_mutex_destroy(&m_workers_lock);
 }
 
 bool Server::listen()
 {
   // TODO: use open_listenfd to create the server socket, return true
   //       if successful, false if not
+  //(each acceptor gets a socket of its own, rather than them all
+  //contending for one socket's queue of connections)
   std::string port_str = std::to_string(m_port);
-  m_ssock = open_listenfd(port_str.c_str());
-  if (m_ssock < 0)
+  for (int i = 0; i < m_config.num_acceptors; i++)
+  {
+    int ssock = open_listener(port_str, m_config.num_acceptors > 1);
+    if (ssock < 0)
+      return false;
+    m_ssocks.push_back(ssock);
+  }
+  if (m_config.metrics_port > 0 && !listen_metrics())
+    return false;
+  return true;
+}
+
+bool Server::open_log()
+{
+  m_log = new MessageLog(m_config.log_dir);
+  return m_log->open(recover_message, this);
+}
+
+bool Server::listen_metrics()
+{
+  //only reachable from this host: the metrics aren't for clients
+  m_metrics_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (m_metrics_sock < 0)
     return false;
+  int one = 1;
+  setsockopt(m_metrics_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(m_config.metrics_port);
+  if (bind(m_metrics_sock, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      ::listen(m_metrics_sock, 16) < 0)
+  {
+    close(m_metrics_sock);
+    m_metrics_sock = -1;
+    return false;
+  }
   return true;
 }
 
+void Server::render_metrics(std::string &out) const
+{
+  Metrics::render(out);
+
+  //rooms that have had to drop messages for slow receivers
+  out += "# HELP chat_room_dropped_total Deliveries dropped by a room's full queues\n";
+  out += "# TYPE chat_room_dropped_total counter\n";
+  m_rooms.for_each([&out](Room *room) {
+    unsigned long dropped = room->get_dropped_count();
+    if (dropped > 0)
+      Metrics::render_labeled(out, "chat_room_dropped_total", "room", room->get_room_name(), dropped);
+  });
+}
+
 void Server::handle_client_requests()
+{
+  pthread_t metrics_tid;
+  bool metrics = m_metrics_sock >= 0 &&
+                 pthread_create(&metrics_tid, nullptr, serve_metrics, this) == 0;
+
+  if (m_config.engine == ENGINE_EPOLL || m_config.engine == ENGINE_URING)
+    handle_epoll_clients();
+  else
+    handle_thread_clients();
+
+  //the clients are gone; stop the metrics thread too (also when they
+  //stopped being served without a shutdown being requested, because an
+  //engine couldn't start) before anything it renders can be freed
+  if (metrics)
+  {
+    request_shutdown();
+    pthread_join(metrics_tid, nullptr);
+  }
+}
+
+void Server::request_shutdown()
+{
+  m_stopping.store(true);
+  eventfd_write(m_stop_fd, 1);
+}
+
+void Server::run_acceptors()
+{
+  std::vector<pthread_t> threads;
+  std::vector<AcceptorData> data(m_ssocks.size());
+  for (size_t i = 1; i < m_ssocks.size(); i++)
+  {
+    data[i] = AcceptorData{this, i};
+    pthread_t tid;
+    if (pthread_create(&tid, nullptr, acceptor, &data[i]) == 0)
+      threads.push_back(tid);
+  }
+  accept_clients(0);
+  for (pthread_t tid : threads)
+    pthread_join(tid, nullptr);
+}
+
+void Server::accept_clients(size_t index)
+{
+  int ssock = m_ssocks[index];
+  //the thread engine's clients are served with blocking I/O
+  int flags = m_config.engine == ENGINE_THREAD ? SOCK_CLOEXEC : SOCK_NONBLOCK | SOCK_CLOEXEC;
+  struct pollfd fds[2];
+  fds[0].fd = ssock;
+  fds[0].events = POLLIN;
+  fds[1].fd = m_stop_fd;
+  fds[1].events = POLLIN;
+  while (!m_stopping.load())
+  {
+    //take every connection that's waiting, and only then wait for more
+    int csock = accept4(ssock, nullptr, nullptr, flags);
+    if (csock >= 0)
+    {
+      start_client(csock);
+      continue;
+    }
+
+    //out of descriptors, the socket stays readable: rather than spin,
+    //give clients a moment to disconnect (the backlog holds the rest)
+    bool full = errno == EMFILE || errno == ENFILE;
+    if (poll(full ? &fds[1] : fds, full ? 1 : 2, full ? ACCEPT_RETRY_MS : -1) < 0 && errno != EINTR)
+      break;
+  }
+
+  //refuse new connections from now on
+  close(ssock);
+  m_ssocks[index] = -1;
+}
+
+void Server::start_client(int csock)
+{
+  Metrics::add(Metrics::CONNECTIONS);
+
+  //the event loops get clients round-robin
+  if (!m_loops.empty())
+  {
+    m_loops[m_next_loop.fetch_add(1) % m_loops.size()]->add_client(csock);
+    return;
+  }
+
+  //the client is registered before a worker takes it, so draining
+  //can't miss it
+  WorkerClient *client = new WorkerClient{new Connection(csock), nullptr};
+  {
+    Guard g(m_workers_lock);
+    m_workers.push_back(client);
+  }
+  ConnData *data = new ConnData{this, client};
+  if (!m_pool->submit(serve_client, data))
+  {
+    //every worker is busy and too many clients are waiting already:
+    //tell the client rather than just hanging up
+    remove_worker(client);
+    client->conn->send(Message(TAG_ERR, "server is busy, try again later"));
+    delete client->conn;
+    delete client;
+    delete data;
+    Metrics::add(Metrics::REJECTIONS);
+    Metrics::add(Metrics::DISCONNECTIONS);
+  }
+}
+
+void Server::handle_thread_clients()
 {
   // TODO: infinite loop calling accept or Accept, starting a new
   //       pthread for each connected client
-  while (true)
+  //(the clients are served by a pool of threads, started ahead of
+  //time rather than one per client as it's accepted)
+  m_pool = new WorkerPool(m_config.min_spare_workers, m_config.max_workers,
+                          m_config.worker_stack_kb * 1024, m_config.max_waiting);
+  if (!m_pool->start())
   {
-    sockaddr_in cli_addr;
-    socklen_t cli_len = sizeof(cli_addr);
-    int csock = accept(m_ssock, (sockaddr *)&cli_addr, &cli_len);
-    if (csock < 0)
-      continue;
+    std::cerr << "Could not start worker threads\n";
+    return;
+  }
+  run_acceptors();
+  drain_thread_clients();
+  m_pool->stop();
+}
 
-    Connection *conn = new Connection(csock);
-    ConnData *data = new ConnData{this, conn};
+void Server::remove_worker(WorkerClient *client)
+{
+  Guard g(m_workers_lock);
+  m_workers.erase(std::find(m_workers.begin(), m_workers.end(), client));
+}
 
-    pthread_t tid;
-    pthread_create(&tid, nullptr, worker, data);
+void Server::start_receiving(WorkerClient *client, MessageQueue *mqueue)
+{
+  Guard g(m_workers_lock);
+  client->mqueue = mqueue;
+  if (m_queues_closed)
+    mqueue->close();
+}
+
+namespace
+{
+
+  //wait (polling) until done() or the deadline (a Metrics::now time)
+  template <typename Fn>
+  bool wait_until(Fn done, int64_t deadline)
+  {
+    while (!done())
+    {
+      if (Metrics::now() >= deadline)
+        return false;
+      usleep(DRAIN_POLL_US);
+    }
+    return true;
+  }
+
+}
+
+void Server::drain_thread_clients()
+{
+  int64_t start = Metrics::now();
+  int64_t deadline = start + m_config.drain_timeout_ms * 1000000L;
+  size_t clients;
+  auto receivers_only = [this] {
+    Guard g(m_workers_lock);
+    for (WorkerClient *client : m_workers)
+    {
+      if (!client->mqueue)
+        return false;
+    }
+    return true;
+  };
+  auto all_gone = [this] {
+    Guard g(m_workers_lock);
+    return m_workers.empty();
+  };
+
+  //a sender's thread carries on until it has answered the requests it
+  //has already read, then sees EOF (a receiver's socket is left alone,
+  //since its thread takes EOF to mean the receiver has gone)
+  {
+    Guard g(m_workers_lock);
+    clients = m_workers.size();
+    for (WorkerClient *client : m_workers)
+    {
+      if (!client->mqueue)
+        shutdown(client->conn->get_fd(), SHUT_RD);
+    }
+  }
+  wait_until(receivers_only, deadline);
+
+  //closing a receiver's queue has its thread send what's left in it
+  //and then finish
+  {
+    Guard g(m_workers_lock);
+    m_queues_closed = true;
+    for (WorkerClient *client : m_workers)
+    {
+      if (client->mqueue)
+        client->mqueue->close();
+    }
+  }
+  size_t forced = 0;
+  if (!wait_until(all_gone, deadline))
+  {
+    //out of time: disconnect everyone left (which gets any thread
+    //stuck writing to a slow client out of the write)
+    Guard g(m_workers_lock);
+    forced = m_workers.size();
+    for (WorkerClient *client : m_workers)
+      shutdown(client->conn->get_fd(), SHUT_RDWR);
   }
+  wait_until(all_gone, INT64_MAX);
+  report_drain(start, clients, forced);
+}
+
+void Server::report_drain(int64_t start, size_t clients, size_t forced) const
+{
+  std::cerr << "Shut down: drained " << clients << " clients in "
+            << (Metrics::now() - start) / 1000000 << " ms";
+  if (forced > 0)
+    std::cerr << " (" << forced << " disconnected at the deadline)";
+  std::cerr << "\n";
+}
+
+void Server::handle_epoll_clients()
+{
+  //start the event loops (which do their I/O with epoll or io_uring)
+  bool uring = m_config.engine == ENGINE_URING;
+  for (int i = 0; i < m_config.num_loops; i++)
+  {
+    EventLoop *loop = new EventLoop(this, uring);
+    if (!loop->start())
+    {
+      delete loop;
+      //without io_uring (an old kernel, or one that has it turned
+      //off), fall back to a thread per client
+      if (uring && i == 0)
+      {
+        std::cerr << "io_uring is not available, using the thread engine\n";
+        m_config.engine = ENGINE_THREAD;
+        handle_thread_clients();
+        return;
+      }
+      std::cerr << "Could not start event loop\n";
+      //stop the loops already started (nothing is accepted yet, so
+      //they have no clients to drain)
+      for (EventLoop *started : m_loops)
+      {
+        started->drain(EventLoop::CLOSE_ALL);
+        started->join();
+      }
+      return;
+    }
+    m_loops.push_back(loop);
+  }
+
+  //accept clients, spreading them round-robin over the loops
+  run_acceptors();
+  drain_loops();
+}
+
+void Server::drain_loops()
+{
+  int64_t start = Metrics::now();
+  int64_t deadline = start + m_config.drain_timeout_ms * 1000000L;
+  size_t clients = 0;
+  for (EventLoop *loop : m_loops)
+    clients += loop->get_num_clients();
+  auto done = [this](EventLoop::Drain phase) {
+    return [this, phase] {
+      for (EventLoop *loop : m_loops)
+      {
+        if (loop->get_drain_left(phase) != 0)
+          return false;
+      }
+      return true;
+    };
+  };
+
+  //the same steps as for the thread engine, which each loop takes for
+  //its own clients
+  for (EventLoop *loop : m_loops)
+    loop->drain(EventLoop::STOP_SENDERS);
+  wait_until(done(EventLoop::STOP_SENDERS), deadline);
+
+  for (EventLoop *loop : m_loops)
+    loop->drain(EventLoop::CLOSE_QUEUES);
+  size_t forced = 0;
+  if (!wait_until(done(EventLoop::CLOSE_QUEUES), deadline))
+  {
+    for (EventLoop *loop : m_loops)
+    {
+      forced += loop->get_num_clients();
+      loop->drain(EventLoop::CLOSE_ALL);
+    }
+  }
+  for (EventLoop *loop : m_loops)
+    loop->join();
+  report_drain(start, clients, forced);
 }
 
 Room *Server::find_or_create_room(const std::string &room_name)
 {
   // TODO: return a pointer to the unique Room object representing
   //       the named chat room, creating a new one if necessary
-  Guard g(m_lock);
-  auto it = m_rooms.find(room_name);
-  if (it != m_rooms.end())
-    return it->second;
-
-  Room *room = new Room(room_name);
-  m_rooms[room_name] = room;
-  return room;
+  //joining an existing room doesn't lock anything, and creating one
+  //only locks a stripe of the registry
+  return m_rooms.acquire(room_name);
+}
+
+void Server::release_room(Room *room)
+{
+  //a room nobody is in (and that has no history) is removed
+  m_rooms.release(room);
+}
+
+void Server::subscribe(Subscription *sub, const std::string &pattern, size_t replay,
+                       std::vector<Frame *> *replay_frames)
+{
+  m_rooms.subscribe(sub, pattern, replay, replay_frames);
+}
+
+void Server::unsubscribe(Subscription *sub)
+{
+  m_rooms.unsubscribe(sub);
 }
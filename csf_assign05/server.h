@@ -1,35 +1,209 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <map>
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <atomic>
 #include <pthread.h>
+#include "message_queue.h"
+#include "room_registry.h"
+#include "user_directory.h"
 class Room;
+class EventLoop;
+class MessageLog;
+class Connection;
+class WorkerPool;
+class Subscription;
+class Frame;
+
+// Engines the server can use to communicate with clients
+enum ServerEngine {
+  ENGINE_THREAD, // one thread (with blocking I/O) per client
+  ENGINE_EPOLL,  // fixed pool of epoll event loops, non-blocking I/O
+  ENGINE_URING,  // the same event loops, doing their I/O through io_uring
+                 // (or ENGINE_THREAD where io_uring isn't available)
+};
+
+// Server settings chosen at startup
+struct ServerConfig {
+  ServerEngine engine;
+  int num_loops; // number of event loop threads (epoll and uring engines)
+
+  // number of threads accepting connections, each with a listening
+  // socket of its own (with more than one, the sockets share the port
+  // through SO_REUSEPORT, and the kernel spreads connections over them)
+  int num_acceptors;
+
+  // the thread engine serves each client on a thread from a pool that
+  // keeps min_spare_workers threads idle (so accepting a client never
+  // has to start one) and grows to at most max_workers, with stacks of
+  // worker_stack_kb KB; once they're all busy, up to max_waiting
+  // clients wait for one, and further clients are turned away
+  size_t min_spare_workers;
+  size_t max_workers;
+  size_t worker_stack_kb;
+  size_t max_waiting;
+
+  // a receiver's queued messages are written in batches of at most
+  // batch_size frames, and a partial batch is held for at most
+  // batch_delay_us microseconds waiting for more (thread engine)
+  size_t batch_size;
+  long batch_delay_us;
+
+  // implementation used for each receiver's MessageQueue
+  MessageQueue::Kind queue_kind;
+
+  // each receiver's queue holds at most queue_capacity messages
+  // (0 means no limit), and overflow_policy says what happens to a
+  // receiver too slow to keep its queue from filling up
+  size_t queue_capacity;
+  MessageQueue::OverflowPolicy overflow_policy;
+
+  // port (on localhost) serving the server's metrics over HTTP in the
+  // Prometheus text format, 0 for none
+  int metrics_port;
+
+  // each room keeps its last history_messages messages (and at most
+  // about history_bytes bytes of them, unless that is 0), and a
+  // receiver that joins a room is first sent the last replay_messages
+  // of them
+  size_t history_messages;
+  size_t history_bytes;
+  size_t replay_messages;
+
+  // each room numbers its messages, and deliveries carry the number
+  // ("room@seq" in place of the room's name; see Room)
+  bool numbered;
+
+  // at most (about) this many rooms are kept for their history once
+  // nobody is in them (the ones empty longest are removed first)
+  size_t idle_rooms;
+
+  // if not empty, every message sent to a room is saved in a log in
+  // this directory (and the rooms' history is reloaded from it)
+  std::string log_dir;
+
+  // at shutdown, clients get this long to be answered and sent what
+  // is queued for them before they're disconnected
+  long drain_timeout_ms;
+
+  ServerConfig()
+    : engine(ENGINE_THREAD), num_loops(4), num_acceptors(1),
+      min_spare_workers(16), max_workers(10000), worker_stack_kb(256), max_waiting(1024),
+      batch_size(64), batch_delay_us(0),
+      queue_kind(MessageQueue::LOCKED),
+      queue_capacity(0), overflow_policy(MessageQueue::DROP_OLDEST),
+      metrics_port(0),
+      history_messages(0), history_bytes(0), replay_messages(0), numbered(false),
+      idle_rooms(1024),
+      drain_timeout_ms(5000) { }
+};
 
 class Server {
 public:
-  Server(int port);
+  Server(int port, const ServerConfig &config = ServerConfig());
   ~Server();
 
+  const ServerConfig &get_config() const { return m_config; }
+
   bool listen();
 
+  // open the message log (ServerConfig::log_dir), reloading the
+  // messages in it into the rooms' history; false on error
+  bool open_log();
+
+  // the message log, nullptr if there is none
+  MessageLog *get_log() const { return m_log; }
+
+  // accept and serve clients until request_shutdown is called, then
+  // drain the clients (see drain_thread_clients and drain_loops)
   void handle_client_requests();
 
+  // make handle_client_requests stop accepting clients and return
+  // once it has drained them; safe to call from a signal handler
+  void request_shutdown();
+
+  // accept clients on the index'th listening socket until a shutdown
+  // is requested, then close it (run by each acceptor thread)
+  void accept_clients(size_t index);
+
+  // a thread engine worker's client, registered (by the accepting
+  // thread) so it can be drained at shutdown
+  struct WorkerClient {
+    Connection *conn;
+    MessageQueue *mqueue; // the receiver's queue, once it has joined
+  };
+  void remove_worker(WorkerClient *client);
+
+  // the worker's client has joined a room as a receiver (whose queue
+  // is closed right away if the server is already draining receivers)
+  void start_receiving(WorkerClient *client, MessageQueue *mqueue);
+
+  // return the named room, creating it if necessary, with a reference
+  // to give back with release_room (see RoomRegistry)
   Room *find_or_create_room(const std::string &room_name);
+  void release_room(Room *room);
+
+  // add a room, or every room matching a pattern ("prefix*"), to a
+  // receiver's subscription, and remove them all again (see
+  // RoomRegistry::subscribe)
+  void subscribe(Subscription *sub, const std::string &pattern, size_t replay,
+                 std::vector<Frame *> *replay_frames);
+  void unsubscribe(Subscription *sub);
+
+  // every receiver that has joined a room, by username
+  UserDirectory *get_users() { return &m_users; }
+
+  // append the current metrics (see Metrics) to out
+  void render_metrics(std::string &out) const;
+  int get_metrics_socket() const { return m_metrics_sock; }
+  int get_stop_fd() const { return m_stop_fd; }
 
 private:
   // prohibit value semantics
   Server(const Server &);
   Server &operator=(const Server &);
 
-  typedef std::map<std::string, Room *> RoomMap;
+  void handle_thread_clients();
+  void handle_epoll_clients();
+  bool listen_metrics();
+
+  // run accept_clients on every listening socket (the first in this
+  // thread), returning once they have all stopped
+  void run_acceptors();
+
+  // hand a newly accepted client to a worker thread or an event loop
+  // (or turn it away if the worker pool is saturated)
+  void start_client(int csock);
+
+  // first stop reading requests from senders (and clients that haven't
+  // joined a room yet) once their pending requests are answered, then
+  // let receivers write out what's queued for them, and after the
+  // deadline (ServerConfig::drain_timeout_ms) disconnect whoever is
+  // left; return once every client is gone
+  void drain_thread_clients();
+  void drain_loops();
+  void report_drain(int64_t start, size_t clients, size_t forced) const;
 
   // These member variables are sufficient for implementing
   // the server operations
   int m_port;
-  int m_ssock;
-  RoomMap m_rooms;
-  pthread_mutex_t m_lock;
+  std::vector<int> m_ssocks; // listening sockets, one per acceptor
+  int m_metrics_sock;
+  ServerConfig m_config;
+  RoomRegistry m_rooms;
+  UserDirectory m_users;
+  std::vector<EventLoop *> m_loops;
+  WorkerPool *m_pool;     // the thread engine's worker threads
+  MessageLog *m_log;
+  int m_stop_fd;          // eventfd written to request a shutdown
+  std::atomic<bool> m_stopping; // (and set) for acceptors busy accepting
+  std::atomic<size_t> m_next_loop; // loop the next client goes to
+
+  pthread_mutex_t m_workers_lock;
+  std::vector<WorkerClient *> m_workers;
+  bool m_queues_closed;   // the receivers are being drained
 };
 
 #endif // SERVER_H
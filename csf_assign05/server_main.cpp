@@ -1,29 +1,219 @@
 #include <iostream>
+#include <string>
 #include <csignal>
+#include <cstring>
+#include <unistd.h>
 #include "server.h"
 
 // If you implement the Server class as described by its
 // TODO comments, you should not need to make any changes
 // to this main function.
 
+static void usage() {
+  std::cerr << "Usage: server_main [-e thread|epoll|uring] [-t loops] [-A acceptors] "
+               "[-W max_workers] [-Q max_waiting] [-K worker_stack_kb] "
+               "[-b batch_size] [-d batch_delay_us] [-q locked|lockfree] "
+               "[-c queue_capacity] [-p oldest|newest|disconnect] "
+               "[-m metrics_port] [-H history_messages] [-B history_bytes] "
+               "[-r replay_messages] [-I idle_rooms] [-n] [-L log_dir] [-S drain_timeout_ms] <port>\n";
+}
+
+static Server *g_server;
+
+// SIGINT and SIGTERM shut the server down gracefully
+static void handle_shutdown_signal(int) {
+  g_server->request_shutdown();
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    std::cerr << "Usage: server_main <port>\n";
+  ServerConfig config;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "e:t:A:W:Q:K:b:d:q:c:p:m:H:B:r:I:nL:S:")) != -1) {
+    switch (opt) {
+    case 'e':
+      if (std::string(optarg) == "thread") {
+        config.engine = ENGINE_THREAD;
+      } else if (std::string(optarg) == "epoll") {
+        config.engine = ENGINE_EPOLL;
+      } else if (std::string(optarg) == "uring") {
+        config.engine = ENGINE_URING;
+      } else {
+        usage();
+        return 1;
+      }
+      break;
+    case 't':
+      config.num_loops = std::stoi(optarg);
+      if (config.num_loops < 1) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'A':
+      config.num_acceptors = std::stoi(optarg);
+      if (config.num_acceptors < 1) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'W':
+      if (std::stol(optarg) < 1) {
+        usage();
+        return 1;
+      }
+      config.max_workers = std::stol(optarg);
+      break;
+    case 'Q':
+      if (std::stol(optarg) < 0) {
+        usage();
+        return 1;
+      }
+      config.max_waiting = std::stol(optarg);
+      break;
+    case 'K':
+      if (std::stol(optarg) < 64) {
+        usage();
+        return 1;
+      }
+      config.worker_stack_kb = std::stol(optarg);
+      break;
+    case 'b':
+      if (std::stoi(optarg) < 1) {
+        usage();
+        return 1;
+      }
+      config.batch_size = std::stoi(optarg);
+      break;
+    case 'd':
+      config.batch_delay_us = std::stol(optarg);
+      if (config.batch_delay_us < 0) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'q':
+      if (std::string(optarg) == "locked") {
+        config.queue_kind = MessageQueue::LOCKED;
+      } else if (std::string(optarg) == "lockfree") {
+        config.queue_kind = MessageQueue::LOCK_FREE;
+      } else {
+        usage();
+        return 1;
+      }
+      break;
+    case 'c':
+      if (std::stol(optarg) < 0) {
+        usage();
+        return 1;
+      }
+      config.queue_capacity = std::stol(optarg);
+      break;
+    case 'p':
+      if (std::string(optarg) == "oldest") {
+        config.overflow_policy = MessageQueue::DROP_OLDEST;
+      } else if (std::string(optarg) == "newest") {
+        config.overflow_policy = MessageQueue::DROP_NEWEST;
+      } else if (std::string(optarg) == "disconnect") {
+        config.overflow_policy = MessageQueue::DISCONNECT;
+      } else {
+        usage();
+        return 1;
+      }
+      break;
+    case 'm':
+      config.metrics_port = std::stoi(optarg);
+      if (config.metrics_port < 1 || config.metrics_port > 65535) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'H':
+      if (std::stol(optarg) < 0) {
+        usage();
+        return 1;
+      }
+      config.history_messages = std::stol(optarg);
+      break;
+    case 'B':
+      if (std::stol(optarg) < 0) {
+        usage();
+        return 1;
+      }
+      config.history_bytes = std::stol(optarg);
+      break;
+    case 'r':
+      if (std::stol(optarg) < 0) {
+        usage();
+        return 1;
+      }
+      config.replay_messages = std::stol(optarg);
+      break;
+    case 'I':
+      if (std::stol(optarg) < 0) {
+        usage();
+        return 1;
+      }
+      config.idle_rooms = std::stol(optarg);
+      break;
+    case 'n':
+      config.numbered = true;
+      break;
+    case 'L':
+      config.log_dir = optarg;
+      break;
+    case 'S':
+      config.drain_timeout_ms = std::stol(optarg);
+      if (config.drain_timeout_ms < 0) {
+        usage();
+        return 1;
+      }
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage();
     return 1;
   }
 
-  int port = std::stoi(argv[1]);
+  int port = std::stoi(argv[optind]);
+
+  // replaying messages needs a history at least that long, and a
+  // message log reloads the last messages into the rooms' history
+  if (config.history_messages < config.replay_messages) {
+    config.history_messages = config.replay_messages;
+  }
+  if (!config.log_dir.empty() && config.history_messages == 0) {
+    config.history_messages = 100;
+  }
 
   // ignore SIGPIPE: when the server sends data to the receive client,
   // it may find that the connection has been terminated (e.g., if the
   // receive client exited)
   signal(SIGPIPE, SIG_IGN);
 
-  Server server(port);
+  Server server(port, config);
+  if (!config.log_dir.empty() && !server.open_log()) {
+    std::cerr << "Could not open message log in " << config.log_dir << "\n";
+    return 1;
+  }
   if (!server.listen()) {
     std::cerr << "Could not listen on port " << port << "\n";
     return 1;
   }
 
+  g_server = &server;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_shutdown_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
   server.handle_client_requests();
+  return 0;
 }
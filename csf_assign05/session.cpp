@@ -0,0 +1,336 @@
+#include <cctype>
+#include "message.h"
+#include "frame.h"
+#include "user.h"
+#include "room.h"
+#include "subscription.h"
+#include "server.h"
+#include "message_log.h"
+#include "session.h"
+
+namespace
+{
+
+  //hlper function to validate username/room name
+  bool is_valid_name(const Slice &name)
+  {
+    if (name.empty())
+      return false;
+    for (size_t i = 0; i < name.len; i++)
+    {
+      if (!std::isalnum((unsigned char)name.data[i]))
+        return false;
+    }
+    return true;
+  }
+
+  //a receiver's join names one or more rooms, or patterns matching
+  //every room whose name starts with a prefix ("prefix*", or just "*"
+  //for every room), separated by commas; false if any is invalid
+  bool parse_rooms(const Slice &list, std::vector<std::string> &patterns)
+  {
+    const char *p = list.data, *end = list.data + list.len;
+    while (true)
+    {
+      const char *comma = static_cast<const char *>(memchr(p, ',', end - p));
+      Slice pattern(p, (comma ? comma : end) - p);
+      bool prefix = !pattern.empty() && pattern.data[pattern.len - 1] == '*';
+      Slice name(pattern.data, pattern.len - (prefix ? 1 : 0));
+      if (!is_valid_name(name) && !(prefix && name.empty()))
+        return false;
+      patterns.push_back(pattern.str());
+      if (!comma)
+        return true;
+      p = comma + 1;
+    }
+  }
+
+}
+
+Session::Session(Server *server)
+    : m_server(server), m_state(LOGIN), m_protocol(PROTO_TEXT), m_user(nullptr), m_room(nullptr),
+      m_subscription(nullptr), m_durable_lsn(0)
+{
+}
+
+Session::~Session()
+{
+  //remove receiver from its rooms upon disconnecting
+  if (m_subscription)
+  {
+    m_server->get_users()->remove(m_user);
+    m_server->unsubscribe(m_subscription);
+    delete m_subscription;
+  }
+  if (m_room)
+    m_server->release_room(m_room);
+  if (m_user)
+    m_user->unref();
+  for (Frame *frame : m_replay)
+    frame->unref();
+}
+
+bool Session::handle(const MessageView &msg, Message &reply)
+{
+  m_durable_lsn = 0;
+  switch (m_state)
+  {
+  case LOGIN:
+    //the protocol can be chosen before logging in
+    if (msg.tag == TAG_PROTO)
+      return handle_proto(msg, reply);
+    return handle_login(msg, reply);
+  case JOIN:
+    return handle_join(msg, reply);
+  case SENDING:
+    return handle_sender(msg, reply);
+  default:
+    //receivers don't send anything once they have joined
+    return true;
+  }
+}
+
+bool Session::handle_invalid(Message &reply)
+{
+  reply = Message(TAG_ERR, "Invalid message format");
+  //only a sender can carry on after an invalid message
+  return m_state == SENDING;
+}
+
+bool Session::handle_proto(const MessageView &msg, Message &reply)
+{
+  if (msg.data == "text")
+    m_protocol = PROTO_TEXT;
+  else if (msg.data == "binary")
+    m_protocol = PROTO_BINARY;
+  else
+  {
+    reply = Message(TAG_ERR, "Unknown protocol");
+    return true;
+  }
+  reply = Message(TAG_OK, msg.data.str());
+  return true;
+}
+
+bool Session::handle_login(const MessageView &msg, Message &reply)
+{
+  //validate login tag
+  if (msg.tag != TAG_SLOGIN && msg.tag != TAG_RLOGIN)
+  {
+    reply = Message(TAG_ERR, "Invalid login tag");
+    return false;
+  }
+
+  //validate username
+  if (!is_valid_name(msg.data))
+  {
+    reply = Message(TAG_ERR, "Invalid username");
+    return false;
+  }
+
+  const ServerConfig &config = m_server->get_config();
+  m_user = new User(msg.data.str(), MessageQueue::create(config.queue_kind,
+                                                   config.queue_capacity,
+                                                   config.overflow_policy));
+  if (msg.tag == TAG_RLOGIN)
+  {
+    //receiver must join a room next
+    m_state = JOIN;
+    reply = Message(TAG_OK, "Logged in as receiver");
+  }
+  else
+  {
+    //sender starts with no room
+    m_state = SENDING;
+    reply = Message(TAG_OK, "Logged in as sender");
+  }
+  return true;
+}
+
+bool Session::handle_join(const MessageView &msg, Message &reply)
+{
+  if (msg.tag != TAG_JOIN)
+  {
+    reply = Message(TAG_ERR, "Expected join message");
+    return false;
+  }
+
+  //validate room names
+  std::vector<std::string> patterns;
+  if (!parse_rooms(msg.data, patterns))
+  {
+    reply = Message(TAG_ERR, "Invalid room name");
+    return false;
+  }
+
+  //join rooms
+  m_subscription = new Subscription(m_user);
+  for (const std::string &pattern : patterns)
+    m_server->subscribe(m_subscription, pattern, m_server->get_config().replay_messages, &m_replay);
+
+  //a direct message from a sender in no room comes as from the first
+  //room named, or failing that, the first room a pattern matched (a
+  //receiver whose patterns matched nothing yet can't be sent one)
+  std::string dm_room = m_subscription->get_first_room();
+  for (const std::string &pattern : patterns)
+  {
+    if (pattern.back() != '*')
+    {
+      dm_room = pattern;
+      break;
+    }
+  }
+  m_server->get_users()->add(m_user, dm_room);
+  m_state = RECEIVING;
+  reply = Message(TAG_OK, "Joined room");
+  return true;
+}
+
+bool Session::handle_sender(const MessageView &msg, Message &reply)
+{
+  //check for empty tag (invalid message)
+  if (msg.tag.empty())
+  {
+    reply = Message(TAG_ERR, "Invalid message format");
+  }
+  else if (msg.tag == TAG_SENDALL)
+  {
+    if (!m_room)
+    {
+      reply = Message(TAG_ERR, "Not in a room");
+      return true;
+    }
+    //the delivery must fit in a binary message ("room:sender:text")
+    if (m_room->get_room_name().size() + m_user->username.size() + 2 + msg.data.len > Message::MAX_BINARY_LEN)
+    {
+      reply = Message(TAG_ERR, "Message too long");
+      return true;
+    }
+    //with a message log, the message is appended before it is sent,
+    //but only the reply waits for it to be flushed (receivers can get
+    //a message a crash then loses)
+    MessageLog *log = m_server->get_log();
+    if (log)
+    {
+      m_durable_lsn = log->append(m_room->get_room_name(), m_user->username, msg.data);
+      if (!m_durable_lsn)
+      {
+        reply = Message(TAG_ERR, "Could not save message");
+        return true;
+      }
+    }
+    m_room->broadcast_message(m_user->username, msg.data);
+    reply = Message(TAG_OK, "Message sent");
+  }
+  else if (msg.tag == TAG_SENDUSER)
+  {
+    handle_senduser(msg, reply);
+  }
+  else if (msg.tag == TAG_JOIN)
+  {
+    if (!is_valid_name(msg.data))
+    {
+      reply = Message(TAG_ERR, "Invalid room name");
+      return true;
+    }
+    //senders don't need to be removed from their old room
+    //(only receivers are members), so just switch rooms (joining the
+    //new one first, so rejoining the same room doesn't remove it)
+    Room *room = m_server->find_or_create_room(msg.data.str());
+    if (m_room)
+      m_server->release_room(m_room);
+    m_room = room;
+    reply = Message(TAG_OK, "Joined room");
+  }
+  else if (msg.tag == TAG_LEAVE)
+  {
+    if (!m_room)
+    {
+      //if not in room to leave, error
+      reply = Message(TAG_ERR, "Not in a room");
+      return true;
+    }
+    m_server->release_room(m_room);
+    m_room = nullptr;
+    reply = Message(TAG_OK, "Left room");
+  }
+  else if (msg.tag == TAG_QUIT)
+  {
+    reply = Message(TAG_OK, "Goodbye");
+    return false;
+  }
+  else
+  {
+    //if none of above tags, unknown command
+    reply = Message(TAG_ERR, "Unknown command");
+  }
+  return true;
+}
+
+void Session::handle_senduser(const MessageView &msg, Message &reply)
+{
+  //the data is "recipient:text"
+  const char *colon = static_cast<const char *>(memchr(msg.data.data, ':', msg.data.len));
+  if (!colon)
+  {
+    reply = Message(TAG_ERR, "Invalid message format");
+    return;
+  }
+  Slice recipient(msg.data.data, colon - msg.data.data);
+  Slice text(colon + 1, msg.data.len - recipient.len - 1);
+  if (!is_valid_name(recipient))
+  {
+    reply = Message(TAG_ERR, "Invalid username");
+    return;
+  }
+
+  //in a room, the message goes to the user in that room; otherwise to
+  //the user wherever it is (as a delivery from the user's room, which
+  //the directory checks it fits with)
+  size_t room_len = m_room ? m_room->get_room_name().size() : 0;
+  if (room_len + m_user->username.size() + 2 + text.len > Message::MAX_BINARY_LEN)
+  {
+    reply = Message(TAG_ERR, "Message too long");
+    return;
+  }
+  size_t delivered;
+  if (m_room)
+    delivered = m_room->send_to_user(m_user->username, recipient.str(), text);
+  else
+    delivered = m_server->get_users()->send(m_user->username, recipient.str(), text);
+
+  if (delivered == 0)
+    reply = Message(TAG_ERR, m_room ? "User not in room" : "No such user");
+  else
+    reply = Message(TAG_OK, "Message sent");
+}
+
+void ReplyBatch::add(const Session &session, const Message &reply)
+{
+  if (m_count == m_replies.size())
+    m_replies.push_back(reply);
+  else
+  {
+    m_replies[m_count].tag = reply.tag;
+    m_replies[m_count].data = reply.data;
+  }
+  if (session.get_durable_lsn())
+  {
+    m_logged.push_back(m_count);
+    m_lsn = session.get_durable_lsn();
+  }
+  m_count++;
+}
+
+void ReplyBatch::set_failed()
+{
+  for (size_t i : m_logged)
+    m_replies[i] = Message(TAG_ERR, "Could not save message");
+}
+
+void ReplyBatch::clear()
+{
+  m_count = 0;
+  m_logged.clear();
+  m_lsn = 0;
+}
@@ -0,0 +1,122 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "message.h"
+struct User;
+class Frame;
+class Room;
+class Server;
+class Subscription;
+
+// A Session is the protocol state machine for one connected client
+// (slogin/rlogin, join, sendall, senduser, leave, quit). It doesn't do any I/O
+// itself: the server engine (thread-per-client or epoll) feeds it each
+// message received from the client and sends back the reply it produces,
+// so both engines implement exactly the same protocol.
+class Session {
+public:
+  enum State {
+    LOGIN,     // waiting for slogin or rlogin
+    JOIN,      // receiver logged in, waiting for its join message
+    RECEIVING, // receiver is a member of its rooms, deliveries flow to it
+    SENDING,   // sender logged in, processing commands
+  };
+
+  Session(Server *server);
+
+  // Destructor: removes a receiver from its rooms and releases the User
+  ~Session();
+
+  // handle a message received from the client, filling in the reply
+  // that should be sent back; returns false if the connection should
+  // be closed once the reply has been sent (msg only needs to remain
+  // valid during the call)
+  bool handle(const MessageView &msg, Message &reply);
+
+  // handle a message from the client that could not be parsed
+  bool handle_invalid(Message &reply);
+
+  State get_state() const { return m_state; }
+
+  // the protocol the client asked for; the engine should switch the
+  // connection to it once it has sent the reply to the current message
+  Protocol get_protocol() const { return m_protocol; }
+
+  // if not 0, the message just handled was appended to the server's
+  // message log, and the reply mustn't be sent until the log is
+  // durable up to this position (see MessageLog::wait)
+  uint64_t get_durable_lsn() const { return m_durable_lsn; }
+
+  // the messages to replay to a receiver that has just joined its
+  // room (see ServerConfig::replay_messages): the engine should send
+  // them after the reply to the join, before any deliveries; the
+  // caller takes over the references to the frames
+  void take_replay(std::vector<Frame *> &frames) { frames.swap(m_replay); }
+
+  User *get_user() const { return m_user; }
+  Room *get_room() const { return m_room; }
+
+private:
+  // prohibit value semantics
+  Session(const Session &);
+  Session &operator=(const Session &);
+
+  bool handle_proto(const MessageView &msg, Message &reply);
+  bool handle_login(const MessageView &msg, Message &reply);
+  bool handle_join(const MessageView &msg, Message &reply);
+  bool handle_sender(const MessageView &msg, Message &reply);
+  void handle_senduser(const MessageView &msg, Message &reply);
+
+  Server *m_server;
+  State m_state;
+  Protocol m_protocol;
+  User *m_user;
+  Room *m_room; // a sender's current room, which the session holds a
+                // reference to
+  Subscription *m_subscription; // the rooms a receiver has joined
+  std::vector<Frame *> m_replay;
+  uint64_t m_durable_lsn;
+};
+
+// Replies an engine holds back to send together: the replies to
+// requests a client has pipelined (sent without waiting for the reply
+// to the one before), and replies that have to wait until the message
+// log is durable. Waiting once for the last message of a batch to be
+// on disk covers every message before it, so a pipelined sender's
+// messages share flushes.
+class ReplyBatch {
+public:
+  ReplyBatch() : m_count(0), m_lsn(0) { }
+
+  // an engine sends a batch once it has this many replies
+  enum { MAX_SIZE = 64 };
+
+  // add the reply to the request the session has just handled
+  void add(const Session &session, const Message &reply);
+
+  bool empty() const { return m_count == 0; }
+  size_t size() const { return m_count; }
+  const Message *get_replies() const { return m_replies.data(); }
+
+  // the replies can't be sent until the log is durable this far (0 if
+  // they needn't wait)
+  uint64_t get_durable_lsn() const { return m_lsn; }
+
+  // the log couldn't be flushed: the replies to the messages that
+  // were saved in it become errors
+  void set_failed();
+
+  // empty the batch (keeping the replies' memory for reuse)
+  void clear();
+
+private:
+  std::vector<Message> m_replies; // the first m_count are in use
+  std::vector<size_t> m_logged;   // indexes of replies to saved messages
+  size_t m_count;
+  uint64_t m_lsn;
+};
+
+#endif // SESSION_H
@@ -0,0 +1,56 @@
+#include <algorithm>
+#include "guard.h"
+#include "room.h"
+#include "subscription.h"
+
+Subscription::Subscription(User *user)
+    : m_user(user), m_closed(false)
+{
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+Subscription::~Subscription()
+{
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool Subscription::add_room(Room *room, size_t replay, std::vector<Frame *> *replay_frames)
+{
+  //joining under the lock means close can't return until the user is
+  //in every room it will have to be removed from
+  Guard g(m_lock);
+  if (m_closed || !m_rooms.insert(room).second)
+    return false;
+  room->add_member(m_user, replay, replay_frames);
+  if (m_first_room.empty())
+    m_first_room = room->get_room_name();
+  return true;
+}
+
+void Subscription::close(std::vector<Room *> &rooms)
+{
+  Guard g(m_lock);
+  m_closed = true;
+  rooms.assign(m_rooms.begin(), m_rooms.end());
+  m_rooms.clear();
+}
+
+size_t Subscription::get_num_rooms() const
+{
+  Guard g(m_lock);
+  return m_rooms.size();
+}
+
+std::string Subscription::get_first_room() const
+{
+  Guard g(m_lock);
+  return m_first_room;
+}
+
+bool Subscription::add_prefix(const std::string &prefix)
+{
+  if (std::find(m_prefixes.begin(), m_prefixes.end(), prefix) != m_prefixes.end())
+    return false;
+  m_prefixes.push_back(prefix);
+  return true;
+}
@@ -0,0 +1,63 @@
+#ifndef SUBSCRIPTION_H
+#define SUBSCRIPTION_H
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <pthread.h>
+struct User;
+class Room;
+class Frame;
+
+// The rooms a receiver gets messages from: the ones it joined by name,
+// and those whose names match the patterns it subscribed to, which
+// are added as they are created, by whichever thread creates them
+// (see RoomRegistry::subscribe). The user is a member of each room,
+// so they all deliver into its one queue, and the subscription holds
+// a reference to each room until RoomRegistry::unsubscribe gives them
+// back.
+class Subscription {
+public:
+  // the user must outlive the subscription
+  Subscription(User *user);
+  ~Subscription();
+
+  User *get_user() const { return m_user; }
+
+  // make the user a member of a room the caller holds a reference to,
+  // and take over the reference; returns false (leaving the caller
+  // with the reference) if the subscription already has the room, or
+  // has been closed. replay is as for Room::add_member.
+  bool add_room(Room *room, size_t replay = 0, std::vector<Frame *> *replay_frames = nullptr);
+
+  // take no more rooms, and hand over the ones taken (with their
+  // references), whose member the user still is
+  void close(std::vector<Room *> &rooms);
+
+  size_t get_num_rooms() const;
+
+  // the name of the first room the subscription was given (empty if
+  // it hasn't been given any)
+  std::string get_first_room() const;
+
+  // the prefixes of the patterns subscribed to, which are only
+  // changed by the thread subscribing (add_prefix returns false if
+  // the prefix was already there)
+  bool add_prefix(const std::string &prefix);
+  const std::vector<std::string> &get_prefixes() const { return m_prefixes; }
+
+private:
+  // prohibit value semantics
+  Subscription(const Subscription &);
+  Subscription &operator=(const Subscription &);
+
+  User *m_user;
+  std::vector<std::string> m_prefixes;
+
+  mutable pthread_mutex_t m_lock;
+  std::unordered_set<Room *> m_rooms;
+  std::string m_first_room;
+  bool m_closed;
+};
+
+#endif // SUBSCRIPTION_H
@@ -0,0 +1,55 @@
+#include <algorithm>
+#include "subscription_trie.h"
+
+void SubscriptionTrie::add(const std::string &prefix, Subscription *sub)
+{
+  Node *node = &m_root;
+  for (char c : prefix)
+  {
+    Node *&child = node->children[c];
+    if (!child)
+      child = new Node;
+    node = child;
+  }
+  if (std::find(node->subs.begin(), node->subs.end(), sub) == node->subs.end())
+    node->subs.push_back(sub);
+}
+
+void SubscriptionTrie::remove(const std::string &prefix, Subscription *sub)
+{
+  //find the path down to the prefix's node
+  std::vector<Node *> path(1, &m_root);
+  for (char c : prefix)
+  {
+    std::map<char, Node *>::iterator child = path.back()->children.find(c);
+    if (child == path.back()->children.end())
+      return;
+    path.push_back(child->second);
+  }
+
+  std::vector<Subscription *> &subs = path.back()->subs;
+  std::vector<Subscription *>::iterator i = std::find(subs.begin(), subs.end(), sub);
+  if (i == subs.end())
+    return;
+  subs.erase(i);
+
+  //then prune the nodes left with nothing below them, bottom up
+  for (size_t depth = prefix.size(); depth > 0; depth--)
+  {
+    Node *node = path[depth];
+    if (!node->subs.empty() || !node->children.empty())
+      break;
+    path[depth - 1]->children.erase(prefix[depth - 1]);
+    delete node;
+  }
+}
+
+void SubscriptionTrie::clear(Node *node)
+{
+  for (auto &child : node->children)
+  {
+    clear(child.second);
+    delete child.second;
+  }
+  node->children.clear();
+}
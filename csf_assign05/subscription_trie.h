@@ -0,0 +1,64 @@
+#ifndef SUBSCRIPTION_TRIE_H
+#define SUBSCRIPTION_TRIE_H
+
+#include <string>
+#include <vector>
+#include <map>
+class Subscription;
+
+// The receivers' pattern subscriptions ("prefix*"), indexed by prefix
+// in a trie over room names, so finding every subscription a room's
+// name matches takes one walk down the trie along the name: a step
+// per character, plus the subscriptions found on the way, however
+// many patterns there are in all. A node is only kept while it (or a
+// node below it) has subscriptions.
+//
+// The trie isn't synchronized (RoomRegistry locks it).
+class SubscriptionTrie {
+public:
+  SubscriptionTrie() { }
+  ~SubscriptionTrie() { clear(&m_root); }
+
+  // add a subscription to a prefix (if it isn't already subscribed)
+  void add(const std::string &prefix, Subscription *sub);
+
+  // remove a subscription from a prefix it was added to
+  void remove(const std::string &prefix, Subscription *sub);
+
+  // call fn(sub) for every subscription to a prefix of name (including
+  // the empty prefix, and name itself)
+  template <typename Fn> void for_each_match(const std::string &name, Fn fn) const;
+
+private:
+  // prohibit value semantics
+  SubscriptionTrie(const SubscriptionTrie &);
+  SubscriptionTrie &operator=(const SubscriptionTrie &);
+
+  struct Node {
+    std::vector<Subscription *> subs; // subscribed to this node's prefix
+    std::map<char, Node *> children;
+  };
+
+  static void clear(Node *node); // delete the nodes below node
+
+  Node m_root;
+};
+
+template <typename Fn>
+void SubscriptionTrie::for_each_match(const std::string &name, Fn fn) const
+{
+  const Node *node = &m_root;
+  for (size_t i = 0; ; i++)
+  {
+    for (Subscription *sub : node->subs)
+      fn(sub);
+    if (i == name.size())
+      break;
+    std::map<char, Node *>::const_iterator child = node->children.find(name[i]);
+    if (child == node->children.end())
+      break;
+    node = child->second;
+  }
+}
+
+#endif // SUBSCRIPTION_TRIE_H
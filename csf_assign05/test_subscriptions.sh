@@ -0,0 +1,84 @@
+#!/bin/bash
+
+# Usage: ./test_subscriptions.sh [port] [server options...]
+#
+# Checks that a receiver subscribed to room patterns gets direct
+# messages (from a sender in no room) as from a room it actually
+# joined: the first room it named, or else the first room a pattern
+# matched, and that a receiver whose patterns matched no room isn't
+# sent one (the sender gets an error instead).
+
+PORT=$1
+shift
+TEMP_DIR="/tmp/subs${RANDOM}"
+SERVER_PID=0
+declare -a CLIENT_PIDS
+
+cleanup() {
+    local PID=0
+    for PID in "${CLIENT_PIDS[@]}"; do
+        kill ${PID} > /dev/null 2>&1
+        wait ${PID} 2> /dev/null
+    done
+    if [[ ${SERVER_PID} -ne 0 ]]; then
+        kill ${SERVER_PID} > /dev/null 2>&1
+        wait ${SERVER_PID} 2> /dev/null
+    fi
+    rm -rf ${TEMP_DIR}
+}
+
+if [[ -z ${PORT} ]]; then
+    echo "Usage: ${0} [port] [server options...]"
+    exit 1
+fi
+
+mkdir -p ${TEMP_DIR}
+./server "$@" ${PORT} 2> /dev/null &
+SERVER_PID=$!
+sleep 0.5
+
+# the sender keeps room "metrics" around while the receivers join, then
+# leaves it and sends each of them a direct message
+{
+    echo "/join metrics"
+    sleep 1.5
+    echo "/leave"
+    echo "/senduser bob dm1"
+    echo "/senduser carol dm2"
+    echo "/senduser dave dm3"
+    sleep 0.5
+    echo "/quit"
+} | ./sender localhost ${PORT} alice > /dev/null 2> ${TEMP_DIR}/alice.err &
+CLIENT_PIDS+=($!)
+sleep 0.5
+
+stdbuf -oL ./receiver localhost ${PORT} bob "met*,lobby" > ${TEMP_DIR}/bob.out 2>&1 &
+CLIENT_PIDS+=($!)
+stdbuf -oL ./receiver localhost ${PORT} carol "met*" > ${TEMP_DIR}/carol.out 2>&1 &
+CLIENT_PIDS+=($!)
+stdbuf -oL ./receiver localhost ${PORT} dave "zzz*" > ${TEMP_DIR}/dave.out 2>&1 &
+CLIENT_PIDS+=($!)
+sleep 2.5
+
+FAILED=0
+check() {
+    local NAME=$1
+    local EXPECTED=$2
+    local ACTUAL
+    ACTUAL=$(cat ${TEMP_DIR}/${NAME})
+    if [[ "${ACTUAL}" != "${EXPECTED}" ]]; then
+        echo "${NAME}: expected '${EXPECTED}', got '${ACTUAL}'"
+        FAILED=1
+    fi
+}
+check bob.out "[lobby] alice: dm1"
+check carol.out "[metrics] alice: dm2"
+check dave.out ""
+check alice.err "No such user"
+
+cleanup
+if [[ ${FAILED} -ne 0 ]]; then
+    echo "Test failed!"
+    exit 1
+fi
+echo "Tests passed successfully!"
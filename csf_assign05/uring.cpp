@@ -0,0 +1,208 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+namespace
+{
+
+  int io_uring_setup(unsigned entries, io_uring_params *params)
+  {
+    return syscall(__NR_io_uring_setup, entries, params);
+  }
+
+  int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+  {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+  }
+
+  int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+  {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+  }
+
+}
+
+Ring::Ring()
+    : m_fd(-1), m_sq_ptr(MAP_FAILED), m_sq_size(0), m_cq_ptr(MAP_FAILED), m_cq_size(0),
+      m_sqes(static_cast<io_uring_sqe *>(MAP_FAILED)), m_to_submit(0),
+      m_buf_ring(static_cast<io_uring_buf_ring *>(MAP_FAILED)), m_buf_ring_size(0),
+      m_buffers(nullptr), m_buf_count(0), m_buf_size(0), m_buf_tail(0)
+{
+  memset(&m_params, 0, sizeof(m_params));
+}
+
+Ring::~Ring()
+{
+  if (m_buf_ring != MAP_FAILED)
+    munmap(m_buf_ring, m_buf_ring_size);
+  free(m_buffers);
+  if (m_sqes != MAP_FAILED)
+    munmap(m_sqes, m_params.sq_entries * sizeof(io_uring_sqe));
+  if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+    munmap(m_cq_ptr, m_cq_size);
+  if (m_sq_ptr != MAP_FAILED)
+    munmap(m_sq_ptr, m_sq_size);
+  if (m_fd >= 0)
+    close(m_fd);
+}
+
+bool Ring::init(unsigned entries)
+{
+  //multishot receives can complete many times per submission, so the
+  //completion queue is made bigger than usual (the kernel also holds
+  //on to completions that overflow it, rather than dropping them)
+  m_params.flags = IORING_SETUP_CQSIZE;
+  m_params.cq_entries = entries * 8;
+  m_fd = io_uring_setup(entries, &m_params);
+  if (m_fd < 0)
+    return false;
+  if (!(m_params.features & IORING_FEAT_NODROP))
+    return false;
+
+  //the submission and completion rings (one mapping, on kernels that
+  //support it), and the submission queue entries
+  m_sq_size = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned);
+  m_cq_size = m_params.cq_off.cqes + m_params.cq_entries * sizeof(io_uring_cqe);
+  bool single = m_params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && m_cq_size > m_sq_size)
+    m_sq_size = m_cq_size;
+  m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  m_fd, IORING_OFF_SQ_RING);
+  if (m_sq_ptr == MAP_FAILED)
+    return false;
+  if (single)
+    m_cq_ptr = m_sq_ptr;
+  else
+  {
+    m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    m_fd, IORING_OFF_CQ_RING);
+    if (m_cq_ptr == MAP_FAILED)
+      return false;
+  }
+  m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, m_params.sq_entries * sizeof(io_uring_sqe),
+                                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            m_fd, IORING_OFF_SQES));
+  if (m_sqes == MAP_FAILED)
+    return false;
+
+  char *sq = static_cast<char *>(m_sq_ptr);
+  m_sq_head = reinterpret_cast<unsigned *>(sq + m_params.sq_off.head);
+  m_sq_tail = reinterpret_cast<unsigned *>(sq + m_params.sq_off.tail);
+  m_sq_mask = *reinterpret_cast<unsigned *>(sq + m_params.sq_off.ring_mask);
+  m_sq_array = reinterpret_cast<unsigned *>(sq + m_params.sq_off.array);
+  char *cq = static_cast<char *>(m_cq_ptr);
+  m_cq_head = reinterpret_cast<unsigned *>(cq + m_params.cq_off.head);
+  m_cq_tail = reinterpret_cast<unsigned *>(cq + m_params.cq_off.tail);
+  m_cq_mask = *reinterpret_cast<unsigned *>(cq + m_params.cq_off.ring_mask);
+  m_cqes = reinterpret_cast<io_uring_cqe *>(cq + m_params.cq_off.cqes);
+
+  //entry i of the array always names submission queue entry i
+  for (unsigned i = 0; i < m_params.sq_entries; i++)
+    m_sq_array[i] = i;
+  return true;
+}
+
+bool Ring::init_buffers(unsigned count, unsigned size, uint16_t group_id)
+{
+  m_buf_ring_size = count * sizeof(io_uring_buf);
+  m_buf_ring = static_cast<io_uring_buf_ring *>(mmap(nullptr, m_buf_ring_size,
+                                                     PROT_READ | PROT_WRITE,
+                                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (m_buf_ring == MAP_FAILED)
+    return false;
+  if (posix_memalign(reinterpret_cast<void **>(&m_buffers), 4096, (size_t)count * size) != 0)
+  {
+    m_buffers = nullptr;
+    return false;
+  }
+
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(m_buf_ring);
+  reg.ring_entries = count;
+  reg.bgid = group_id;
+  m_buf_count = count;
+  if (io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return false;
+  m_buf_size = size;
+
+  //hand the kernel every buffer
+  for (unsigned i = 0; i < count; i++)
+  {
+    io_uring_buf &buf = get_ring_buf(i);
+    buf.addr = reinterpret_cast<uint64_t>(m_buffers + (size_t)i * size);
+    buf.len = size;
+    buf.bid = i;
+  }
+  m_buf_tail = count;
+  __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+  return true;
+}
+
+io_uring_sqe *Ring::get_sqe()
+{
+  unsigned tail = *m_sq_tail;
+  if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_params.sq_entries)
+  {
+    //full: make room by submitting what's queued
+    submit(0);
+    if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_params.sq_entries)
+      return nullptr;
+  }
+  io_uring_sqe *sqe = &m_sqes[tail & m_sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  m_to_submit++;
+  return sqe;
+}
+
+bool Ring::submit(unsigned wait_nr)
+{
+  //the entries are filled in by the time this is called, though the
+  //tail was advanced when they were handed out (nothing reads the
+  //queue until io_uring_enter)
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (true)
+  {
+    int rc = io_uring_enter(m_fd, m_to_submit, wait_nr, flags);
+    if (rc >= 0)
+    {
+      m_to_submit -= rc;
+      return true;
+    }
+    if (errno == EINTR)
+      continue;
+    //busy (the completion queue is backed up): the caller has to reap
+    //completions before submitting more
+    return errno == EBUSY || errno == EAGAIN;
+  }
+}
+
+io_uring_buf &Ring::get_ring_buf(unsigned index)
+{
+  //the ring is an array of io_uring_bufs (the first one's reserved
+  //field doubling as the tail); io_uring_buf_ring::bufs can't be used
+  //from C++, where the header's flexible array member comes after an
+  //empty struct that takes up space
+  return reinterpret_cast<io_uring_buf *>(m_buf_ring)[index & (m_buf_count - 1)];
+}
+
+char *Ring::get_buffer(const io_uring_cqe *cqe) const
+{
+  return m_buffers + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * m_buf_size;
+}
+
+void Ring::return_buffer(const io_uring_cqe *cqe)
+{
+  unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  io_uring_buf &buf = get_ring_buf(m_buf_tail);
+  buf.addr = reinterpret_cast<uint64_t>(m_buffers + (size_t)id * m_buf_size);
+  buf.len = m_buf_size;
+  buf.bid = id;
+  m_buf_tail++;
+  __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
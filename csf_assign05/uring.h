@@ -0,0 +1,89 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <linux/io_uring.h>
+
+// A minimal io_uring instance, set up with the raw system calls (so
+// the server needs no liburing): a submission queue to fill in with
+// get_sqe, submitted (and waited on) with one io_uring_enter per call
+// to submit, and a completion queue read with for_each_completion.
+//
+// It can also register a ring of equally sized buffers with the
+// kernel (a "provided buffer ring"), which a recv with
+// IOSQE_BUFFER_SELECT picks a buffer from only once data arrives, so
+// any number of idle connections can each have a recv outstanding
+// without each having a buffer of its own.
+//
+// A Ring is only used by one thread.
+class Ring {
+public:
+  Ring();
+  ~Ring();
+
+  // create the ring with room for (at least) entries submissions,
+  // returns false if io_uring isn't available
+  bool init(unsigned entries);
+
+  // register count buffers of size bytes (count a power of 2) as
+  // buffer group group_id, returns false on error
+  bool init_buffers(unsigned count, unsigned size, uint16_t group_id);
+
+  // a cleared submission queue entry to fill in, submitting what's
+  // queued first if the queue is full
+  io_uring_sqe *get_sqe();
+
+  // submit the queued entries, and wait until at least wait_nr
+  // completions are ready; returns false on error (other than EINTR)
+  bool submit(unsigned wait_nr);
+
+  // call fn(cqe) for every completion ready, then mark them consumed;
+  // returns how many there were
+  template <typename Fn> unsigned for_each_completion(Fn fn);
+
+  // the buffer a completion's data was received into (with
+  // IORING_CQE_F_BUFFER set), and giving it back to the kernel
+  char *get_buffer(const io_uring_cqe *cqe) const;
+  void return_buffer(const io_uring_cqe *cqe);
+
+private:
+  // prohibit value semantics
+  Ring(const Ring &);
+  Ring &operator=(const Ring &);
+
+  io_uring_buf &get_ring_buf(unsigned index);
+
+  int m_fd;
+  io_uring_params m_params;
+
+  void *m_sq_ptr;
+  size_t m_sq_size;
+  void *m_cq_ptr;
+  size_t m_cq_size;
+  io_uring_sqe *m_sqes;
+  unsigned *m_sq_head, *m_sq_tail, m_sq_mask, *m_sq_array;
+  unsigned *m_cq_head, *m_cq_tail, m_cq_mask;
+  io_uring_cqe *m_cqes;
+  unsigned m_to_submit; // entries queued since the last submit
+
+  io_uring_buf_ring *m_buf_ring;
+  size_t m_buf_ring_size;
+  char *m_buffers;
+  unsigned m_buf_count, m_buf_size;
+  uint16_t m_buf_tail;
+};
+
+template <typename Fn>
+unsigned Ring::for_each_completion(Fn fn)
+{
+  unsigned head = *m_cq_head;
+  unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+  unsigned count = tail - head;
+  for (; head != tail; head++)
+    fn(&m_cqes[head & m_cq_mask]);
+  __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+#endif // URING_H
@@ -2,15 +2,42 @@
 #define USER_H
 
 #include <string>
+#include <atomic>
 #include "message_queue.h"
+#include "pool.h"
 
 struct User {
   std::string username;
 
   // queue of pending messages awaiting delivery
-  MessageQueue mqueue;
+  MessageQueue *mqueue;
 
-  User(const std::string &username) : username(username) { }
+  // the User takes ownership of the queue, and starts out with a
+  // reference count of 1
+  User(const std::string &username, MessageQueue *mqueue)
+    : username(username), mqueue(mqueue), refcount(1) { }
+
+  // reference counting: a room's member list holds a reference to each
+  // member, so a broadcast can still be enqueueing into a receiver's
+  // queue after the receiver has left the room
+  void ref() { refcount.fetch_add(1, std::memory_order_relaxed); }
+  void unref()
+  {
+    if (refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete this;
+  }
+
+  static void *operator new(size_t size) { return Pool::allocate(size); }
+  static void operator delete(void *p, size_t size) { Pool::deallocate(p, size); }
+
+private:
+  ~User() { delete mqueue; }
+
+  std::atomic<int> refcount;
+
+  // prohibit value semantics
+  User(const User &);
+  User &operator=(const User &);
 };
 
 #endif // USER_H
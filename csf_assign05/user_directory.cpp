@@ -0,0 +1,80 @@
+#include <functional>
+#include "guard.h"
+#include "metrics.h"
+#include "message.h"
+#include "frame.h"
+#include "user.h"
+#include "user_directory.h"
+
+UserDirectory::UserDirectory()
+{
+  for (Stripe &stripe : m_stripes)
+    pthread_mutex_init(&stripe.lock, nullptr);
+}
+
+UserDirectory::~UserDirectory()
+{
+  for (Stripe &stripe : m_stripes)
+    pthread_mutex_destroy(&stripe.lock);
+}
+
+UserDirectory::Stripe &UserDirectory::stripe_for(const std::string &username)
+{
+  return m_stripes[std::hash<std::string>()(username) & (NUM_STRIPES - 1)];
+}
+
+void UserDirectory::add(User *user, const std::string &room_name)
+{
+  Stripe &stripe = stripe_for(user->username);
+  Entry entry = { user, room_name };
+  Guard g(stripe.lock);
+  stripe.users.emplace(user->username, entry);
+}
+
+void UserDirectory::remove(User *user)
+{
+  Stripe &stripe = stripe_for(user->username);
+  Guard g(stripe.lock);
+  auto range = stripe.users.equal_range(user->username);
+  for (auto i = range.first; i != range.second; ++i)
+  {
+    if (i->second.user == user)
+    {
+      stripe.users.erase(i);
+      return;
+    }
+  }
+}
+
+size_t UserDirectory::send(const std::string &sender_username, const std::string &recipient,
+                           const Slice &message_text)
+{
+  Stripe &stripe = stripe_for(recipient);
+  size_t fanout = 0, num_dropped = 0;
+  {
+    //enqueueing never blocks, so it can be done with the stripe locked
+    //(which keeps the users from going away meanwhile)
+    Guard g(stripe.lock);
+    auto range = stripe.users.equal_range(recipient);
+    for (auto i = range.first; i != range.second; ++i)
+    {
+      //the delivery must fit in a binary message ("room:sender:text")
+      if (i->second.room_name.empty())
+        continue;
+      if (i->second.room_name.size() + sender_username.size() + 2 + message_text.len > Message::MAX_BINARY_LEN)
+        continue;
+      Frame *frame = Frame::create_delivery(i->second.room_name, sender_username, message_text);
+      num_dropped += i->second.user->mqueue->enqueue(frame);
+      fanout++;
+    }
+  }
+
+  if (fanout > 0)
+  {
+    Metrics::add(Metrics::DIRECT_MESSAGES);
+    Metrics::add(Metrics::DELIVERIES_QUEUED, fanout);
+    Metrics::add(Metrics::DELIVERIES_DROPPED, num_dropped);
+    Metrics::add(Metrics::QUEUED_MESSAGES, (int64_t)fanout - (int64_t)num_dropped);
+  }
+  return fanout;
+}
@@ -0,0 +1,61 @@
+#ifndef USER_DIRECTORY_H
+#define USER_DIRECTORY_H
+
+#include <string>
+#include <unordered_map>
+#include <pthread.h>
+struct User;
+struct Slice;
+
+// The server's receivers, by username, so a sender that isn't in a room
+// can still send a message to a user (senduser) with a hash lookup
+// rather than a search of every room. The names are hashed into
+// NUM_STRIPES independently locked tables, so receivers joining and
+// leaving, and senders looking them up, rarely wait for each other.
+//
+// The directory doesn't hold references to the users: a receiver's
+// session removes its user before releasing it, and a message is
+// enqueued with the stripe locked.
+class UserDirectory {
+public:
+  UserDirectory();
+  ~UserDirectory();
+
+  // add a receiver that has joined the named room (or, if room_name
+  // is empty, none its direct messages could come as from)
+  void add(User *user, const std::string &room_name);
+
+  // remove a receiver (which must have been added)
+  void remove(User *user);
+
+  // send a message to every receiver with the given username (each as
+  // a delivery from its own room), returning how many it was sent to
+  // (a receiver without a room, or in a room whose name makes the
+  // delivery too long, is skipped)
+  size_t send(const std::string &sender_username, const std::string &recipient,
+              const Slice &message_text);
+
+private:
+  // prohibit value semantics
+  UserDirectory(const UserDirectory &);
+  UserDirectory &operator=(const UserDirectory &);
+
+  enum { NUM_STRIPES = 64 };
+
+  struct Entry {
+    User *user;
+    std::string room_name;
+  };
+
+  struct Stripe {
+    pthread_mutex_t lock;
+    std::unordered_multimap<std::string, Entry> users;
+    char pad[64]; // keep stripes off each other's cache lines
+  };
+
+  Stripe &stripe_for(const std::string &username);
+
+  Stripe m_stripes[NUM_STRIPES];
+};
+
+#endif // USER_DIRECTORY_H
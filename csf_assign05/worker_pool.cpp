@@ -0,0 +1,201 @@
+#include <cerrno>
+#include <ctime>
+#include <algorithm>
+#include "guard.h"
+#include "metrics.h"
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(size_t min_spare, size_t max_threads, size_t stack_size, size_t max_waiting)
+    : m_min_spare(std::min(min_spare, max_threads)), m_max_threads(max_threads), m_stack_size(stack_size),
+      m_max_waiting(max_waiting), m_num_threads(0), m_num_idle(0), m_stopping(false)
+{
+  pthread_mutex_init(&m_lock, nullptr);
+  //idle threads time out by the monotonic clock
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&m_task_ready, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&m_exited, nullptr);
+}
+
+WorkerPool::~WorkerPool()
+{
+  stop();
+  pthread_cond_destroy(&m_exited);
+  pthread_cond_destroy(&m_task_ready);
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool WorkerPool::start()
+{
+  for (size_t i = 0; i < m_min_spare; i++)
+  {
+    {
+      Guard g(m_lock);
+      m_num_threads++;
+      m_num_idle++;
+    }
+    if (!spawn())
+      return false;
+  }
+  return true;
+}
+
+bool WorkerPool::submit(TaskFn fn, void *arg)
+{
+  bool grow = false;
+  {
+    Guard g(m_lock);
+    if (m_stopping)
+      return false;
+
+    //each idle thread takes one of the queued tasks; a task beyond
+    //those needs a thread started for it (which only happens here if
+    //the spare threads have run out), or has to wait for one to finish
+    if (m_tasks.size() >= m_num_idle)
+    {
+      if (m_num_threads < m_max_threads)
+      {
+        m_num_threads++;
+        m_num_idle++;
+        grow = true;
+      }
+      else if (m_tasks.size() - m_num_idle >= m_max_waiting)
+        return false;
+    }
+    m_tasks.push_back(Task{fn, arg});
+    pthread_cond_signal(&m_task_ready);
+  }
+
+  if (!grow || spawn())
+    return true;
+
+  //the thread couldn't be started: unless an idle thread can still
+  //take the task (or one already has), take it back and refuse it
+  Guard g(m_lock);
+  if (m_tasks.size() <= m_num_idle)
+    return true;
+  auto it = std::find_if(m_tasks.begin(), m_tasks.end(),
+                         [fn, arg](const Task &task) { return task.fn == fn && task.arg == arg; });
+  if (it == m_tasks.end())
+    return true;
+  m_tasks.erase(it);
+  return false;
+}
+
+void WorkerPool::stop()
+{
+  {
+    Guard g(m_lock);
+    m_stopping = true;
+    pthread_cond_broadcast(&m_task_ready);
+    while (m_num_threads > 0)
+      pthread_cond_wait(&m_exited, &m_lock);
+  }
+  //a thread says it has exited just before it does: wait until it
+  //really has (with nothing of it left running, even its thread-local
+  //destructors) before the pool, or the server, goes away
+  join_finished();
+}
+
+size_t WorkerPool::get_num_threads() const
+{
+  Guard g(m_lock);
+  return m_num_threads;
+}
+
+size_t WorkerPool::get_num_busy() const
+{
+  Guard g(m_lock);
+  return m_num_threads - m_num_idle;
+}
+
+void *WorkerPool::run(void *arg)
+{
+  static_cast<WorkerPool *>(arg)->work();
+  return nullptr;
+}
+
+void WorkerPool::work()
+{
+  Metrics::add(Metrics::WORKER_THREADS);
+  pthread_mutex_lock(&m_lock);
+  while (true)
+  {
+    //wait for a task, giving up (if there are enough other spare
+    //threads) after a while without one
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += IDLE_TIMEOUT_MS / 1000;
+    bool timed_out = false;
+    while (m_tasks.empty() && !m_stopping && !timed_out)
+      timed_out = pthread_cond_timedwait(&m_task_ready, &m_lock, &deadline) == ETIMEDOUT;
+    if (m_tasks.empty() && (m_stopping || m_num_idle > m_min_spare))
+      break;
+    if (m_tasks.empty())
+      continue;
+
+    Task task = m_tasks.front();
+    m_tasks.pop_front();
+    m_num_idle--;
+
+    //keep min_spare threads waiting for the next tasks, so whoever
+    //submits them doesn't have to start threads
+    size_t grow = 0;
+    while (m_num_idle + grow < m_min_spare && m_num_threads + grow < m_max_threads && !m_stopping)
+      grow++;
+    m_num_threads += grow;
+    m_num_idle += grow;
+    pthread_mutex_unlock(&m_lock);
+
+    for (size_t i = 0; i < grow; i++)
+      spawn();
+    task.fn(task.arg);
+
+    pthread_mutex_lock(&m_lock);
+    m_num_idle++;
+  }
+
+  //once it says it has exited, stop can return (and the pool be
+  //destroyed) as soon as the lock is released, so that's the last
+  //thing done with it
+  Metrics::add(Metrics::WORKER_THREADS, -1);
+  m_num_threads--;
+  m_num_idle--;
+  m_finished.push_back(pthread_self());
+  pthread_cond_broadcast(&m_exited);
+  pthread_mutex_unlock(&m_lock);
+}
+
+bool WorkerPool::spawn()
+{
+  //the thread is already counted (as idle); threads that have exited
+  //since the last one started are joined first, so they don't pile up
+  join_finished();
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, m_stack_size);
+  pthread_t tid;
+  bool started = pthread_create(&tid, &attr, run, this) == 0;
+  pthread_attr_destroy(&attr);
+  if (!started)
+  {
+    Guard g(m_lock);
+    m_num_threads--;
+    m_num_idle--;
+    pthread_cond_broadcast(&m_exited);
+  }
+  return started;
+}
+
+void WorkerPool::join_finished()
+{
+  std::vector<pthread_t> finished;
+  {
+    Guard g(m_lock);
+    finished.swap(m_finished);
+  }
+  for (pthread_t tid : finished)
+    pthread_join(tid, nullptr);
+}
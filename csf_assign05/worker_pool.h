@@ -0,0 +1,78 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <deque>
+#include <vector>
+#include <cstddef>
+#include <pthread.h>
+
+// A pool of threads that each run one task at a time to completion
+// (the thread engine's client sessions, which block on their client
+// for as long as it stays connected). Threads are started ahead of
+// need, so handing the pool a task only queues it: whenever a thread
+// takes a task and leaves fewer than min_spare threads idle, it starts
+// another itself (up to max_threads) before running the task. Threads
+// idle for IDLE_TIMEOUT_MS exit again, down to min_spare. A thread
+// that has exited is joined the next time one is started, or by stop,
+// so none is still running once stop returns.
+//
+// The threads have stacks of stack_size bytes rather than the default
+// (usually 8MB), so what a client costs is small and predictable.
+//
+// Once max_threads threads are busy, up to max_waiting tasks wait for
+// one of them to finish; beyond that, submit turns tasks away, so the
+// server can refuse clients it has no thread to serve.
+class WorkerPool {
+public:
+  typedef void (*TaskFn)(void *arg);
+
+  WorkerPool(size_t min_spare, size_t max_threads, size_t stack_size, size_t max_waiting);
+  ~WorkerPool(); // calls stop
+
+  // start the first min_spare threads, false on error
+  bool start();
+
+  // have a thread run fn(arg), or return false (without running it)
+  // if the pool is saturated, or the thread it needed couldn't be
+  // started
+  bool submit(TaskFn fn, void *arg);
+
+  // wait for every task submitted to finish, and the threads to exit
+  void stop();
+
+  size_t get_num_threads() const;
+  size_t get_num_busy() const;
+
+private:
+  // prohibit value semantics
+  WorkerPool(const WorkerPool &);
+  WorkerPool &operator=(const WorkerPool &);
+
+  enum { IDLE_TIMEOUT_MS = 10000 };
+
+  struct Task {
+    TaskFn fn;
+    void *arg;
+  };
+
+  static void *run(void *arg);
+  void work();
+  bool spawn(); // start a thread already counted (as idle)
+  void join_finished();
+
+  size_t m_min_spare;
+  size_t m_max_threads;
+  size_t m_stack_size;
+  size_t m_max_waiting;
+
+  mutable pthread_mutex_t m_lock;
+  pthread_cond_t m_task_ready; // a task was queued, or the pool is stopping
+  pthread_cond_t m_exited;     // a thread has exited
+  std::deque<Task> m_tasks;    // waiting for a thread
+  std::vector<pthread_t> m_finished; // exited, but not joined yet
+  size_t m_num_threads;
+  size_t m_num_idle;
+  bool m_stopping;
+};
+
+#endif // WORKER_POOL_H